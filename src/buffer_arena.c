@@ -0,0 +1,252 @@
+/*
+ * buffer_arena.c - Slab allocator for chunk buffers and decompressors
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The decompressors, the chunk buffers of the resource pool, and the chunks in
+ * the shared cache are all a few KiB to a few tens of KiB in size.  Allocating
+ * them with malloc() scatters them around the heap, among the many small
+ * allocations NTFS-3G makes, and a mount which has opened and cached the chunks
+ * of many files fragments the heap badly.
+ *
+ * So they're allocated here instead, from slabs of SLAB_SIZE bytes which are
+ * mapped separately from the heap and aligned to their size.  Each slab is
+ * divided into blocks of one power-of-two size, so freed blocks can always be
+ * reused for the same kind of buffer, and a slab is unmapped as soon as all its
+ * blocks are free (except for one empty slab per size, kept to avoid mapping
+ * and unmapping a slab repeatedly).  The first page of each slab holds its
+ * header, which is found from a block's address by masking off the low bits.
+ *
+ * Optionally, the slabs are backed by transparent huge pages.  SLAB_SIZE is
+ * the usual huge page size, so each slab then takes a single TLB entry, which
+ * helps the decoders, whose tables and output are spread over many pages.  A
+ * slab backed by a huge page uses all of its memory as soon as it's touched,
+ * so this is disabled by default.
+ *
+ * Sizes too small to waste a block on, and sizes larger than the largest block,
+ * are allocated with malloc() as before.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <ntfs-3g/misc.h>
+
+#include "buffer_arena.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+#define SLAB_ORDER		21
+#define SLAB_SIZE		((size_t)1 << SLAB_ORDER)
+
+/* The size of the slab header, which is followed by the blocks  */
+#define SLAB_HEADER_SIZE	4096
+
+/* Blocks range in size from 1 KiB to 64 KiB.  */
+#define MIN_BLOCK_ORDER		10
+#define MAX_BLOCK_ORDER		16
+#define NUM_BLOCK_ORDERS	(MAX_BLOCK_ORDER - MIN_BLOCK_ORDER + 1)
+
+struct slab {
+	/* Neighbors in the list of slabs of the same block size which have free
+	 * blocks  */
+	struct slab *prev;
+	struct slab *next;
+
+	/* Blocks which were freed, linked through their first word  */
+	void *free_blocks;
+
+	/* The start of the blocks which have never been allocated.  These are
+	 * handed out in order, so memory that isn't needed is never touched.  */
+	u8 *next_unused;
+	unsigned num_unused;
+
+	/* The number of allocated blocks  */
+	unsigned num_used;
+};
+
+static struct {
+	pthread_mutex_t lock;
+
+	/* The slabs with free blocks  */
+	struct slab *partial;
+
+	/* The number of slabs whose blocks are all free  */
+	unsigned num_empty;
+} block_sizes[NUM_BLOCK_ORDERS] = {
+	[0 ... NUM_BLOCK_ORDERS - 1] = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	},
+};
+
+static int huge_pages_enabled;
+
+/* Enable or disable backing slabs by transparent huge pages.  This only affects
+ * slabs mapped after it's called.  */
+void
+buffer_arena_set_huge_pages(int enabled)
+{
+	huge_pages_enabled = enabled;
+}
+
+static forceinline int
+slab_is_full(const struct slab *slab)
+{
+	return !slab->free_blocks && !slab->num_unused;
+}
+
+static void
+list_add(struct slab **head, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head)
+		(*head)->prev = slab;
+	*head = slab;
+}
+
+static void
+list_remove(struct slab **head, struct slab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*head = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+/* Map a new slab with blocks of 2^@order bytes.  On failure, return NULL and
+ * set errno.  */
+static struct slab *
+map_slab(unsigned order)
+{
+	u8 *raw, *p;
+	struct slab *slab;
+
+	/* Map twice the size and trim the excess to align the slab.  */
+	raw = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		return NULL;
+	p = (u8 *)(((uintptr_t)raw + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+	if (p != raw)
+		munmap(raw, p - raw);
+	munmap(p + SLAB_SIZE, raw + SLAB_SIZE - p);
+
+#ifdef MADV_HUGEPAGE
+	if (huge_pages_enabled)
+		madvise(p, SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+
+	slab = (struct slab *)p;
+	slab->free_blocks = NULL;
+	slab->next_unused = p + SLAB_HEADER_SIZE;
+	slab->num_unused = (SLAB_SIZE - SLAB_HEADER_SIZE) >> order;
+	slab->num_used = 0;
+	return slab;
+}
+
+/*
+ * Allocate a buffer of @size bytes.  Buffers of more than 512 bytes are aligned
+ * to at least 1 KiB, and smaller ones are aligned as by malloc().  On failure,
+ * return NULL and set errno.
+ */
+void *
+buffer_arena_alloc(size_t size)
+{
+	unsigned order;
+	unsigned i;
+	struct slab *slab;
+	void *block;
+
+	if (size <= ((size_t)1 << (MIN_BLOCK_ORDER - 1)) ||
+	    size > ((size_t)1 << MAX_BLOCK_ORDER))
+		return ntfs_malloc(size);
+
+	order = max(ilog2_ceil(size), MIN_BLOCK_ORDER);
+	i = order - MIN_BLOCK_ORDER;
+
+	pthread_mutex_lock(&block_sizes[i].lock);
+	slab = block_sizes[i].partial;
+	if (!slab) {
+		slab = map_slab(order);
+		if (!slab) {
+			pthread_mutex_unlock(&block_sizes[i].lock);
+			return NULL;
+		}
+		list_add(&block_sizes[i].partial, slab);
+		block_sizes[i].num_empty++;
+	}
+
+	if (slab->free_blocks) {
+		block = slab->free_blocks;
+		slab->free_blocks = *(void **)block;
+	} else {
+		block = slab->next_unused;
+		slab->next_unused += (size_t)1 << order;
+		slab->num_unused--;
+	}
+	if (slab->num_used++ == 0)
+		block_sizes[i].num_empty--;
+	if (slab_is_full(slab))
+		list_remove(&block_sizes[i].partial, slab);
+	pthread_mutex_unlock(&block_sizes[i].lock);
+	return block;
+}
+
+/* Free a buffer allocated by buffer_arena_alloc() with the same @size.  */
+void
+buffer_arena_free(void *ptr, size_t size)
+{
+	unsigned i;
+	struct slab *slab;
+
+	if (!ptr)
+		return;
+
+	if (size <= ((size_t)1 << (MIN_BLOCK_ORDER - 1)) ||
+	    size > ((size_t)1 << MAX_BLOCK_ORDER)) {
+		free(ptr);
+		return;
+	}
+
+	i = max(ilog2_ceil(size), MIN_BLOCK_ORDER) - MIN_BLOCK_ORDER;
+	slab = (struct slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+
+	pthread_mutex_lock(&block_sizes[i].lock);
+	if (slab_is_full(slab))
+		list_add(&block_sizes[i].partial, slab);
+	*(void **)ptr = slab->free_blocks;
+	slab->free_blocks = ptr;
+	if (--slab->num_used == 0) {
+		if (block_sizes[i].num_empty) {
+			list_remove(&block_sizes[i].partial, slab);
+			munmap(slab, SLAB_SIZE);
+		} else {
+			block_sizes[i].num_empty++;
+		}
+	}
+	pthread_mutex_unlock(&block_sizes[i].lock);
+}
@@ -0,0 +1,21 @@
+/*
+ * buffer_arena.h
+ *
+ * Declarations for the slab allocator of chunk buffers and decompressors.
+ */
+
+#ifndef _BUFFER_ARENA_H
+#define _BUFFER_ARENA_H
+
+#include "common_defs.h"
+
+extern void
+buffer_arena_set_huge_pages(int enabled);
+
+extern void *
+buffer_arena_alloc(size_t size);
+
+extern void
+buffer_arena_free(void *ptr, size_t size);
+
+#endif /* _BUFFER_ARENA_H */
@@ -0,0 +1,347 @@
+/*
+ * chunk_cache.c - Cache of decompressed chunks shared across open files
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each decompression context remembers the last chunk it decompressed, but that
+ * doesn't help when many processes open the same file, since every open gets
+ * its own context.  This file implements a second level of caching: a
+ * size-bounded LRU cache of decompressed chunks, keyed by (MFT reference, chunk
+ * index), which is shared by all decompression contexts on the same volume.
+ *
+ * The MFT reference includes the MFT record's sequence number, so a chunk
+ * cached for a file that has since been deleted can never be returned for a
+ * different file that reuses the same MFT record.
+ *
+ * The chunks of WIMBoot files are instead cached per WIM, keyed by the offset
+ * of their resource in the WIM, since many files on many volumes may share a
+ * WIM, and files with the same data share a resource.
+ *
+ * A volume's cache is freed when the caller says the volume is being unmounted.
+ * Otherwise, a volume mounted later at the same address would get its chunks.
+ *
+ * Each cache has a lock, since reads of different files, or several reads of
+ * the same file, may run concurrently.  For the same reason, lookups copy the
+ * data out of the cache rather than returning a pointer into it, which another
+ * thread's insertion could free.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ntfs-3g/misc.h>
+
+#include "buffer_arena.h"
+#include "chunk_cache.h"
+
+/* The default maximum amount of decompressed data, in bytes, which each
+ * volume's cache may hold.  */
+#define DEFAULT_CACHE_SIZE	(16 << 20)
+
+/* Minimum and maximum numbers of hash buckets  */
+#define MIN_HASH_ORDER		6
+#define MAX_HASH_ORDER		20
+
+struct chunk_cache_entry {
+	/* Next entry in the same hash bucket  */
+	struct chunk_cache_entry *hash_next;
+
+	/* Neighbors in the LRU list.  The most recently used entry is at the
+	 * head.  */
+	struct chunk_cache_entry *lru_prev;
+	struct chunk_cache_entry *lru_next;
+
+	/* The key for this entry  */
+	u64 mref;
+	u64 chunk_idx;
+
+	/* The uncompressed size of the chunk, and its data  */
+	u32 size;
+	u8 *data;
+};
+
+struct chunk_cache {
+	/* Protects everything below except 'owner' and 'next'  */
+	pthread_mutex_t lock;
+
+	/* The volume or WIM this cache belongs to, and the next cache in the
+	 * list of all caches  */
+	const void *owner;
+	struct chunk_cache *next;
+
+	/* Hash table of entries, with 2^hash_order buckets  */
+	struct chunk_cache_entry **buckets;
+	unsigned hash_order;
+
+	/* LRU list  */
+	struct chunk_cache_entry *lru_head;
+	struct chunk_cache_entry *lru_tail;
+
+	/* Total size of the cached chunk data, and the limit on it  */
+	size_t cur_size;
+	size_t max_size;
+};
+
+/* The list of all caches, protected by 'all_caches_lock'  */
+static struct chunk_cache *all_caches;
+static pthread_mutex_t all_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t max_cache_size = DEFAULT_CACHE_SIZE;
+
+/*
+ * Set the maximum amount of decompressed data, in bytes, which each volume's
+ * chunk cache may hold.  0 disables the cache.  This only affects caches that
+ * haven't been created yet.
+ */
+void
+chunk_cache_set_max_size(size_t max_size)
+{
+	max_cache_size = max_size;
+}
+
+static forceinline size_t
+hash_key(const struct chunk_cache *cache, u64 mref, u64 chunk_idx)
+{
+	u64 h = (mref * 0x9E3779B97F4A7C15ULL) ^ chunk_idx;
+
+	return (h * 0x9E3779B97F4A7C15ULL) >> (64 - cache->hash_order);
+}
+
+/*
+ * Return the chunk cache for @owner, which is a volume or a WIM, creating it if
+ * needed.
+ * Return NULL if caching is disabled or if memory couldn't be allocated; the
+ * caller should then just proceed without the shared cache.
+ */
+struct chunk_cache *
+chunk_cache_get(const void *owner)
+{
+	struct chunk_cache *cache;
+	unsigned hash_order;
+
+	pthread_mutex_lock(&all_caches_lock);
+	for (cache = all_caches; cache; cache = cache->next)
+		if (cache->owner == owner)
+			goto out;
+
+	if (max_cache_size == 0)
+		goto out;
+
+	/* Size the hash table for the smallest possible chunks.  */
+	hash_order = ilog2_ceil(max_cache_size >> 12);
+	hash_order = max(hash_order, MIN_HASH_ORDER);
+	hash_order = min(hash_order, MAX_HASH_ORDER);
+
+	cache = ntfs_calloc(sizeof(*cache));
+	if (!cache)
+		goto out;
+	cache->buckets = ntfs_calloc(sizeof(cache->buckets[0]) << hash_order);
+	if (!cache->buckets) {
+		free(cache);
+		cache = NULL;
+		goto out;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->hash_order = hash_order;
+	cache->max_size = max_cache_size;
+	cache->owner = owner;
+	cache->next = all_caches;
+	all_caches = cache;
+out:
+	pthread_mutex_unlock(&all_caches_lock);
+	return cache;
+}
+
+static void
+lru_remove(struct chunk_cache *cache, struct chunk_cache_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void
+lru_add_head(struct chunk_cache *cache, struct chunk_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+static void
+free_entry(struct chunk_cache_entry *entry)
+{
+	buffer_arena_free(entry->data, entry->size);
+	free(entry);
+}
+
+/*
+ * Free the chunk cache for @owner, if it has one.  No decompression context may
+ * be using the cache.
+ */
+void
+chunk_cache_free(const void *owner)
+{
+	struct chunk_cache **pp, *cache;
+
+	pthread_mutex_lock(&all_caches_lock);
+	for (pp = &all_caches; (cache = *pp); pp = &cache->next)
+		if (cache->owner == owner)
+			break;
+	if (cache)
+		*pp = cache->next;
+	pthread_mutex_unlock(&all_caches_lock);
+	if (!cache)
+		return;
+
+	while (cache->lru_head) {
+		struct chunk_cache_entry *entry = cache->lru_head;
+
+		cache->lru_head = entry->lru_next;
+		free_entry(entry);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+/* Evict the least recently used entry.  */
+static void
+evict_one(struct chunk_cache *cache)
+{
+	struct chunk_cache_entry *entry = cache->lru_tail;
+	struct chunk_cache_entry **pp;
+
+	pp = &cache->buckets[hash_key(cache, entry->mref, entry->chunk_idx)];
+	while (*pp != entry)
+		pp = &(*pp)->hash_next;
+	*pp = entry->hash_next;
+
+	lru_remove(cache, entry);
+	cache->cur_size -= entry->size;
+	free_entry(entry);
+}
+
+/* Find the entry for a chunk.  The cache's lock must be held.  */
+static struct chunk_cache_entry *
+find_entry(const struct chunk_cache *cache, u64 mref, u64 chunk_idx)
+{
+	struct chunk_cache_entry *entry;
+
+	entry = cache->buckets[hash_key(cache, mref, chunk_idx)];
+	for (; entry; entry = entry->hash_next)
+		if (entry->mref == mref && entry->chunk_idx == chunk_idx)
+			break;
+	return entry;
+}
+
+/*
+ * Look up a chunk, and on a hit, copy @size bytes of its uncompressed data,
+ * starting @offset bytes into it, into @buf and return 0.  On a miss, return
+ * -1.
+ */
+int
+chunk_cache_read(struct chunk_cache *cache, u64 mref, u64 chunk_idx,
+		 u32 offset, u32 size, void *buf)
+{
+	struct chunk_cache_entry *entry;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = find_entry(cache, mref, chunk_idx);
+	if (entry) {
+		if (entry != cache->lru_head) {
+			lru_remove(cache, entry);
+			lru_add_head(cache, entry);
+		}
+		memcpy(buf, &entry->data[offset], size);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return entry ? 0 : -1;
+}
+
+/* Return true if a chunk is cached.  This doesn't count as a use of the chunk
+ * for the purpose of choosing which chunks to evict.  */
+int
+chunk_cache_contains(struct chunk_cache *cache, u64 mref, u64 chunk_idx)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache->lock);
+	ret = find_entry(cache, mref, chunk_idx) != NULL;
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+/*
+ * Add a copy of the uncompressed data of a chunk to the cache, evicting the
+ * least recently used chunks as needed to stay within the size limit.  Nothing
+ * is done if the chunk is already cached, e.g. because another thread
+ * decompressed it at the same time.  Failure to allocate memory is ignored.
+ */
+void
+chunk_cache_insert(struct chunk_cache *cache, u64 mref, u64 chunk_idx,
+		   const void *data, u32 size)
+{
+	struct chunk_cache_entry *entry;
+	size_t bucket;
+
+	if (size > cache->max_size)
+		return;
+
+	/* Copy the data before taking the lock.  */
+	entry = ntfs_malloc(sizeof(*entry));
+	if (!entry)
+		return;
+	entry->data = buffer_arena_alloc(size);
+	if (!entry->data) {
+		free(entry);
+		return;
+	}
+	entry->mref = mref;
+	entry->chunk_idx = chunk_idx;
+	entry->size = size;
+	memcpy(entry->data, data, size);
+
+	pthread_mutex_lock(&cache->lock);
+	if (find_entry(cache, mref, chunk_idx)) {
+		pthread_mutex_unlock(&cache->lock);
+		free_entry(entry);
+		return;
+	}
+
+	while (cache->cur_size + size > cache->max_size)
+		evict_one(cache);
+
+	bucket = hash_key(cache, mref, chunk_idx);
+	entry->hash_next = cache->buckets[bucket];
+	cache->buckets[bucket] = entry;
+	lru_add_head(cache, entry);
+	cache->cur_size += size;
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,35 @@
+/*
+ * chunk_cache.h
+ *
+ * Declarations for the cache of decompressed chunks shared by all
+ * decompression contexts of a volume or WIM.
+ */
+
+#ifndef _CHUNK_CACHE_H
+#define _CHUNK_CACHE_H
+
+#include "common_defs.h"
+
+struct chunk_cache;
+
+extern void
+chunk_cache_set_max_size(size_t max_size);
+
+extern struct chunk_cache *
+chunk_cache_get(const void *owner);
+
+extern void
+chunk_cache_free(const void *owner);
+
+extern int
+chunk_cache_read(struct chunk_cache *cache, u64 mref, u64 chunk_idx,
+		 u32 offset, u32 size, void *buf);
+
+extern int
+chunk_cache_contains(struct chunk_cache *cache, u64 mref, u64 chunk_idx);
+
+extern void
+chunk_cache_insert(struct chunk_cache *cache, u64 mref, u64 chunk_idx,
+		   const void *data, u32 size);
+
+#endif /* _CHUNK_CACHE_H */
@@ -0,0 +1,285 @@
+/*
+ * chunk_table.c - Fully loaded chunk offset tables
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A decompression context normally caches only a small window of the chunk
+ * offset table, so random reads from a large file often need an extra read of
+ * the chunk offset table.  To avoid that, the whole chunk offset table of a
+ * large file can instead be loaded into memory once.  The loaded table is
+ * shared by all decompression contexts for the file and is freed when the last
+ * of them is closed.
+ *
+ * To save memory, the table is stored in a compact form: 32-bit offsets
+ * relative to the first chunk of each group of 2^CHUNK_TABLE_GROUP_ORDER
+ * chunks, plus a 64-bit offset for each group.  A group spans at most
+ * 2^CHUNK_TABLE_GROUP_ORDER times the maximum chunk size bytes, so the relative
+ * offsets always fit in 32 bits, even in files >= 4 GiB.
+ *
+ * The list of loaded tables is protected by a lock.  Loading a table can take
+ * many reads, so the lock isn't held while it's loaded; instead, the table is
+ * added to the list marked as loading, and readers which need the same table at
+ * the same time wait for it rather than loading it too.  A table doesn't change
+ * once it's loaded, so it's read without the lock.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <ntfs-3g/misc.h>
+
+#include "chunk_table.h"
+
+/* The default maximum size in bytes of a loaded chunk table.  Files which would
+ * need a larger table use the chunk offsets window instead.  */
+#define DEFAULT_MAX_TABLE_SIZE	(4 << 20)
+
+/* The number of entries to read from the on-disk table at a time  */
+#define ENTRIES_PER_READ	8192
+
+static struct chunk_table *all_tables;
+static pthread_mutex_t all_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signaled when a table has been loaded, or has failed to load  */
+static pthread_cond_t table_loaded_cond = PTHREAD_COND_INITIALIZER;
+static size_t max_table_size = DEFAULT_MAX_TABLE_SIZE;
+
+static void
+free_chunk_table(struct chunk_table *table)
+{
+	free(table->group_offsets);
+	free(table->offsets);
+	free(table);
+}
+
+/* Remove @table from the list of tables.  The list lock must be held.  */
+static void
+unlink_chunk_table(struct chunk_table *table)
+{
+	struct chunk_table **pp;
+
+	for (pp = &all_tables; *pp != table; pp = &(*pp)->next)
+		;
+	*pp = table->next;
+}
+
+static size_t
+chunk_table_size(u64 num_chunks)
+{
+	return (num_chunks + 1) * sizeof(u32) +
+	       ((num_chunks >> CHUNK_TABLE_GROUP_ORDER) + 1) * sizeof(u64);
+}
+
+/* Set the maximum size in bytes of a loaded chunk table.  0 disables loading
+ * whole chunk tables.  */
+void
+chunk_table_set_max_size(size_t max_size)
+{
+	max_table_size = max_size;
+}
+
+/* Return true if the whole chunk table of a file with @num_chunks chunks may be
+ * loaded.  */
+int
+chunk_table_allowed(u64 num_chunks)
+{
+	return num_chunks <= SIZE_MAX / 8 &&
+	       chunk_table_size(num_chunks) <= max_table_size;
+}
+
+/*
+ * Read the whole chunk table of a file and convert it to the in-memory form.
+ * The compressed stream is read with @read_fn, @entry_shift is the base 2
+ * logarithm of the on-disk entry size, and the other parameters describe the
+ * file.
+ */
+static int
+load_chunk_table(struct chunk_table *table, chunk_table_read_fn read_fn,
+		 void *read_arg, u64 num_chunks, u32 chunk_size,
+		 int entry_shift, u64 compressed_size)
+{
+	const u64 table_size = (num_chunks - 1) << entry_shift;
+	void *buf;
+	u64 prev_offset = table_size;
+	u64 i;
+	int ret = -1;
+
+	if (table_size > compressed_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	buf = ntfs_malloc(ENTRIES_PER_READ << entry_shift);
+	if (!buf)
+		return -1;
+
+	/* The first chunk has no explicit entry, and the end-of-stream entry
+	 * is implicit too.  */
+	table->group_offsets[0] = table_size;
+	table->offsets[0] = 0;
+	for (i = 1; i <= num_chunks; i++) {
+		u64 offset;
+
+		if (i == num_chunks) {
+			offset = compressed_size;
+		} else {
+			const u64 j = (i - 1) % ENTRIES_PER_READ;
+
+			if (j == 0) {
+				const s64 count =
+					min(num_chunks - i,
+					    (u64)ENTRIES_PER_READ) <<
+					entry_shift;
+				s64 res = (*read_fn)(read_arg,
+						     (i - 1) << entry_shift,
+						     count, buf);
+				if (res != count) {
+					if (res >= 0)
+						errno = EINVAL;
+					goto out;
+				}
+			}
+			if (entry_shift == 3)
+				offset = le64_to_cpu(((le64 *)buf)[j]);
+			else
+				offset = le32_to_cpu(((le32 *)buf)[j]);
+			offset += table_size;
+		}
+
+		/* Chunks can't overlap or extend past end-of-stream, and they
+		 * can't be larger than the chunk size.  This ensures that the
+		 * relative offsets fit in 32 bits.  */
+		if (offset < prev_offset || offset > compressed_size ||
+		    offset - prev_offset > chunk_size) {
+			errno = EINVAL;
+			goto out;
+		}
+
+		if (i % (1 << CHUNK_TABLE_GROUP_ORDER) == 0)
+			table->group_offsets[i >> CHUNK_TABLE_GROUP_ORDER] =
+				offset;
+		table->offsets[i] = offset -
+			table->group_offsets[i >> CHUNK_TABLE_GROUP_ORDER];
+		prev_offset = offset;
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Get a reference to the whole chunk table of the file identified by @id within
+ * @owner: its MFT reference within its volume, or for a WIMBoot file, the
+ * offset of its resource within its WIM.  If another context has already loaded
+ * the table, it is shared, after waiting for it if it's still being loaded;
+ * otherwise it is loaded from the compressed stream with @read_fn.  On failure,
+ * return NULL and set errno; the caller can still use the chunk offsets window.
+ */
+struct chunk_table *
+chunk_table_get(const void *owner, u64 id, chunk_table_read_fn read_fn,
+		void *read_arg, u64 num_chunks, u32 chunk_size,
+		int entry_shift, u64 compressed_size)
+{
+	struct chunk_table *table;
+	int error;
+
+	pthread_mutex_lock(&all_tables_lock);
+	for (table = all_tables; table; table = table->next)
+		if (table->owner == owner && table->id == id)
+			break;
+
+	if (table) {
+		/* Another context has loaded the table or is loading it.  If
+		 * loading it fails, the table is removed from the list, and
+		 * the last of the contexts which were waiting for it frees
+		 * it.  */
+		table->refcnt++;
+		while (table->loading)
+			pthread_cond_wait(&table_loaded_cond,
+					  &all_tables_lock);
+		error = table->error;
+		if (error && --table->refcnt == 0)
+			free_chunk_table(table);
+		pthread_mutex_unlock(&all_tables_lock);
+		if (error) {
+			errno = error;
+			return NULL;
+		}
+		return table;
+	}
+
+	table = ntfs_calloc(sizeof(*table));
+	if (!table) {
+		pthread_mutex_unlock(&all_tables_lock);
+		return NULL;
+	}
+	table->owner = owner;
+	table->id = id;
+	table->refcnt = 1;
+	table->loading = 1;
+	table->next = all_tables;
+	all_tables = table;
+	pthread_mutex_unlock(&all_tables_lock);
+
+	table->offsets = ntfs_malloc((num_chunks + 1) * sizeof(u32));
+	table->group_offsets = ntfs_malloc(((num_chunks >>
+					     CHUNK_TABLE_GROUP_ORDER) + 1) *
+					   sizeof(u64));
+	error = 0;
+	if (!table->offsets || !table->group_offsets ||
+	    load_chunk_table(table, read_fn, read_arg, num_chunks, chunk_size,
+			     entry_shift, compressed_size))
+		error = errno ? errno : EIO;
+
+	pthread_mutex_lock(&all_tables_lock);
+	table->loading = 0;
+	table->error = error;
+	if (error) {
+		unlink_chunk_table(table);
+		if (--table->refcnt == 0)
+			free_chunk_table(table);
+	}
+	pthread_cond_broadcast(&table_loaded_cond);
+	pthread_mutex_unlock(&all_tables_lock);
+	if (error) {
+		errno = error;
+		return NULL;
+	}
+	return table;
+}
+
+/* Release a reference to a chunk table, freeing it if it was the last.  */
+void
+chunk_table_put(struct chunk_table *table)
+{
+	if (!table)
+		return;
+
+	pthread_mutex_lock(&all_tables_lock);
+	if (--table->refcnt) {
+		pthread_mutex_unlock(&all_tables_lock);
+		return;
+	}
+	unlink_chunk_table(table);
+	pthread_mutex_unlock(&all_tables_lock);
+	free_chunk_table(table);
+}
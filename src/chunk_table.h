@@ -0,0 +1,68 @@
+/*
+ * chunk_table.h
+ *
+ * Declarations for fully loaded chunk offset tables, which are shared by all
+ * decompression contexts of a file.
+ */
+
+#ifndef _CHUNK_TABLE_H
+#define _CHUNK_TABLE_H
+
+#include "common_defs.h"
+
+/* Chunks are divided into groups of 2^CHUNK_TABLE_GROUP_ORDER.  Each chunk's
+ * offset is stored as a 32-bit number relative to the offset of the first chunk
+ * in its group.  */
+#define CHUNK_TABLE_GROUP_ORDER	10
+
+struct chunk_table {
+	/* The offset, in the compressed stream, of the first chunk in each
+	 * group  */
+	u64 *group_offsets;
+
+	/* For each chunk, plus one extra entry for end-of-stream, the offset of
+	 * the chunk relative to the start of its group  */
+	u32 *offsets;
+
+	/* Identification of the file, and the number of contexts using this
+	 * table or waiting for it to be loaded  */
+	const void *owner;
+	u64 id;
+	unsigned long refcnt;
+	struct chunk_table *next;
+
+	/* Whether the table is still being loaded, and if loading it failed,
+	 * the error number; protected by the list lock  */
+	int loading;
+	int error;
+};
+
+/* Return the offset of chunk @chunk_idx in the compressed stream.  Passing the
+ * number of chunks returns the size of the compressed stream.  */
+static forceinline u64
+chunk_table_offset(const struct chunk_table *table, u64 chunk_idx)
+{
+	return table->group_offsets[chunk_idx >> CHUNK_TABLE_GROUP_ORDER] +
+	       table->offsets[chunk_idx];
+}
+
+/* A function which reads @count bytes at offset @pos in a compressed stream
+ * into @buf, and returns the number of bytes read or -1 with errno set  */
+typedef s64 (*chunk_table_read_fn)(void *arg, u64 pos, size_t count,
+				   void *buf);
+
+extern void
+chunk_table_set_max_size(size_t max_size);
+
+extern int
+chunk_table_allowed(u64 num_chunks);
+
+extern struct chunk_table *
+chunk_table_get(const void *owner, u64 id, chunk_table_read_fn read_fn,
+		void *read_arg, u64 num_chunks, u32 chunk_size, int entry_shift,
+		u64 compressed_size);
+
+extern void
+chunk_table_put(struct chunk_table *table);
+
+#endif /* _CHUNK_TABLE_H */
@@ -96,6 +96,22 @@ store_##type##_unaligned(type val, void *p)			\
  * and also produce a result of value '0' to be used in constant expressions */
 #define STATIC_ASSERT_ZERO(expr) ((int)sizeof(char[-!(expr)]))
 
+/*
+ * X86_CPU_DISPATCH is defined to 1 if functions can be compiled for x86
+ * instruction set extensions which the compiler flags don't enable, by
+ * declaring them with _target_attribute(), and then selected at runtime using
+ * x86_have_cpu_feature().
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 6))
+#  define X86_CPU_DISPATCH	1
+#  define _target_attribute(t)	__attribute__((target(t)))
+#  define x86_have_cpu_feature(feature) \
+	(__builtin_cpu_init(), __builtin_cpu_supports(feature))
+#else
+#  define X86_CPU_DISPATCH	0
+#endif
+
 /* UNALIGNED_ACCESS_IS_FAST should be defined to 1 if unaligned memory accesses
  * can be performed efficiently on the target platform.  */
 #if defined(__x86_64__) || defined(__i386__) || defined(__ARM_FEATURE_UNALIGNED)
@@ -143,6 +159,7 @@ store_##type##_unaligned(type v, void *p)			\
 
 DEFINE_UNALIGNED_TYPE(le16);
 DEFINE_UNALIGNED_TYPE(le32);
+DEFINE_UNALIGNED_TYPE(le64);
 DEFINE_UNALIGNED_TYPE(machine_word_t);
 
 #define load_word_unaligned	load_machine_word_t_unaligned
@@ -167,6 +184,16 @@ get_unaligned_le32(const u8 *p)
 			((u32)p[1] << 8) | p[0];
 }
 
+static inline u64
+get_unaligned_le64(const u8 *p)
+{
+	if (UNALIGNED_ACCESS_IS_FAST)
+		return le64_to_cpu(load_le64_unaligned(p));
+	else
+		return ((u64)get_unaligned_le32(p + 4) << 32) |
+			get_unaligned_le32(p);
+}
+
 static inline void
 put_unaligned_le16(u16 v, u8 *p)
 {
@@ -280,11 +307,4 @@ ilog2_ceil(size_t n)
         return 1 + bsrw(n - 1);
 }
 
-/* ========================================================================== */
-/*                          Aligned memory allocation                         */
-/* ========================================================================== */
-
-extern void *aligned_malloc(size_t size, size_t alignment);
-extern void aligned_free(void *ptr);
-
 #endif /* _COMMON_DEFS_H */
@@ -33,11 +33,15 @@
 
 #include <string.h>
 
-#ifdef __SSE2__
-#  include <emmintrin.h>
+#include "decompress_common.h"
+
+#if X86_CPU_DISPATCH || defined(__SSE2__)
+#  include <immintrin.h>
 #endif
 
-#include "decompress_common.h"
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
 
 /*
  * make_huffman_decode_table() -
@@ -121,11 +125,36 @@
  *	A temporary array that was declared with DECODE_TABLE_WORKING_SPACE().
  *
  * Returns 0 on success, or -1 if the lengths do not form a valid prefix code.
+ *
+ * This is a template for the implementations of make_huffman_decode_table(),
+ * which are instantiated for the available instruction set extensions.  The
+ * phases which look at every symbol or fill many entries are given as
+ * arguments:
+ *
+ * @count_lens(len_counts, lens, num_syms, max_codeword_len):
+ *	Set len_counts[len] to the number of symbols whose codeword is 'len'
+ *	bits long, for each 'len' from 0 to max_codeword_len inclusively.
+ *
+ * @sort_syms(sorted_syms, offsets, lens, num_syms):
+ *	In increasing order of symbol value, store each symbol 'sym' with a
+ *	nonzero codeword length at 'sorted_syms[offsets[lens[sym]]++]'.
+ *	Symbols with length 0 may be skipped.
+ *
+ * @fill_vecs(p, entry, n):
+ *	Fill @n vectors of @vec_bytes bytes, beginning at @p, with copies of
+ *	the decode table entry @entry.  If @vec_bytes is 0, this isn't used.
  */
-int
-make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
-			  unsigned table_bits, const u8 lens[],
-			  unsigned max_codeword_len, u16 working_space[])
+static forceinline int
+make_huffman_decode_table_template(u16 decode_table[], unsigned num_syms,
+				   unsigned table_bits, const u8 lens[],
+				   unsigned max_codeword_len,
+				   u16 working_space[],
+				   void (*count_lens)(u16 [], const u8 [],
+						      unsigned, unsigned),
+				   void (*sort_syms)(u16 [], u16 [], const u8 [],
+						     unsigned),
+				   const unsigned vec_bytes,
+				   void (*fill_vecs)(void *, u16, unsigned))
 {
 	u16 * const len_counts = &working_space[0];
 	u16 * const offsets = &working_space[1 * (max_codeword_len + 1)];
@@ -140,10 +169,7 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 	unsigned subtable_prefix;
 
 	/* Count how many codewords have each length, including 0.  */
-	for (unsigned len = 0; len <= max_codeword_len; len++)
-		len_counts[len] = 0;
-	for (unsigned sym = 0; sym < num_syms; sym++)
-		len_counts[lens[sym]]++;
+	(*count_lens)(len_counts, lens, num_syms, max_codeword_len);
 
 	/* It is already guaranteed that all lengths are <= max_codeword_len,
 	 * but it cannot be assumed they form a complete prefix code.  A
@@ -184,9 +210,9 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 	for (unsigned len = 0; len < max_codeword_len; len++)
 		offsets[len + 1] = offsets[len] + len_counts[len];
 
-	/* Use the 'offsets' array to sort the symbols. */
-	for (unsigned sym = 0; sym < num_syms; sym++)
-		sorted_syms[offsets[lens[sym]]++] = sym;
+	/* Use the 'offsets' array to sort the symbols.  The symbols with
+	 * codeword length 0 come first, and they are never used.  */
+	(*sort_syms)(sorted_syms, offsets, lens, num_syms);
 
 	/*
 	 * Fill the root table entries for codewords no longer than table_bits.
@@ -194,35 +220,32 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 	 * The table will start with entries for the shortest codeword(s), which
 	 * will have the most entries.  From there, the number of entries per
 	 * codeword will decrease.  As an optimization, we may begin filling
-	 * entries with SSE2 vector accesses (8 entries/store), then change to
+	 * entries with vector accesses (8 or 16 entries/store), then change to
 	 * word accesses (2 or 4 entries/store), then change to 16-bit accesses
 	 * (1 entry/store).
 	 */
-	sym_idx = offsets[0];
+	sym_idx = len_counts[0];
 
-#ifdef __SSE2__
-	/* Fill entries one 128-bit vector (8 entries) at a time. */
-	for (unsigned stores_per_loop = (1U << (table_bits - codeword_len)) /
-				    (sizeof(__m128i) / sizeof(decode_table[0]));
-	     stores_per_loop != 0; codeword_len++, stores_per_loop >>= 1)
-	{
-		unsigned end_sym_idx = sym_idx + len_counts[codeword_len];
-		for (; sym_idx < end_sym_idx; sym_idx++) {
-			/* Note: unlike in the "word" version below, the __m128i
-			 * type already has __attribute__((may_alias)), so using
-			 * it to access an array of u16 will not violate strict
-			 * aliasing.  */
-			__m128i v = _mm_set1_epi16(
-				MAKE_DECODE_TABLE_ENTRY(sorted_syms[sym_idx],
-							codeword_len));
-			unsigned n = stores_per_loop;
-			do {
-				*(__m128i *)entry_ptr = v;
-				entry_ptr += sizeof(v);
-			} while (--n);
+	/* Fill entries one vector at a time. */
+	if (vec_bytes != 0) {
+		for (unsigned stores_per_loop =
+				(1U << (table_bits - codeword_len)) /
+				(vec_bytes / sizeof(decode_table[0]));
+		     stores_per_loop != 0;
+		     codeword_len++, stores_per_loop >>= 1)
+		{
+			unsigned end_sym_idx = sym_idx +
+					       len_counts[codeword_len];
+			for (; sym_idx < end_sym_idx; sym_idx++) {
+				(*fill_vecs)(entry_ptr,
+					MAKE_DECODE_TABLE_ENTRY(
+						sorted_syms[sym_idx],
+						codeword_len),
+					stores_per_loop);
+				entry_ptr += stores_per_loop * vec_bytes;
+			}
 		}
 	}
-#endif /* __SSE2__ */
 
 #ifdef __GNUC__
 	/* Fill entries one word (2 or 4 entries) at a time. */
@@ -340,3 +363,446 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 
 	return 0;
 }
+
+static forceinline void
+count_lens_generic(u16 len_counts[], const u8 lens[], unsigned num_syms,
+		   unsigned max_codeword_len)
+{
+	for (unsigned len = 0; len <= max_codeword_len; len++)
+		len_counts[len] = 0;
+	for (unsigned sym = 0; sym < num_syms; sym++)
+		len_counts[lens[sym]]++;
+}
+
+static forceinline void
+sort_syms_generic(u16 sorted_syms[], u16 offsets[], const u8 lens[],
+		  unsigned num_syms)
+{
+	for (unsigned sym = 0; sym < num_syms; sym++)
+		sorted_syms[offsets[lens[sym]]++] = sym;
+}
+
+/*
+ * Vectorized versions of count_lens() and sort_syms().  Counting and sorting
+ * one symbol at a time is slow since consecutive symbols often have the same
+ * codeword length, especially 0, so each count or offset is incremented while
+ * the previous increment is still being stored.  Instead, the codeword lengths
+ * are counted by comparing whole vectors of them with each length, and the
+ * symbols with length 0, which are usually most of them, aren't sorted at all.
+ *
+ * @count_eq(p, num_vecs, len) returns how many of the bytes in @num_vecs
+ * vectors of @vec_bytes bytes beginning at @p are equal to @len.
+ * @nonzero_mask(p) returns a bitmask of the nonzero bytes in the vector at @p.
+ * The vectors needn't be aligned.
+ */
+static forceinline void
+count_lens_vec(u16 len_counts[], const u8 lens[], unsigned num_syms,
+	       unsigned max_codeword_len, const unsigned vec_bytes,
+	       unsigned (*count_eq)(const u8 *, unsigned, unsigned))
+{
+	const unsigned num_vecs = num_syms / vec_bytes;
+	unsigned num_nonzero = 0;
+
+	len_counts[0] = 0;
+	for (unsigned len = 1; len <= max_codeword_len; len++)
+		len_counts[len] = (*count_eq)(lens, num_vecs, len);
+	for (unsigned sym = num_vecs * vec_bytes; sym < num_syms; sym++)
+		len_counts[lens[sym]]++;
+	for (unsigned len = 1; len <= max_codeword_len; len++)
+		num_nonzero += len_counts[len];
+	len_counts[0] = num_syms - num_nonzero;
+}
+
+static forceinline void
+sort_syms_vec(u16 sorted_syms[], u16 offsets[], const u8 lens[],
+	      unsigned num_syms, const unsigned vec_bytes,
+	      u64 (*nonzero_mask)(const u8 *))
+{
+	unsigned sym;
+
+	for (sym = 0; num_syms - sym >= vec_bytes; sym += vec_bytes) {
+		u64 mask = (*nonzero_mask)(&lens[sym]);
+
+		while (mask) {
+			unsigned s = sym + bsf64(mask);
+
+			sorted_syms[offsets[lens[s]]++] = s;
+			mask &= mask - 1;
+		}
+	}
+	for (; sym < num_syms; sym++)
+		sorted_syms[offsets[lens[sym]]++] = sym;
+}
+
+#if X86_CPU_DISPATCH || defined(__SSE2__)
+#  if X86_CPU_DISPATCH
+#    define SSE2_TARGET	_target_attribute("sse2")
+#  else
+#    define SSE2_TARGET
+#  endif
+static forceinline SSE2_TARGET unsigned
+count_eq_sse2(const u8 *p, unsigned num_vecs, unsigned len)
+{
+	const __m128i v = _mm_set1_epi8(len);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sums = zero;
+
+	/* Each byte of 'counts' can count up to 255 matches.  */
+	while (num_vecs != 0) {
+		unsigned n = min(num_vecs, 255);
+		__m128i counts = zero;
+
+		num_vecs -= n;
+		do {
+			__m128i bytes = _mm_loadu_si128((const __m128i *)p);
+
+			counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(bytes, v));
+			p += sizeof(bytes);
+		} while (--n);
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(counts, zero));
+	}
+	return _mm_cvtsi128_si32(sums) +
+	       _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+}
+
+static forceinline SSE2_TARGET u64
+nonzero_mask_sse2(const u8 *p)
+{
+	__m128i bytes = _mm_loadu_si128((const __m128i *)p);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128())) ^
+	       0xFFFF;
+}
+
+static forceinline SSE2_TARGET void
+count_lens_sse2(u16 len_counts[], const u8 lens[], unsigned num_syms,
+		unsigned max_codeword_len)
+{
+	count_lens_vec(len_counts, lens, num_syms, max_codeword_len,
+		       sizeof(__m128i), count_eq_sse2);
+}
+
+static forceinline SSE2_TARGET void
+sort_syms_sse2(u16 sorted_syms[], u16 offsets[], const u8 lens[],
+	       unsigned num_syms)
+{
+	sort_syms_vec(sorted_syms, offsets, lens, num_syms, sizeof(__m128i),
+		      nonzero_mask_sse2);
+}
+
+static forceinline SSE2_TARGET void
+fill_vecs_sse2(void *p, u16 entry, unsigned n)
+{
+	/* Note: unlike in the "word" version of filling, the __m128i type
+	 * already has __attribute__((may_alias)), so using it to access an
+	 * array of u16 will not violate strict aliasing.  */
+	const __m128i v = _mm_set1_epi16(entry);
+
+	do {
+		*(__m128i *)p = v;
+		p += sizeof(v);
+	} while (--n);
+}
+
+static SSE2_TARGET int
+make_huffman_decode_table_sse2(u16 decode_table[], unsigned num_syms,
+			       unsigned table_bits, const u8 lens[],
+			       unsigned max_codeword_len,
+			       u16 working_space[])
+{
+	return make_huffman_decode_table_template(decode_table, num_syms,
+						  table_bits, lens,
+						  max_codeword_len,
+						  working_space,
+						  count_lens_sse2,
+						  sort_syms_sse2,
+						  sizeof(__m128i),
+						  fill_vecs_sse2);
+}
+#  undef SSE2_TARGET
+#endif /* X86_CPU_DISPATCH || __SSE2__ */
+
+#if X86_CPU_DISPATCH
+static forceinline _target_attribute("avx2") unsigned
+count_eq_avx2(const u8 *p, unsigned num_vecs, unsigned len)
+{
+	const __m256i v = _mm256_set1_epi8(len);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sums = zero;
+	__m128i sum;
+
+	/* Each byte of 'counts' can count up to 255 matches.  */
+	while (num_vecs != 0) {
+		unsigned n = min(num_vecs, 255);
+		__m256i counts = zero;
+
+		num_vecs -= n;
+		do {
+			__m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+
+			counts = _mm256_sub_epi8(counts,
+						 _mm256_cmpeq_epi8(bytes, v));
+			p += sizeof(bytes);
+		} while (--n);
+		sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counts, zero));
+	}
+	sum = _mm_add_epi64(_mm256_castsi256_si128(sums),
+			    _mm256_extracti128_si256(sums, 1));
+	return _mm_cvtsi128_si32(sum) +
+	       _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+}
+
+static forceinline _target_attribute("avx2") u64
+nonzero_mask_avx2(const u8 *p)
+{
+	__m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+
+	return (u32)~_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(bytes, _mm256_setzero_si256()));
+}
+
+static forceinline _target_attribute("avx2") void
+count_lens_avx2(u16 len_counts[], const u8 lens[], unsigned num_syms,
+		unsigned max_codeword_len)
+{
+	count_lens_vec(len_counts, lens, num_syms, max_codeword_len,
+		       sizeof(__m256i), count_eq_avx2);
+}
+
+static forceinline _target_attribute("avx2") void
+sort_syms_avx2(u16 sorted_syms[], u16 offsets[], const u8 lens[],
+	       unsigned num_syms)
+{
+	sort_syms_vec(sorted_syms, offsets, lens, num_syms, sizeof(__m256i),
+		      nonzero_mask_avx2);
+}
+
+static forceinline _target_attribute("avx2") void
+fill_vecs_avx2(void *p, u16 entry, unsigned n)
+{
+	/* Decode tables are only 16-byte aligned.  */
+	const __m256i v = _mm256_set1_epi16(entry);
+
+	do {
+		_mm256_storeu_si256((__m256i *)p, v);
+		p += sizeof(v);
+	} while (--n);
+}
+
+static _target_attribute("avx2") int
+make_huffman_decode_table_avx2(u16 decode_table[], unsigned num_syms,
+			       unsigned table_bits, const u8 lens[],
+			       unsigned max_codeword_len,
+			       u16 working_space[])
+{
+	return make_huffman_decode_table_template(decode_table, num_syms,
+						  table_bits, lens,
+						  max_codeword_len,
+						  working_space,
+						  count_lens_avx2,
+						  sort_syms_avx2,
+						  sizeof(__m256i),
+						  fill_vecs_avx2);
+}
+#endif /* X86_CPU_DISPATCH */
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+static forceinline unsigned
+count_eq_neon(const u8 *p, unsigned num_vecs, unsigned len)
+{
+	const uint8x16_t v = vdupq_n_u8(len);
+	unsigned sum = 0;
+
+	/* Each byte of 'counts' can count up to 255 matches.  */
+	while (num_vecs != 0) {
+		unsigned n = min(num_vecs, 255);
+		uint8x16_t counts = vdupq_n_u8(0);
+
+		num_vecs -= n;
+		do {
+			counts = vsubq_u8(counts, vceqq_u8(vld1q_u8(p), v));
+			p += 16;
+		} while (--n);
+		sum += vaddlvq_u8(counts);
+	}
+	return sum;
+}
+
+static forceinline u64
+nonzero_mask_neon(const u8 *p)
+{
+	/* NEON has no movemask instruction, so give each byte of the
+	 * comparison results a different bit, then sum adjacent bytes until
+	 * each byte holds the mask for 8 bytes of data.  */
+	static const u8 bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+				     1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t mask = vandq_u8(vtstq_u8(vld1q_u8(p), vld1q_u8(p)),
+				   vld1q_u8(bits));
+
+	mask = vpaddq_u8(mask, mask);
+	mask = vpaddq_u8(mask, mask);
+	mask = vpaddq_u8(mask, mask);
+	return vgetq_lane_u16(vreinterpretq_u16_u8(mask), 0);
+}
+
+static forceinline void
+count_lens_neon(u16 len_counts[], const u8 lens[], unsigned num_syms,
+		unsigned max_codeword_len)
+{
+	count_lens_vec(len_counts, lens, num_syms, max_codeword_len, 16,
+		       count_eq_neon);
+}
+
+static forceinline void
+sort_syms_neon(u16 sorted_syms[], u16 offsets[], const u8 lens[],
+	       unsigned num_syms)
+{
+	sort_syms_vec(sorted_syms, offsets, lens, num_syms, 16,
+		      nonzero_mask_neon);
+}
+
+static forceinline void
+fill_vecs_neon(void *p, u16 entry, unsigned n)
+{
+	const uint16x8_t v = vdupq_n_u16(entry);
+
+	do {
+		vst1q_u16(p, v);
+		p += 16;
+	} while (--n);
+}
+
+static int
+make_huffman_decode_table_neon(u16 decode_table[], unsigned num_syms,
+			       unsigned table_bits, const u8 lens[],
+			       unsigned max_codeword_len,
+			       u16 working_space[])
+{
+	return make_huffman_decode_table_template(decode_table, num_syms,
+						  table_bits, lens,
+						  max_codeword_len,
+						  working_space,
+						  count_lens_neon,
+						  sort_syms_neon,
+						  16, fill_vecs_neon);
+}
+#endif /* __aarch64__ && __ARM_NEON */
+
+static int
+make_huffman_decode_table_generic(u16 decode_table[], unsigned num_syms,
+				  unsigned table_bits, const u8 lens[],
+				  unsigned max_codeword_len,
+				  u16 working_space[])
+{
+	return make_huffman_decode_table_template(decode_table, num_syms,
+						  table_bits, lens,
+						  max_codeword_len,
+						  working_space,
+						  count_lens_generic,
+						  sort_syms_generic,
+						  0, NULL);
+}
+
+typedef int (*make_huffman_decode_table_func)(u16 decode_table[],
+					      unsigned num_syms,
+					      unsigned table_bits,
+					      const u8 lens[],
+					      unsigned max_codeword_len,
+					      u16 working_space[]);
+
+/* Choose the fastest implementation of make_huffman_decode_table() for the
+ * CPU, then call it.  This runs only for the first call; later calls go
+ * directly to the chosen implementation.  */
+static int
+dispatch_make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
+				   unsigned table_bits, const u8 lens[],
+				   unsigned max_codeword_len,
+				   u16 working_space[]);
+
+static volatile make_huffman_decode_table_func make_huffman_decode_table_impl =
+	dispatch_make_huffman_decode_table;
+
+static int
+dispatch_make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
+				   unsigned table_bits, const u8 lens[],
+				   unsigned max_codeword_len,
+				   u16 working_space[])
+{
+	make_huffman_decode_table_func f = make_huffman_decode_table_generic;
+
+#if X86_CPU_DISPATCH
+	if (x86_have_cpu_feature("avx2"))
+		f = make_huffman_decode_table_avx2;
+	else if (x86_have_cpu_feature("sse2"))
+		f = make_huffman_decode_table_sse2;
+#elif defined(__SSE2__)
+	f = make_huffman_decode_table_sse2;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	f = make_huffman_decode_table_neon;
+#endif
+	make_huffman_decode_table_impl = f;
+	return (*f)(decode_table, num_syms, table_bits, lens,
+		    max_codeword_len, working_space);
+}
+
+/* Build a decode table for a prefix code; see
+ * make_huffman_decode_table_template() for details.  */
+int
+make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
+			  unsigned table_bits, const u8 lens[],
+			  unsigned max_codeword_len, u16 working_space[])
+{
+	return (*make_huffman_decode_table_impl)(decode_table, num_syms,
+						 table_bits, lens,
+						 max_codeword_len,
+						 working_space);
+}
+
+/*
+ * make_huffman_pair_table() -
+ *
+ * Given a decode table built by make_huffman_decode_table(), build a table that
+ * is indexed by the same 'table_bits' bits of input, but that decodes literals,
+ * i.e. symbols less than 'num_literals', two at a time when possible.  See
+ * PAIR_TABLE_ENTRY() for the format of the entries.
+ *
+ * This lets a decoder output up to two literals per table lookup, without
+ * having to branch on how many it got.  The second codeword is found by
+ * indexing the decode table with the bits following the first codeword, padded
+ * with zeroes; that is only valid if the second codeword fits entirely within
+ * the 'table_bits' bits, which is checked.  Building the pair table takes a
+ * pass over all 2^table_bits entries, so it's only worth doing when many
+ * literals will be decoded with short codewords.
+ *
+ * 'num_literals' must not exceed 256.
+ */
+void
+make_huffman_pair_table(u32 pair_table[], const u16 decode_table[],
+			unsigned table_bits, unsigned num_literals)
+{
+	const unsigned mask = (1U << table_bits) - 1;
+
+	for (unsigned i = 0; i <= mask; i++) {
+		const unsigned entry1 = decode_table[i];
+		const unsigned sym1 = entry1 >> DECODE_TABLE_SYMBOL_SHIFT;
+		const unsigned len1 = entry1 & DECODE_TABLE_LENGTH_MASK;
+		unsigned entry2, sym2, len2;
+
+		/* Subtable pointers are excluded by the symbol check, since
+		 * their "symbols" are at least 2^table_bits.  Codewords of
+		 * length 0 only occur in the table for an empty code.  */
+		if (sym1 >= num_literals || len1 == 0) {
+			pair_table[i] = 0;
+			continue;
+		}
+		pair_table[i] = PAIR_TABLE_ENTRY(1, sym1, 0, len1);
+
+		entry2 = decode_table[(i << len1) & mask];
+		sym2 = entry2 >> DECODE_TABLE_SYMBOL_SHIFT;
+		len2 = entry2 & DECODE_TABLE_LENGTH_MASK;
+		if (sym2 < num_literals && len2 != 0 &&
+		    len1 + len2 <= table_bits)
+			pair_table[i] = PAIR_TABLE_ENTRY(2, sym1, sym2,
+							 len1 + len2);
+	}
+}
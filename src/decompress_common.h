@@ -74,7 +74,15 @@ init_input_bitstream(struct input_bitstream *is, const void *buffer, u32 size)
  * all overrun data is zeroes.  This has no effect on well-formed compressed
  * data.  The only disadvantage is that bad compressed data may go undetected,
  * but even this is irrelevant if higher level code checksums the uncompressed
- * data anyway.  */
+ * data anyway.
+ *
+ * The end of the input is only checked for when the bit buffer is refilled,
+ * which is less often than once per literal or match.  So the decompressors
+ * don't have a separate "fast loop" which checks once per literal or match
+ * that it's far from the end of the input; that was tried and was no faster.
+ * Nor can they avoid checking for the end of the output, since they write
+ * directly into the caller's buffers, and there's no slack after a chunk: with
+ * parallel decompression, the next chunk is written there concurrently.  */
 
 /* Ensure the bit buffer variable for the bitstream contains at least @num_bits
  * bits.  Following this, bitstream_peek_bits() and/or bitstream_remove_bits()
@@ -202,6 +210,170 @@ bitstream_align(struct input_bitstream *is)
 	is->bitbuf = 0;
 }
 
+/******************************************************************************/
+/*                     Wide input bitstream for LZX                           */
+/*----------------------------------------------------------------------------*/
+
+/*
+ * A variant of the input bitstream which holds up to 64 bits and loads several
+ * coding units at once with a single unaligned 8-byte read, so that each
+ * literal, match header, or match offset needs at most one refill.  It's used
+ * on 64-bit platforms to decode the literals and matches of LZX compressed
+ * blocks.
+ *
+ * This can't be used for XPRESS, which interleaves literal bytes with the
+ * coding units: they would already have been loaded into the bit buffer.  LZX
+ * doesn't do that within compressed blocks, but the alignment of its
+ * uncompressed blocks depends on how many bits the 16-bit 'struct
+ * input_bitstream' happens to hold (see lzx_read_block_header()).  So this
+ * keeps track of that in @compat_bitsleft, and wide_bitstream_end() converts
+ * back to a 'struct input_bitstream' in exactly the state that reading the same
+ * bits with the functions above would have left it in.
+ */
+struct wide_input_bitstream {
+
+	/* Bits that have been read from the input buffer.  The bits are
+	 * left-justified; the next bit is always bit 63.  The bits following
+	 * the first @bitsleft bits are either zeroes or the actual next bits of
+	 * the input.  */
+	u64 bitbuf;
+
+	/* Number of bits currently held in @bitbuf.  */
+	u32 bitsleft;
+
+	/* Number of bits that a 'struct input_bitstream' would hold  */
+	u32 compat_bitsleft;
+
+	/* Pointer to the next byte to be loaded into @bitbuf.  */
+	const u8 *next;
+
+	/* Pointer past the end of the input buffer.  */
+	const u8 *end;
+
+	/* Whether zeroes have been substituted for data past the end  */
+	int overrun;
+};
+
+/* Start reading bits with a wide bitstream at the current position of @is.  */
+static forceinline void
+wide_bitstream_begin(struct wide_input_bitstream *ws,
+		     const struct input_bitstream *is)
+{
+	ws->bitbuf = (u64)is->bitbuf << 32;
+	ws->bitsleft = is->bitsleft;
+	ws->compat_bitsleft = is->bitsleft;
+	ws->next = is->next;
+	ws->end = is->end;
+	ws->overrun = 0;
+}
+
+/* Update @is to continue from the current position of the wide bitstream.
+ * The coding units which the wide bitstream loaded ahead are given back.  */
+static forceinline void
+wide_bitstream_end(const struct wide_input_bitstream *ws,
+		   struct input_bitstream *is)
+{
+	const u32 n = ws->compat_bitsleft;
+
+	is->bitsleft = n;
+	is->bitbuf = n ? ((u32)(ws->bitbuf >> 32) >> (32 - n)) << (32 - n) : 0;
+	if (unlikely(ws->overrun))
+		is->next = ws->end;
+	else
+		is->next = ws->next - (ws->bitsleft - n) / 8;
+}
+
+static inline void
+wide_bitstream_refill_slow(struct wide_input_bitstream *ws)
+{
+	while (ws->bitsleft <= 48) {
+		if (unlikely(ws->end - ws->next < 2)) {
+			ws->bitsleft = 64;
+			ws->overrun = 1;
+			return;
+		}
+		ws->bitbuf |= (u64)get_unaligned_le16(ws->next) <<
+			      (48 - ws->bitsleft);
+		ws->next += 2;
+		ws->bitsleft += 16;
+	}
+}
+
+/* Ensure the bit buffer contains at least @num_bits bits, where @num_bits is
+ * at most 48.  As with bitstream_ensure_bits(), data past the end of the input
+ * buffer is assumed to be zeroes.  */
+static forceinline void
+wide_bitstream_ensure_bits(struct wide_input_bitstream *ws,
+			   const unsigned num_bits)
+{
+	u64 v;
+	unsigned num_units;
+
+	if (ws->bitsleft >= num_bits)
+		return;
+
+	if (unlikely(ws->end - ws->next < 8)) {
+		wide_bitstream_refill_slow(ws);
+		return;
+	}
+
+	/* Load the next 4 coding units, and put them in order from high to
+	 * low by reversing their order within the word.  Add as many whole
+	 * units as fit; the rest just fills the low bits with the same bits
+	 * that the next refill will add.  */
+	v = get_unaligned_le64(ws->next);
+	v = (v << 32) | (v >> 32);
+	v = ((v & 0x0000FFFF0000FFFF) << 16) | ((v >> 16) & 0x0000FFFF0000FFFF);
+	num_units = (63 - ws->bitsleft) / 16;
+	ws->bitbuf |= v >> ws->bitsleft;
+	ws->next += 2 * num_units;
+	ws->bitsleft += 16 * num_units;
+}
+
+/* Account for what bitstream_ensure_bits(@num_bits) would have done in the
+ * 16-bit bitstream, as described above.  */
+static forceinline void
+wide_bitstream_compat_ensure_bits(struct wide_input_bitstream *ws,
+				  const unsigned num_bits)
+{
+	if (ws->compat_bitsleft < num_bits)
+		ws->compat_bitsleft += 16;
+	if (num_bits == 17 && ws->compat_bitsleft < num_bits)
+		ws->compat_bitsleft += 16;
+}
+
+/* Return the next @num_bits bits from the wide bitstream, without removing
+ * them.  */
+static forceinline u32
+wide_bitstream_peek_bits(const struct wide_input_bitstream *ws,
+			 const unsigned num_bits)
+{
+	return (ws->bitbuf >> 1) >> (sizeof(ws->bitbuf) * 8 - num_bits - 1);
+}
+
+/* Remove @num_bits from the wide bitstream.  */
+static forceinline void
+wide_bitstream_remove_bits(struct wide_input_bitstream *ws, unsigned num_bits)
+{
+	ws->bitbuf <<= num_bits;
+	ws->bitsleft -= num_bits;
+	ws->compat_bitsleft -= num_bits;
+}
+
+/* Remove and return the next @num_bits bits from the wide bitstream.  There
+ * must be at least @num_bits in the buffer, from a previous call to
+ * wide_bitstream_ensure_bits().  */
+static forceinline u32
+wide_bitstream_pop_bits(struct wide_input_bitstream *ws, unsigned num_bits)
+{
+	u32 bits;
+
+	wide_bitstream_compat_ensure_bits(ws, num_bits);
+	bits = wide_bitstream_peek_bits(ws, num_bits);
+	wide_bitstream_remove_bits(ws, num_bits);
+	return bits;
+}
+
 /******************************************************************************/
 /*                             Huffman decoding                               */
 /*----------------------------------------------------------------------------*/
@@ -291,6 +463,39 @@ read_huffsym(struct input_bitstream *is, const u16 decode_table[],
 	return symbol;
 }
 
+/*
+ * Like read_huffsym(), but read from a wide bitstream.  There must be at least
+ * @max_codeword_len bits in the buffer, from a previous call to
+ * wide_bitstream_ensure_bits().
+ */
+static forceinline unsigned
+read_huffsym_wide(struct wide_input_bitstream *ws, const u16 decode_table[],
+		  unsigned table_bits, unsigned max_codeword_len)
+{
+	unsigned entry;
+	unsigned symbol;
+	unsigned length;
+
+	wide_bitstream_compat_ensure_bits(ws, max_codeword_len);
+
+	entry = decode_table[wide_bitstream_peek_bits(ws, table_bits)];
+	symbol = entry >> DECODE_TABLE_SYMBOL_SHIFT;
+	length = entry & DECODE_TABLE_LENGTH_MASK;
+
+	if (max_codeword_len > table_bits &&
+	    entry >= (1U << (table_bits + DECODE_TABLE_SYMBOL_SHIFT)))
+	{
+		/* Subtable required */
+		wide_bitstream_remove_bits(ws, table_bits);
+		entry = decode_table[symbol + wide_bitstream_peek_bits(ws, length)];
+		symbol = entry >> DECODE_TABLE_SYMBOL_SHIFT;
+		length = entry & DECODE_TABLE_LENGTH_MASK;
+	}
+
+	wide_bitstream_remove_bits(ws, length);
+	return symbol;
+}
+
 /*
  * The DECODE_TABLE_ENOUGH() macro evaluates to the maximum number of decode
  * table entries, including all subtable entries, that may be required for
@@ -416,6 +621,23 @@ make_huffman_decode_table(u16 decode_table[], unsigned num_syms,
 			  unsigned table_bits, const u8 lens[],
 			  unsigned max_codeword_len, u16 working_space[]);
 
+/*
+ * Each pair table entry is 32 bits.  If the bits with which the entry was
+ * indexed begin with the codeword of a literal, then the entry contains the
+ * number of literals it decodes (1 or 2) in bits 24-31, the first literal in
+ * bits 8-15, the second literal (if any) in bits 16-23, and the total length of
+ * their codewords in bits 0-7.  Otherwise it's 0.
+ */
+#define PAIR_TABLE_ENTRY(count, sym1, sym2, length) \
+	(((u32)(count) << 24) | ((u32)(sym2) << 16) | ((u32)(sym1) << 8) | \
+	 (length))
+#define PAIR_TABLE_COUNT_SHIFT	24
+#define PAIR_TABLE_LENGTH_MASK	0xFF
+
+extern void
+make_huffman_pair_table(u32 pair_table[], const u16 decode_table[],
+			unsigned table_bits, unsigned num_literals);
+
 /******************************************************************************/
 /*                             LZ match copying                               */
 /*----------------------------------------------------------------------------*/
@@ -426,6 +648,14 @@ copy_word_unaligned(const void *src, void *dst)
 	store_word_unaligned(load_word_unaligned(src), dst);
 }
 
+/* Copy 16 bytes which don't overlap.  On x86_64 and arm64 a fixed-size
+ * memcpy() like this compiles to one 16-byte vector load and store.  */
+static forceinline void
+copy_16_bytes_unaligned(const void *src, void *dst)
+{
+	memcpy(dst, src, 16);
+}
+
 static forceinline machine_word_t
 repeat_u16(u16 b)
 {
@@ -501,18 +731,26 @@ lz_copy(u32 length, u32 offset, u8 *out_begin, u8 *out_next, u8 *out_end,
 	 * example, if a word is 8 bytes and the match is of length 5, then
 	 * we'll simply copy 8 bytes.  This is okay as long as we don't write
 	 * beyond the end of the output buffer, hence the check for (out_end -
-	 * end >= WORDBYTES - 1).
+	 * end >= WORDBYTES - 1).  The decompressors write directly into the
+	 * caller's buffers, so there's no slack after the end; only the last
+	 * few bytes of the buffer have to be copied bytewise.
 	 */
 	if (UNALIGNED_ACCESS_IS_FAST && likely(out_end - end >= WORDBYTES - 1))
 	{
-		if (offset >= WORDBYTES) {
+		if (offset >= 16 && likely(out_end - end >= 15)) {
+			/* Long matches are copied 16 bytes at a time. */
+			do {
+				copy_16_bytes_unaligned(src, out_next);
+				src += 16;
+				out_next += 16;
+			} while (out_next < end);
+		} else if (offset >= WORDBYTES) {
 			/* The source and destination words don't overlap. */
 			do {
 				copy_word_unaligned(src, out_next);
 				src += WORDBYTES;
 				out_next += WORDBYTES;
 			} while (out_next < end);
-			return 0;
 		} else if (offset == 1) {
 			/* Offset 1 matches are equivalent to run-length
 			 * encoding of the previous byte.  This case is common
@@ -520,20 +758,27 @@ lz_copy(u32 length, u32 offset, u8 *out_begin, u8 *out_next, u8 *out_end,
 			machine_word_t v = repeat_byte(*(out_next - 1));
 			do {
 				store_word_unaligned(v, out_next);
-				src += WORDBYTES;
 				out_next += WORDBYTES;
 			} while (out_next < end);
-			return 0;
+		} else {
+			/*
+			 * 1 < offset < WORDBYTES.  The source and destination
+			 * words overlap, so only the first 'offset' bytes of
+			 * each word copied are correct.  But the rest are
+			 * overwritten by the next word, which is copied from
+			 * 'offset' bytes further on, where the bytes now have
+			 * their final values.  So copy a word at a time while
+			 * advancing by 'offset' bytes.  This repeats the
+			 * pattern of the last 'offset' bytes several bytes at
+			 * a time, rather than one byte at a time.
+			 */
+			do {
+				copy_word_unaligned(src, out_next);
+				src += offset;
+				out_next += offset;
+			} while (out_next < end);
 		}
-		/*
-		 * We don't bother with special cases for other 'offset <
-		 * WORDBYTES', which are usually rarer than 'offset == 1'.
-		 * Extra checks will just slow things down.  Actually, it's
-		 * possible to handle all the 'offset < WORDBYTES' cases using
-		 * the same code, but it still becomes more complicated doesn't
-		 * seem any faster overall; it definitely slows down the more
-		 * common 'offset == 1' case.
-		 */
+		return 0;
 	}
 
 	/* Fall back to a bytewise copy.  */
@@ -0,0 +1,364 @@
+/*
+ * decompress_pool.c - Parallel decompression of independent chunks
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every chunk of a system-compressed file can be decompressed independently, so
+ * a large read which spans many chunks can be decompressed by several threads
+ * at once.  This file implements a pool of worker threads for that purpose.
+ *
+ * libntfs-3g is not thread-safe, so the worker threads never touch NTFS-3G
+ * objects.  Instead, the thread handling the read request reads the compressed
+ * data of runs of consecutive chunks into the batch's staging buffer, then adds
+ * a job for each chunk to the batch which describes where the chunk's
+ * compressed data is and where its uncompressed data should go.  Worker threads
+ * start decompressing as soon as jobs are added, while the reading thread
+ * continues to read the compressed data of later chunks.  When all chunks have
+ * been added, the reading thread helps with the remaining jobs, then waits for
+ * the worker threads to finish.
+ *
+ * Each worker thread has its own LZX and XPRESS decompressors.  The reading
+ * thread uses the decompressor from its decompression context.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ntfs-3g/misc.h>
+
+#include "decompress_pool.h"
+#include "system_compression.h"
+
+/* The size of the staging buffer for compressed data.  When it or the maximum
+ * number of jobs is reached, the batch must be finished and another one
+ * started.  */
+#define STAGING_BUFFER_SIZE	(1 << 20)
+
+/* The maximum number of threads that may be requested  */
+#define MAX_THREADS		64
+
+struct decompress_job {
+	const void *compressed_data;
+	void *uncompressed_data;
+	u32 compressed_size;
+	u32 uncompressed_size;
+	int result;
+};
+
+struct decompress_batch {
+	/* Whether the jobs use LZX (otherwise XPRESS), and the decompressor to
+	 * use for jobs run by the thread which owns the batch  */
+	int is_lzx;
+	void *decompressor;
+
+	/* The jobs.  Jobs 'next_job' through 'num_jobs - 1' have not been
+	 * started yet.  'num_done' jobs have been completed.  */
+	struct decompress_job jobs[DECOMPRESS_BATCH_MAX_JOBS];
+	unsigned num_jobs;
+	unsigned next_job;
+	unsigned num_done;
+
+	/* The buffer for compressed data, and how much of it is in use  */
+	u8 *staging_buffer;
+	u32 staging_used;
+};
+
+struct worker {
+	pthread_t thread;
+	struct lzx_decompressor *lzx;
+	struct xpress_decompressor *xpress;
+};
+
+static struct {
+	pthread_mutex_t lock;
+
+	/* Signaled when jobs are added or when the workers should exit  */
+	pthread_cond_t work_cond;
+
+	/* Signaled when a job has been completed  */
+	pthread_cond_t done_cond;
+
+	/* The requested number of threads, including the reading thread  */
+	unsigned num_threads;
+
+	/* The worker threads which have been started, if any  */
+	struct worker *workers;
+	unsigned num_workers;
+	int started;
+	int exiting;
+
+	/* The batch currently being processed, or NULL  */
+	struct decompress_batch *active;
+
+	struct decompress_batch batch;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+	.num_threads = 1,
+};
+
+/*
+ * Set the number of threads which may decompress the chunks of a single read
+ * request, including the thread which handles the request.  1 disables
+ * parallel decompression.  This only has an effect if it's called before the
+ * first batch is started.
+ */
+void
+decompress_pool_set_threads(unsigned num_threads)
+{
+	pool.num_threads = max(1U, min(num_threads, (unsigned)MAX_THREADS));
+}
+
+static int
+run_job(struct decompress_job *job, int is_lzx, void *decompressor)
+{
+	/* Chunks stored uncompressed just need to be copied.  */
+	if (job->compressed_size == job->uncompressed_size) {
+		memcpy(job->uncompressed_data, job->compressed_data,
+		       job->uncompressed_size);
+		return 0;
+	}
+	if (is_lzx)
+		return lzx_decompress(decompressor,
+				      job->compressed_data,
+				      job->compressed_size,
+				      job->uncompressed_data,
+				      job->uncompressed_size);
+	else
+		return xpress_decompress(decompressor,
+					 job->compressed_data,
+					 job->compressed_size,
+					 job->uncompressed_data,
+					 job->uncompressed_size);
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct worker *w = arg;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		struct decompress_batch *batch = pool.active;
+		struct decompress_job *job;
+
+		if (pool.exiting)
+			break;
+
+		if (!batch || batch->next_job == batch->num_jobs) {
+			pthread_cond_wait(&pool.work_cond, &pool.lock);
+			continue;
+		}
+
+		job = &batch->jobs[batch->next_job++];
+		pthread_mutex_unlock(&pool.lock);
+
+		job->result = run_job(job, batch->is_lzx,
+				      batch->is_lzx ? (void *)w->lzx :
+						      (void *)w->xpress);
+
+		pthread_mutex_lock(&pool.lock);
+		batch->num_done++;
+		pthread_cond_signal(&pool.done_cond);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static void
+free_worker(struct worker *w)
+{
+	lzx_free_decompressor(w->lzx);
+	xpress_free_decompressor(w->xpress);
+}
+
+/* Start the worker threads.  The pool lock must be held.  */
+static void
+start_workers(void)
+{
+	pool.started = 1;
+
+	pool.batch.staging_buffer = ntfs_malloc(STAGING_BUFFER_SIZE);
+	pool.workers = ntfs_calloc((pool.num_threads - 1) *
+				   sizeof(pool.workers[0]));
+	if (!pool.batch.staging_buffer || !pool.workers)
+		return;
+
+	while (pool.num_workers < pool.num_threads - 1) {
+		struct worker *w = &pool.workers[pool.num_workers];
+
+		w->lzx = lzx_allocate_decompressor(32768);
+		w->xpress = xpress_allocate_decompressor();
+		if (!w->lzx || !w->xpress ||
+		    pthread_create(&w->thread, NULL, worker_thread, w)) {
+			free_worker(w);
+			break;
+		}
+		pool.num_workers++;
+	}
+}
+
+/* Stop the worker threads before the plugin is unloaded.  */
+static void __attribute__((destructor))
+stop_workers(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.exiting = 1;
+	pthread_cond_broadcast(&pool.work_cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	while (pool.num_workers) {
+		struct worker *w = &pool.workers[--pool.num_workers];
+
+		pthread_join(w->thread, NULL);
+		free_worker(w);
+	}
+	free(pool.workers);
+	free(pool.batch.staging_buffer);
+}
+
+/*
+ * Start a batch of chunks to decompress in parallel.  @decompressor is the
+ * caller's decompressor for the format, which the caller's thread will use to
+ * help with the jobs.  Return NULL if parallel decompression is disabled or
+ * unavailable, or if another read's batch is in progress, in which case the
+ * caller should decompress the chunks itself.
+ */
+struct decompress_batch *
+decompress_pool_begin(int is_lzx, void *decompressor)
+{
+	struct decompress_batch *batch = &pool.batch;
+
+	if (pool.num_threads <= 1)
+		return NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	if (!pool.started)
+		start_workers();
+	if (!pool.num_workers || pool.active) {
+		pthread_mutex_unlock(&pool.lock);
+		return NULL;
+	}
+	batch->is_lzx = is_lzx;
+	batch->decompressor = decompressor;
+	batch->num_jobs = 0;
+	batch->next_job = 0;
+	batch->num_done = 0;
+	batch->staging_used = 0;
+	pool.active = batch;
+	pthread_mutex_unlock(&pool.lock);
+	return batch;
+}
+
+/*
+ * Return a pointer to the free space in the staging buffer of @batch, into
+ * which the compressed data of chunks may be read, or NULL if the batch doesn't
+ * have room for at least @min_size bytes and one more job.  The size of the
+ * free space and the number of jobs which may still be added are returned in
+ * *@size_ret and *@max_jobs_ret.
+ */
+void *
+decompress_batch_get_buffer(struct decompress_batch *batch, u32 min_size,
+			    u32 *size_ret, unsigned *max_jobs_ret)
+{
+	if (batch->num_jobs == DECOMPRESS_BATCH_MAX_JOBS ||
+	    STAGING_BUFFER_SIZE - batch->staging_used < min_size)
+		return NULL;
+	*size_ret = STAGING_BUFFER_SIZE - batch->staging_used;
+	*max_jobs_ret = DECOMPRESS_BATCH_MAX_JOBS - batch->num_jobs;
+	return &batch->staging_buffer[batch->staging_used];
+}
+
+/*
+ * Add a job to @batch.  The compressed data of the jobs must have been read, in
+ * the order the jobs are added, into the space returned by the last call to
+ * decompress_batch_get_buffer(); @compressed_data must be where the previous
+ * job's data ended.  If @compressed_size is equal to @uncompressed_size, then
+ * the chunk is stored uncompressed and is just copied.  A worker thread may
+ * begin decompressing into @uncompressed_data immediately.
+ */
+void
+decompress_batch_add(struct decompress_batch *batch,
+		     const void *compressed_data, u32 compressed_size,
+		     void *uncompressed_data, u32 uncompressed_size)
+{
+	struct decompress_job *job = &batch->jobs[batch->num_jobs];
+
+	job->compressed_data = compressed_data;
+	job->compressed_size = compressed_size;
+	job->uncompressed_data = uncompressed_data;
+	job->uncompressed_size = uncompressed_size;
+	batch->staging_used += compressed_size;
+
+	pthread_mutex_lock(&pool.lock);
+	batch->num_jobs++;
+	pthread_cond_signal(&pool.work_cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Skip @size bytes of the space returned by the last call to
+ * decompress_batch_get_buffer(), which hold the compressed data of a chunk that
+ * the caller handled itself rather than adding a job for it.
+ */
+void
+decompress_batch_skip(struct decompress_batch *batch, u32 size)
+{
+	batch->staging_used += size;
+}
+
+/*
+ * Finish @batch: help run its remaining jobs, then wait for all of them to
+ * complete.  Return NULL if all chunks were decompressed successfully;
+ * otherwise return the uncompressed data pointer of the first job, in the order
+ * they were added, that failed.
+ */
+void *
+decompress_batch_finish(struct decompress_batch *batch)
+{
+	void *failed = NULL;
+	unsigned i;
+
+	pthread_mutex_lock(&pool.lock);
+	while (batch->next_job != batch->num_jobs) {
+		struct decompress_job *job = &batch->jobs[batch->next_job++];
+
+		pthread_mutex_unlock(&pool.lock);
+		job->result = run_job(job, batch->is_lzx, batch->decompressor);
+		pthread_mutex_lock(&pool.lock);
+		batch->num_done++;
+	}
+	while (batch->num_done != batch->num_jobs)
+		pthread_cond_wait(&pool.done_cond, &pool.lock);
+
+	/* Check the results before releasing the batch to the next read.  */
+	for (i = 0; i < batch->num_jobs; i++) {
+		if (batch->jobs[i].result) {
+			failed = batch->jobs[i].uncompressed_data;
+			break;
+		}
+	}
+	pool.active = NULL;
+	pthread_mutex_unlock(&pool.lock);
+	return failed;
+}
@@ -0,0 +1,38 @@
+/*
+ * decompress_pool.h
+ *
+ * Declarations for the pool of threads which decompress chunks in parallel.
+ */
+
+#ifndef _DECOMPRESS_POOL_H
+#define _DECOMPRESS_POOL_H
+
+#include "common_defs.h"
+
+/* The maximum number of jobs in a batch  */
+#define DECOMPRESS_BATCH_MAX_JOBS	256
+
+struct decompress_batch;
+
+extern void
+decompress_pool_set_threads(unsigned num_threads);
+
+extern struct decompress_batch *
+decompress_pool_begin(int is_lzx, void *decompressor);
+
+extern void *
+decompress_batch_get_buffer(struct decompress_batch *batch, u32 min_size,
+			    u32 *size_ret, unsigned *max_jobs_ret);
+
+extern void
+decompress_batch_add(struct decompress_batch *batch,
+		     const void *compressed_data, u32 compressed_size,
+		     void *uncompressed_data, u32 uncompressed_size);
+
+extern void
+decompress_batch_skip(struct decompress_batch *batch, u32 size);
+
+extern void *
+decompress_batch_finish(struct decompress_batch *batch);
+
+#endif /* _DECOMPRESS_POOL_H */
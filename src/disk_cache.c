@@ -0,0 +1,484 @@
+/*
+ * disk_cache.c - Persistent cache of decompressed chunks
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The shared chunk cache only lasts until the volume is unmounted.  Systems
+ * which mount the same images over and over decompress the same files every
+ * time.  So decompressed chunks can also be kept in a directory, where later
+ * mounts will find them.  Reading a chunk back from there costs a copy, usually
+ * from the page cache, and a checksum, which is much cheaper than decompressing
+ * it.
+ *
+ * The directory has a subdirectory for each volume, named by the volume serial
+ * number from the boot sector.  It holds a cache file for each file, named by
+ * the file's MFT reference, which includes the sequence number of its MFT
+ * record.  A cache file begins with a header describing the file.  If the
+ * file's compression format, sizes, or MFT record change time don't match the
+ * header, then the file has been rewritten since it was cached, and the cache
+ * file is emptied.
+ *
+ * The header is followed by a table of the Adler-32 checksums of the cached
+ * chunks, with 0 for each chunk that isn't cached.  The chunks themselves
+ * follow at fixed positions, so cache files are sparse.  A chunk's data is
+ * written before its checksum, and it's only used if it matches its checksum,
+ * so a chunk that was being written during a crash is never used.
+ *
+ * The directory has a maximum size.  It's checked when the first cache file is
+ * opened, and again each time another sixteenth of the maximum size has been
+ * written.  If it's too large, then the least recently used cache files are
+ * deleted until it's at most 7/8 full.  A cache file's modification time is
+ * updated whenever it's opened, so it shows when the file was last used.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ntfs-3g/device.h>
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/misc.h>
+
+#include "disk_cache.h"
+
+/* The default maximum size in bytes of the cache directory  */
+#define DEFAULT_MAX_SIZE	((u64)1 << 30)
+
+/* "WOFCACHE", and the version of the cache file format  */
+#define HEADER_MAGIC		0x4548434143464F57ULL
+#define HEADER_VERSION		1
+
+/* The alignment of the chunk data in a cache file  */
+#define DATA_ALIGNMENT		4096
+
+struct disk_cache_header {
+	le64 magic;
+	le32 version;
+	le32 format;
+	le64 uncompressed_size;
+	le64 compressed_size;
+	le64 change_time;
+} __attribute__((packed));
+
+struct disk_cache_file {
+	int fd;
+	u32 chunk_order;
+
+	/* The offset of the first chunk's data in the cache file  */
+	u64 data_offset;
+};
+
+/* The serial number of a volume, or 'ok == 0' if it couldn't be read  */
+struct cache_volume {
+	const ntfs_volume *vol;
+	u64 serial;
+	int ok;
+	struct cache_volume *next;
+};
+
+/* A cache file found when checking the size of the directory  */
+struct cached_file_info {
+	char *path;
+	time_t mtime;
+	u64 size;
+};
+
+static struct {
+	/* The cache directory, or NULL if the cache is disabled, and its
+	 * maximum size  */
+	char *dir;
+	u64 max_size;
+
+	/* The volumes whose serial numbers have been read, the number of bytes
+	 * written since the size of the directory was last checked, and whether
+	 * it has been checked at all.  These are protected by 'lock'.  */
+	pthread_mutex_t lock;
+	struct cache_volume *volumes;
+	u64 written;
+	int checked;
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.max_size = DEFAULT_MAX_SIZE,
+};
+
+/*
+ * Set the directory in which to keep decompressed chunks between mounts, or
+ * NULL to disable the cache, which is the default.  This only affects files
+ * opened after it's called.  On failure, return -1 and set errno.
+ */
+int
+disk_cache_set_dir(const char *dir)
+{
+	char *copy = NULL;
+
+	if (dir) {
+		copy = strdup(dir);
+		if (!copy)
+			return -1;
+	}
+	free(cache.dir);
+	cache.dir = copy;
+	return 0;
+}
+
+/* Set the maximum size in bytes of the cache directory.  */
+void
+disk_cache_set_max_size(u64 max_size)
+{
+	cache.max_size = max_size;
+}
+
+static u32
+adler32(const u8 *p, size_t len)
+{
+	u32 s1 = 1, s2 = 0;
+
+	while (len) {
+		/* 5552 is the most bytes that can be summed before 's2' might
+		 * overflow.  */
+		size_t n = min(len, (size_t)5552);
+
+		len -= n;
+		do {
+			s1 += *p++;
+			s2 += s1;
+		} while (--n);
+		s1 %= 65521;
+		s2 %= 65521;
+	}
+	return (s2 << 16) | s1;
+}
+
+/* Get the serial number of @vol from its boot sector.  The cache's lock must be
+ * held.  */
+static int
+get_volume_serial(const ntfs_volume *vol, u64 *serial_ret)
+{
+	struct cache_volume *v;
+	NTFS_BOOT_SECTOR bs;
+
+	for (v = cache.volumes; v; v = v->next)
+		if (v->vol == vol)
+			goto out;
+
+	v = ntfs_calloc(sizeof(*v));
+	if (!v)
+		return -1;
+	v->vol = vol;
+	if (ntfs_pread(vol->dev, 0, sizeof(bs), &bs) == sizeof(bs)) {
+		v->serial = le64_to_cpu(bs.volume_serial_number);
+		v->ok = 1;
+	}
+	v->next = cache.volumes;
+	cache.volumes = v;
+out:
+	*serial_ret = v->serial;
+	return v->ok ? 0 : -1;
+}
+
+/* Forget the serial number of @vol, which is being unmounted, so that another
+ * volume mounted later at the same address gets its own.  */
+void
+disk_cache_forget_volume(const ntfs_volume *vol)
+{
+	struct cache_volume **pp, *v;
+
+	pthread_mutex_lock(&cache.lock);
+	for (pp = &cache.volumes; (v = *pp); pp = &v->next) {
+		if (v->vol == vol) {
+			*pp = v->next;
+			free(v);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static int
+cmp_mtime(const void *p1, const void *p2)
+{
+	const struct cached_file_info *f1 = p1, *f2 = p2;
+
+	if (f1->mtime != f2->mtime)
+		return f1->mtime < f2->mtime ? -1 : 1;
+	return 0;
+}
+
+/* Append to @path, which has space for PATH_MAX bytes, a separator and @name.
+ * Return -1 if it doesn't fit.  */
+static int
+append_path(char *path, size_t len, const char *name)
+{
+	int n = snprintf(path + len, PATH_MAX - len, "/%s", name);
+
+	return (n < 0 || (size_t)n >= PATH_MAX - len) ? -1 : len + n;
+}
+
+/*
+ * Delete the least recently used cache files until the directory is at most 7/8
+ * of its maximum size, if it's larger than the maximum.  Errors are ignored;
+ * files which can't be examined are just left alone.  The cache's lock must be
+ * held.
+ */
+static void
+limit_size(void)
+{
+	struct cached_file_info *files = NULL;
+	size_t num_files = 0, max_files = 0;
+	u64 total = 0;
+	char path[PATH_MAX];
+	DIR *dir, *subdir;
+	struct dirent *d, *sd;
+	int len, sublen;
+	size_t i;
+
+	len = snprintf(path, sizeof(path), "%s", cache.dir);
+	if (len < 0 || len >= PATH_MAX)
+		return;
+	dir = opendir(cache.dir);
+	if (!dir)
+		return;
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		sublen = append_path(path, len, d->d_name);
+		if (sublen < 0)
+			continue;
+		subdir = opendir(path);
+		if (!subdir)
+			continue;
+		while ((sd = readdir(subdir))) {
+			struct stat st;
+			int n;
+
+			if (sd->d_name[0] == '.')
+				continue;
+			n = append_path(path, sublen, sd->d_name);
+			if (n < 0 || stat(path, &st) || !S_ISREG(st.st_mode))
+				continue;
+			if (num_files == max_files) {
+				size_t new_max = max(2 * max_files, (size_t)64);
+				void *p = realloc(files,
+						  new_max * sizeof(files[0]));
+				if (!p)
+					break;
+				files = p;
+				max_files = new_max;
+			}
+			files[num_files].path = strdup(path);
+			if (!files[num_files].path)
+				break;
+			files[num_files].mtime = st.st_mtime;
+			files[num_files].size = (u64)st.st_blocks * 512;
+			total += files[num_files].size;
+			num_files++;
+		}
+		closedir(subdir);
+	}
+	closedir(dir);
+
+	if (total > cache.max_size) {
+		qsort(files, num_files, sizeof(files[0]), cmp_mtime);
+		for (i = 0; i < num_files &&
+			    total > cache.max_size - cache.max_size / 8; i++) {
+			if (!unlink(files[i].path))
+				total -= files[i].size;
+		}
+	}
+	for (i = 0; i < num_files; i++)
+		free(files[i].path);
+	free(files);
+}
+
+/*
+ * Open the cache file for the file with MFT reference @mref on @vol, creating
+ * it if needed.  The other parameters describe the file; if they don't match
+ * the cache file, then it's emptied.  Return NULL if the cache is disabled or
+ * the cache file couldn't be opened; the caller should then just proceed
+ * without it.
+ */
+struct disk_cache_file *
+disk_cache_open(const ntfs_volume *vol, u64 mref, u64 change_time,
+		u32 format, u32 chunk_order, u64 uncompressed_size,
+		u64 compressed_size)
+{
+	const u64 num_chunks = (uncompressed_size +
+				((u64)1 << chunk_order) - 1) >> chunk_order;
+	struct disk_cache_header hdr, old_hdr;
+	struct disk_cache_file *file;
+	char path[PATH_MAX];
+	u64 serial;
+	int len;
+	int fd;
+
+	if (!cache.dir)
+		return NULL;
+
+	pthread_mutex_lock(&cache.lock);
+	if (get_volume_serial(vol, &serial)) {
+		pthread_mutex_unlock(&cache.lock);
+		return NULL;
+	}
+	if (!cache.checked) {
+		cache.checked = 1;
+		limit_size();
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	/* Create the directories if they don't exist yet.  */
+	len = snprintf(path, sizeof(path), "%s/%016llx", cache.dir,
+		       (unsigned long long)serial);
+	if (len < 0 || len >= PATH_MAX)
+		return NULL;
+	mkdir(cache.dir, 0700);
+	mkdir(path, 0700);
+	if (snprintf(path + len, PATH_MAX - len, "/%016llx",
+		     (unsigned long long)mref) >= PATH_MAX - len)
+		return NULL;
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return NULL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = cpu_to_le64(HEADER_MAGIC);
+	hdr.version = cpu_to_le32(HEADER_VERSION);
+	hdr.format = cpu_to_le32(format);
+	hdr.uncompressed_size = cpu_to_le64(uncompressed_size);
+	hdr.compressed_size = cpu_to_le64(compressed_size);
+	hdr.change_time = cpu_to_le64(change_time);
+
+	if (pread(fd, &old_hdr, sizeof(old_hdr), 0) == sizeof(old_hdr) &&
+	    !memcmp(&old_hdr, &hdr, sizeof(hdr))) {
+		/* Mark the cache file as recently used.  */
+		futimens(fd, NULL);
+	} else if (ftruncate(fd, 0) ||
+		   pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		close(fd);
+		return NULL;
+	}
+
+	file = ntfs_malloc(sizeof(*file));
+	if (!file) {
+		close(fd);
+		return NULL;
+	}
+	file->fd = fd;
+	file->chunk_order = chunk_order;
+	file->data_offset = (sizeof(hdr) + num_chunks * sizeof(le32) +
+			     DATA_ALIGNMENT - 1) & ~(u64)(DATA_ALIGNMENT - 1);
+	return file;
+}
+
+/* Return the checksum of chunk @chunk_idx in the cache file, or 0 if the chunk
+ * isn't cached.  */
+static u32
+get_checksum(struct disk_cache_file *file, u64 chunk_idx)
+{
+	le32 checksum;
+
+	if (pread(file->fd, &checksum, sizeof(checksum),
+		  sizeof(struct disk_cache_header) +
+		  chunk_idx * sizeof(checksum)) != sizeof(checksum))
+		return 0;
+	return le32_to_cpu(checksum);
+}
+
+/*
+ * Read the @size bytes of uncompressed data of chunk @chunk_idx from the cache
+ * file into @buf.  Return 0 if they were read and match their checksum, or -1
+ * if the chunk isn't cached.
+ */
+int
+disk_cache_read(struct disk_cache_file *file, u64 chunk_idx, void *buf,
+		u32 size)
+{
+	const u32 checksum = get_checksum(file, chunk_idx);
+
+	if (!checksum ||
+	    pread(file->fd, buf, size,
+		  file->data_offset + (chunk_idx << file->chunk_order)) !=
+		  (ssize_t)size ||
+	    adler32(buf, size) != checksum)
+		return -1;
+	return 0;
+}
+
+/* Return true if chunk @chunk_idx is in the cache file.  */
+int
+disk_cache_contains(struct disk_cache_file *file, u64 chunk_idx)
+{
+	return get_checksum(file, chunk_idx) != 0;
+}
+
+/*
+ * Write the @size bytes of uncompressed data of chunk @chunk_idx to the cache
+ * file, unless it's already there, then delete old cache files if the directory
+ * may have grown too large.  Errors are ignored.
+ */
+void
+disk_cache_write(struct disk_cache_file *file, u64 chunk_idx,
+		 const void *data, u32 size)
+{
+	u32 checksum;
+	le32 entry;
+
+	if (disk_cache_contains(file, chunk_idx))
+		return;
+
+	/* Chunks whose checksum happens to be 0 can't be cached.  */
+	checksum = adler32(data, size);
+	if (!checksum)
+		return;
+
+	if (pwrite(file->fd, data, size,
+		   file->data_offset + (chunk_idx << file->chunk_order)) !=
+	    (ssize_t)size)
+		return;
+	entry = cpu_to_le32(checksum);
+	if (pwrite(file->fd, &entry, sizeof(entry),
+		   sizeof(struct disk_cache_header) +
+		   chunk_idx * sizeof(entry)) != sizeof(entry))
+		return;
+
+	pthread_mutex_lock(&cache.lock);
+	cache.written += size;
+	if (cache.written >= cache.max_size / 16) {
+		cache.written = 0;
+		limit_size();
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+void
+disk_cache_close(struct disk_cache_file *file)
+{
+	if (file) {
+		close(file->fd);
+		free(file);
+	}
+}
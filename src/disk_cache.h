@@ -0,0 +1,44 @@
+/*
+ * disk_cache.h
+ *
+ * Declarations for the persistent cache of decompressed chunks.
+ */
+
+#ifndef _DISK_CACHE_H
+#define _DISK_CACHE_H
+
+#include <ntfs-3g/volume.h>
+
+#include "common_defs.h"
+
+struct disk_cache_file;
+
+extern int
+disk_cache_set_dir(const char *dir);
+
+extern void
+disk_cache_set_max_size(u64 max_size);
+
+extern void
+disk_cache_forget_volume(const ntfs_volume *vol);
+
+extern struct disk_cache_file *
+disk_cache_open(const ntfs_volume *vol, u64 mref, u64 change_time,
+		u32 format, u32 chunk_order, u64 uncompressed_size,
+		u64 compressed_size);
+
+extern int
+disk_cache_read(struct disk_cache_file *file, u64 chunk_idx, void *buf,
+		u32 size);
+
+extern int
+disk_cache_contains(struct disk_cache_file *file, u64 chunk_idx);
+
+extern void
+disk_cache_write(struct disk_cache_file *file, u64 chunk_idx,
+		 const void *data, u32 size);
+
+extern void
+disk_cache_close(struct disk_cache_file *file);
+
+#endif /* _DISK_CACHE_H */
@@ -0,0 +1,167 @@
+/*
+ * latency.c - Latency histograms of the stages of reading chunks
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The counters in the decompression statistics give totals, but not how the
+ * time is distributed, so they can't tell a uniformly slow device from one
+ * whose reads occasionally stall.  When built with --enable-tracing, each read
+ * of the compressed stream and each decompression done by a reading thread is
+ * timed and counted in a histogram for its stage.
+ *
+ * The histograms have logarithmic buckets, as in HdrHistogram: four per power
+ * of two, so each bucket's upper bound is at most 25% above its lower bound,
+ * whatever the magnitude.  Recording a latency is a few relaxed atomic
+ * increments, so that many threads can record latencies without contending for
+ * a lock.  The histograms are global, since tail latencies matter across all
+ * files, not per file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+#include "system_compression.h"
+
+/* The base 2 logarithm of the number of buckets per power of two  */
+#define SUB_BUCKET_ORDER	2
+#define SUB_BUCKETS		(1 << SUB_BUCKET_ORDER)
+
+/* Return the smallest latency counted by bucket @i, which may be
+ * NTFS_DECOMPRESSION_HISTOGRAM_BUCKETS for the end of the last bucket.  The
+ * first SUB_BUCKETS latencies each have their own bucket.  */
+static u64
+bucket_min(unsigned i)
+{
+	const unsigned order = (i >> SUB_BUCKET_ORDER) + SUB_BUCKET_ORDER - 1;
+
+	if (i < SUB_BUCKETS)
+		return i;
+	if (order >= 64)
+		return UINT64_MAX;
+	return (u64)(SUB_BUCKETS + (i & (SUB_BUCKETS - 1))) <<
+	       (order - SUB_BUCKET_ORDER);
+}
+
+/*
+ * Return the latency, in nanoseconds, below which @percentile percent of the
+ * latencies counted in @hist fall.  It's the upper bound of the bucket where
+ * that percentile falls, or the maximum latency recorded if that's lower.  If
+ * @hist is empty, return 0.
+ */
+u64
+latency_percentile(const struct ntfs_system_decompression_histogram *hist,
+		   double percentile)
+{
+	const double target = hist->count * (percentile / 100);
+	u64 seen = 0;
+	unsigned i;
+
+	if (hist->count == 0)
+		return 0;
+	for (i = 0; i < NTFS_DECOMPRESSION_HISTOGRAM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target && seen != 0)
+			return min(bucket_min(i + 1) - 1, hist->max_ns);
+	}
+	return hist->max_ns;
+}
+
+#ifdef ENABLE_TRACING
+
+static struct ntfs_system_decompression_histogram
+	histograms[NTFS_DECOMPRESSION_NUM_STAGES];
+
+/* Return the index of the bucket which counts latencies of @ns nanoseconds;
+ * the inverse of bucket_min().  */
+static unsigned
+bucket_index(u64 ns)
+{
+	unsigned order;
+
+	if (ns < SUB_BUCKETS)
+		return ns;
+	order = bsr64(ns);
+	return ((order - SUB_BUCKET_ORDER + 1) << SUB_BUCKET_ORDER) +
+	       ((ns >> (order - SUB_BUCKET_ORDER)) & (SUB_BUCKETS - 1));
+}
+
+/* Return the current time in nanoseconds, for timing a stage.  */
+u64
+latency_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count an operation of @stage which took @ns nanoseconds.  */
+void
+latency_record(unsigned stage, u64 ns)
+{
+	struct ntfs_system_decompression_histogram *hist = &histograms[stage];
+	u64 max_ns = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->buckets[bucket_index(ns)], 1,
+			   __ATOMIC_RELAXED);
+	while (ns > max_ns &&
+	       !__atomic_compare_exchange_n(&hist->max_ns, &max_ns, ns, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Copy the histogram of @stage into @hist.  Operations which are being
+ * recorded at the same time may be partly included.  */
+int
+latency_get(unsigned stage, struct ntfs_system_decompression_histogram *hist)
+{
+	const struct ntfs_system_decompression_histogram *src;
+	unsigned i;
+
+	if (stage >= NTFS_DECOMPRESSION_NUM_STAGES) {
+		errno = EINVAL;
+		return -1;
+	}
+	src = &histograms[stage];
+	hist->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	hist->total_ns = __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+	hist->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+	for (i = 0; i < NTFS_DECOMPRESSION_HISTOGRAM_BUCKETS; i++)
+		hist->buckets[i] = __atomic_load_n(&src->buckets[i],
+						   __ATOMIC_RELAXED);
+	return 0;
+}
+
+#else /* ENABLE_TRACING */
+
+int
+latency_get(unsigned stage, struct ntfs_system_decompression_histogram *hist)
+{
+	(void)stage;
+	memset(hist, 0, sizeof(*hist));
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif /* !ENABLE_TRACING */
@@ -0,0 +1,55 @@
+/*
+ * latency.h
+ *
+ * Declarations for the latency histograms and tracepoints of the stages of
+ * reading chunks, which are only compiled in with --enable-tracing.
+ */
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include "common_defs.h"
+
+#if defined(ENABLE_TRACING) && defined(HAVE_SYS_SDT_H)
+#  include <sys/sdt.h>
+#  define trace_point(name, ...) \
+	STAP_PROBEV(ntfs_system_compression, name, ##__VA_ARGS__)
+#else
+#  define trace_point(name, ...)	do { } while (0)
+#endif
+
+struct ntfs_system_decompression_histogram;
+
+extern int
+latency_get(unsigned stage, struct ntfs_system_decompression_histogram *hist);
+
+extern u64
+latency_percentile(const struct ntfs_system_decompression_histogram *hist,
+		   double percentile);
+
+#ifdef ENABLE_TRACING
+
+extern u64
+latency_clock(void);
+
+extern void
+latency_record(unsigned stage, u64 ns);
+
+#else /* ENABLE_TRACING */
+
+static forceinline u64
+latency_clock(void)
+{
+	return 0;
+}
+
+static forceinline void
+latency_record(unsigned stage, u64 ns)
+{
+	(void)stage;
+	(void)ns;
+}
+
+#endif /* !ENABLE_TRACING */
+
+#endif /* _LATENCY_H */
@@ -25,16 +25,16 @@
 
 #include <string.h>
 
-#ifdef __SSE2__
-#  include <emmintrin.h>
-#endif
+#include "common_defs.h"
+#include "lzx_common.h"
 
-#ifdef __AVX2__
+#if X86_CPU_DISPATCH || defined(__SSE2__)
 #  include <immintrin.h>
 #endif
 
-#include "common_defs.h"
-#include "lzx_common.h"
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
 
 /* Mapping: offset slot => first match offset that uses that offset slot.
  * The offset slots for repeat offsets map to "fake" offsets < 1.  */
@@ -163,11 +163,13 @@ undo_translate_target(void *target, s32 input_pos)
  * in calculating the translated jump targets.  But in WIM files, this file size
  * is always the same (LZX_WIM_MAGIC_FILESIZE == 12000000).
  */
+typedef void (*e8_filter_func)(u8 *data, u32 start, u32 size,
+			       void (*process_target)(void *, s32));
+
 static void
-lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
+lzx_e8_filter_generic(u8 *data, u32 start, u32 size,
+		      void (*process_target)(void *, s32))
 {
-
-#if !defined(__SSE2__) && !defined(__AVX2__)
 	/*
 	 * A worthwhile optimization is to push the end-of-buffer check into the
 	 * relatively rare E8 case.  This is possible if we replace the last six
@@ -182,13 +184,13 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 	u8 saved_bytes[6];
 	u8 *p;
 
-	if (size <= 10)
+	if (size <= 10 || start >= size - 10)
 		return;
 
 	tail = &data[size - 6];
 	memcpy(saved_bytes, tail, 6);
 	memset(tail, 0xE8, 6);
-	p = data;
+	p = data + start;
 	for (;;) {
 		while (*p != 0xE8)
 			p++;
@@ -198,22 +200,26 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 		p += 5;
 	}
 	memcpy(tail, saved_bytes, 6);
-#else
-	/* SSE2 or AVX-2 optimized version for x86_64  */
+}
 
-	u8 *p = data;
+/*
+ * Template for the vectorized versions of the E8 filter.  @find_e8 returns a
+ * bitmask of the E8 bytes in the @block_size bytes at the given address, which
+ * is aligned to @block_size.  @block_size may be 32 or 64.
+ */
+static forceinline void
+lzx_e8_filter_vec(u8 *data, u32 start, u32 size,
+		  void (*process_target)(void *, s32),
+		  const unsigned block_size, u64 (*find_e8)(const u8 *))
+{
+	u8 *p = data + start;
 	u64 valid_mask = ~0;
 
 	if (size <= 10)
 		return;
-#ifdef __AVX2__
-#  define ALIGNMENT_REQUIRED 32
-#else
-#  define ALIGNMENT_REQUIRED 16
-#endif
 
 	/* Process one byte at a time until the pointer is properly aligned.  */
-	while ((uintptr_t)p % ALIGNMENT_REQUIRED != 0) {
+	while ((uintptr_t)p % block_size != 0) {
 		if (p >= data + size - 10)
 			return;
 		if (*p == 0xE8 && (valid_mask & 1)) {
@@ -225,7 +231,7 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 		valid_mask |= (u64)1 << 63;
 	}
 
-	if (data + size - p >= 64) {
+	if (data + size - p >= 2 * block_size) {
 
 		/* Vectorized processing  */
 
@@ -234,44 +240,20 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 		 * positioned so that it will never be changed by a previous
 		 * translation before it is detected.  */
 
-		u8 *trap = p + ((data + size - p) & ~31) - 32 + 4;
+		u8 *trap = p + ((data + size - p) & ~(block_size - 1)) -
+			   block_size + 4;
 		u8 saved_byte = *trap;
 		*trap = 0xE8;
 
 		for (;;) {
-			u32 e8_mask;
+			u64 e8_mask;
+			u64 next_valid_mask = ~0;
 			u8 *orig_p = p;
-		#ifdef __AVX2__
-			const __m256i e8_bytes = _mm256_set1_epi8(0xE8);
-			for (;;) {
-				__m256i bytes = *(const __m256i *)p;
-				__m256i cmpresult = _mm256_cmpeq_epi8(bytes, e8_bytes);
-				e8_mask = _mm256_movemask_epi8(cmpresult);
-				if (e8_mask)
-					break;
-				p += 32;
-			}
-		#else
-			const __m128i e8_bytes = _mm_set1_epi8(0xE8);
-			for (;;) {
-				/* Read the next 32 bytes of data and test them
-				 * for E8 bytes.  */
-				__m128i bytes1 = *(const __m128i *)p;
-				__m128i bytes2 = *(const __m128i *)(p + 16);
-				__m128i cmpresult1 = _mm_cmpeq_epi8(bytes1, e8_bytes);
-				__m128i cmpresult2 = _mm_cmpeq_epi8(bytes2, e8_bytes);
-				u32 mask1 = _mm_movemask_epi8(cmpresult1);
-				u32 mask2 = _mm_movemask_epi8(cmpresult2);
-				/* The masks have a bit set for each E8 byte.
-				 * We stay in this fast inner loop as long as
-				 * there are no E8 bytes.  */
-				if (mask1 | mask2) {
-					e8_mask = mask1 | (mask2 << 16);
-					break;
-				}
-				p += 32;
-			}
-		#endif
+
+			/* We stay in this fast inner loop as long as there are
+			 * no E8 bytes.  */
+			while (!(e8_mask = (*find_e8)(p)))
+				p += block_size;
 
 			/* Did we pass over data with no E8 bytes?  */
 			if (p != orig_p)
@@ -283,16 +265,19 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 
 			/* Process the E8 bytes.  However, the AND with
 			 * 'valid_mask' ensures we never process an E8 byte that
-			 * was itself part of a translation target.  */
+			 * was itself part of a translation target.  A target
+			 * may extend into the next block.  */
 			while ((e8_mask &= valid_mask)) {
-				unsigned bit = bsf32(e8_mask);
+				unsigned bit = bsf64(e8_mask);
 				(*process_target)(p + bit + 1, p + bit - data);
 				valid_mask &= ~((u64)0x1F << bit);
+				if (bit > block_size - 5)
+					next_valid_mask = ~((u64)0x1F >>
+							    (block_size - bit));
 			}
 
-			valid_mask >>= 32;
-			valid_mask |= 0xFFFFFFFF00000000;
-			p += 32;
+			valid_mask = next_valid_mask;
+			p += block_size;
 		}
 
 		*trap = saved_byte;
@@ -308,17 +293,141 @@ lzx_e8_filter(u8 *data, u32 size, void (*process_target)(void *, s32))
 		valid_mask >>= 1;
 		valid_mask |= (u64)1 << 63;
 	}
-#endif /* __SSE2__ || __AVX2__ */
+}
+
+#if X86_CPU_DISPATCH || defined(__SSE2__)
+#  if X86_CPU_DISPATCH
+#    define SSE2_TARGET	_target_attribute("sse2")
+#  else
+#    define SSE2_TARGET
+#  endif
+static forceinline SSE2_TARGET u64
+find_e8_sse2(const u8 *p)
+{
+	const __m128i e8_bytes = _mm_set1_epi8(0xE8);
+	__m128i bytes1 = *(const __m128i *)p;
+	__m128i bytes2 = *(const __m128i *)(p + 16);
+	u32 mask1 = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes1, e8_bytes));
+	u32 mask2 = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes2, e8_bytes));
+
+	return mask1 | (mask2 << 16);
+}
+
+static SSE2_TARGET void
+lzx_e8_filter_sse2(u8 *data, u32 start, u32 size,
+		   void (*process_target)(void *, s32))
+{
+	lzx_e8_filter_vec(data, start, size, process_target, 32,
+			  find_e8_sse2);
+}
+#  undef SSE2_TARGET
+#endif /* X86_CPU_DISPATCH || __SSE2__ */
+
+#if X86_CPU_DISPATCH
+static forceinline _target_attribute("avx2") u64
+find_e8_avx2(const u8 *p)
+{
+	__m256i bytes = *(const __m256i *)p;
+
+	return (u32)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(0xE8)));
+}
+
+static _target_attribute("avx2") void
+lzx_e8_filter_avx2(u8 *data, u32 start, u32 size,
+		   void (*process_target)(void *, s32))
+{
+	lzx_e8_filter_vec(data, start, size, process_target, 32,
+			  find_e8_avx2);
+}
+
+static forceinline _target_attribute("avx512bw") u64
+find_e8_avx512bw(const u8 *p)
+{
+	return _mm512_cmpeq_epi8_mask(_mm512_load_si512(p),
+				      _mm512_set1_epi8(0xE8));
+}
+
+static _target_attribute("avx512bw") void
+lzx_e8_filter_avx512bw(u8 *data, u32 start, u32 size,
+		       void (*process_target)(void *, s32))
+{
+	lzx_e8_filter_vec(data, start, size, process_target, 64,
+			  find_e8_avx512bw);
+}
+#endif /* X86_CPU_DISPATCH */
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+static forceinline u64
+find_e8_neon(const u8 *p)
+{
+	/* NEON has no movemask instruction, so give each byte of the
+	 * comparison results a different bit, then sum adjacent bytes until
+	 * each byte holds the mask for 8 bytes of data.  */
+	static const u8 bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+				     1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint8x16_t e8_bytes = vdupq_n_u8(0xE8);
+	const uint8x16_t weights = vld1q_u8(bits);
+	uint8x16_t mask1 = vandq_u8(vceqq_u8(vld1q_u8(p), e8_bytes), weights);
+	uint8x16_t mask2 = vandq_u8(vceqq_u8(vld1q_u8(p + 16), e8_bytes),
+				    weights);
+	uint8x16_t sum = vpaddq_u8(mask1, mask2);
+
+	sum = vpaddq_u8(sum, sum);
+	sum = vpaddq_u8(sum, sum);
+	return vgetq_lane_u32(vreinterpretq_u32_u8(sum), 0);
+}
+
+static void
+lzx_e8_filter_neon(u8 *data, u32 start, u32 size,
+		   void (*process_target)(void *, s32))
+{
+	lzx_e8_filter_vec(data, start, size, process_target, 32,
+			  find_e8_neon);
+}
+#endif /* __aarch64__ && __ARM_NEON */
+
+/* Choose the fastest E8 filter for the CPU, then call it.  This runs only for
+ * the first call of lzx_e8_filter(); later calls go directly to the chosen
+ * version.  */
+static void
+dispatch_e8_filter(u8 *data, u32 start, u32 size,
+		   void (*process_target)(void *, s32));
+
+static volatile e8_filter_func lzx_e8_filter = dispatch_e8_filter;
+
+static void
+dispatch_e8_filter(u8 *data, u32 start, u32 size,
+		   void (*process_target)(void *, s32))
+{
+	e8_filter_func f = lzx_e8_filter_generic;
+
+#if X86_CPU_DISPATCH
+	if (x86_have_cpu_feature("avx512bw"))
+		f = lzx_e8_filter_avx512bw;
+	else if (x86_have_cpu_feature("avx2"))
+		f = lzx_e8_filter_avx2;
+	else if (x86_have_cpu_feature("sse2"))
+		f = lzx_e8_filter_sse2;
+#elif defined(__SSE2__)
+	f = lzx_e8_filter_sse2;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	f = lzx_e8_filter_neon;
+#endif
+	lzx_e8_filter = f;
+	(*f)(data, start, size, process_target);
 }
 
 void
 lzx_preprocess(u8 *data, u32 size)
 {
-	lzx_e8_filter(data, size, do_translate_target);
+	(*lzx_e8_filter)(data, 0, size, do_translate_target);
 }
 
+/* Undo E8 preprocessing, given that there are no E8 bytes before position
+ * @e8_begin.  */
 void
-lzx_postprocess(u8 *data, u32 size)
+lzx_postprocess(u8 *data, u32 size, u32 e8_begin)
 {
-	lzx_e8_filter(data, size, undo_translate_target);
+	(*lzx_e8_filter)(data, e8_begin, size, undo_translate_target);
 }
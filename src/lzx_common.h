@@ -24,6 +24,6 @@ extern void
 lzx_preprocess(u8 *data, u32 size);
 
 extern void
-lzx_postprocess(u8 *data, u32 size);
+lzx_postprocess(u8 *data, u32 size, u32 e8_begin);
 
 #endif /* _LZX_COMMON_H */
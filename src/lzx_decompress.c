@@ -56,6 +56,7 @@
 
 #include <string.h>
 
+#include "buffer_arena.h"
 #include "decompress_common.h"
 #include "lzx_common.h"
 #include "system_compression.h"
@@ -68,6 +69,11 @@
 
 #define LZX_READ_LENS_MAX_OVERRUN 50
 
+/* The window order which system compression and WIM files always use, and the
+ * number of main symbols for it, as lzx_get_num_main_syms() would return.  */
+#define LZX_32K_WINDOW_ORDER		15
+#define LZX_32K_NUM_MAIN_SYMS		(LZX_NUM_CHARS + 30 * LZX_NUM_LEN_HEADERS)
+
 struct lzx_decompressor {
 
 	DECODE_TABLE(maincode_decode_table, LZX_MAINCODE_MAX_NUM_SYMBOLS,
@@ -109,10 +115,33 @@ struct lzx_decompressor {
 	unsigned window_order;
 	unsigned num_main_syms;
 
+	/* The implementation of lzx_decompress() for the window order, chosen
+	 * when the decompressor was allocated */
+	int (*decompress)(struct lzx_decompressor *restrict d,
+			  const void *restrict compressed_data,
+			  size_t compressed_size,
+			  void *restrict uncompressed_data,
+			  size_t uncompressed_size);
+
+	/* The function which decodes the literals and matches of compressed
+	 * blocks, chosen for the CPU when the decompressor was allocated */
+	int (*decode_items)(struct lzx_decompressor *d,
+			    struct input_bitstream *is, u8 *out_begin,
+			    u8 *out_next, u8 *block_end, u32 recent_offsets[],
+			    unsigned min_aligned_offset_slot);
+
 	/* Like lzx_extra_offset_bits[], but does not include the entropy-coded
 	 * bits of aligned offset blocks */
 	u8 extra_offset_bits_minus_aligned[LZX_MAX_OFFSET_SLOTS];
 
+	/* The codeword lengths for which the main and length decode tables were
+	 * last built, and whether the tables are still valid.  Consecutive
+	 * blocks and chunks often use the same codes, and then the tables
+	 * needn't be built again.  */
+	u8 table_maincode_lens[LZX_MAINCODE_MAX_NUM_SYMBOLS];
+	u8 table_lencode_lens[LZX_LENCODE_NUM_SYMBOLS];
+	int tables_valid;
+
 } _aligned_attribute(DECODE_TABLE_ALIGNMENT);
 
 /* Read a Huffman-encoded symbol using the precode. */
@@ -147,6 +176,35 @@ read_alignedsym(const struct lzx_decompressor *d, struct input_bitstream *is)
 			    LZX_ALIGNEDCODE_TABLEBITS, LZX_MAX_ALIGNED_CODEWORD_LEN);
 }
 
+/* Versions of the above for the wide bitstream  */
+
+static forceinline unsigned
+read_mainsym_wide(const struct lzx_decompressor *d,
+		  struct wide_input_bitstream *ws)
+{
+	return read_huffsym_wide(ws, d->maincode_decode_table,
+				 LZX_MAINCODE_TABLEBITS,
+				 LZX_MAX_MAIN_CODEWORD_LEN);
+}
+
+static forceinline unsigned
+read_lensym_wide(const struct lzx_decompressor *d,
+		 struct wide_input_bitstream *ws)
+{
+	return read_huffsym_wide(ws, d->lencode_decode_table,
+				 LZX_LENCODE_TABLEBITS,
+				 LZX_MAX_LEN_CODEWORD_LEN);
+}
+
+static forceinline unsigned
+read_alignedsym_wide(const struct lzx_decompressor *d,
+		     struct wide_input_bitstream *ws)
+{
+	return read_huffsym_wide(ws, d->alignedcode_decode_table,
+				 LZX_ALIGNEDCODE_TABLEBITS,
+				 LZX_MAX_ALIGNED_CODEWORD_LEN);
+}
+
 /*
  * Read a precode from the compressed input bitstream, then use it to decode
  * @num_lens codeword length values and write them to @lens.
@@ -235,12 +293,14 @@ lzx_read_codeword_lens(struct lzx_decompressor *d, struct input_bitstream *is,
  * Read the header of an LZX block.  For all block types, the block type and
  * size is saved in *block_type_ret and *block_size_ret, respectively.  For
  * compressed blocks, the codeword lengths are also saved.  For uncompressed
- * blocks, the recent offsets queue is also updated.
+ * blocks, the recent offsets queue is also updated.  @window_order and
+ * @num_main_syms are those of @d, as compile-time constants if possible.
  */
-static int
+static forceinline int
 lzx_read_block_header(struct lzx_decompressor *d, struct input_bitstream *is,
 		      u32 recent_offsets[], int *block_type_ret,
-		      u32 *block_size_ret)
+		      u32 *block_size_ret, const unsigned window_order,
+		      const unsigned num_main_syms)
 {
 	int block_type;
 	u32 block_size;
@@ -255,7 +315,7 @@ lzx_read_block_header(struct lzx_decompressor *d, struct input_bitstream *is,
 		block_size = LZX_DEFAULT_BLOCK_SIZE;
 	} else {
 		block_size = bitstream_read_bits(is, 16);
-		if (d->window_order >= 16) {
+		if (window_order >= 16) {
 			block_size <<= 8;
 			block_size |= bitstream_read_bits(is, 8);
 		}
@@ -286,7 +346,7 @@ lzx_read_block_header(struct lzx_decompressor *d, struct input_bitstream *is,
 			return -1;
 
 		if (lzx_read_codeword_lens(d, is, d->maincode_lens + LZX_NUM_CHARS,
-					   d->num_main_syms - LZX_NUM_CHARS))
+					   num_main_syms - LZX_NUM_CHARS))
 			return -1;
 
 
@@ -328,56 +388,15 @@ lzx_read_block_header(struct lzx_decompressor *d, struct input_bitstream *is,
 	return 0;
 }
 
-/* Decompress a block of LZX-compressed data. */
+/*
+ * Decode the literals and matches of a compressed block, using the 16-bit
+ * bitstream.
+ */
 static int
-lzx_decompress_block(struct lzx_decompressor *d, struct input_bitstream *is,
-		     int block_type, u32 block_size,
-		     u8 * const out_begin, u8 *out_next, u32 recent_offsets[])
+lzx_decode_items(struct lzx_decompressor *d, struct input_bitstream *is,
+		 u8 * const out_begin, u8 *out_next, u8 * const block_end,
+		 u32 recent_offsets[], unsigned min_aligned_offset_slot)
 {
-	u8 * const block_end = out_next + block_size;
-	unsigned min_aligned_offset_slot;
-
-	/*
-	 * Build the Huffman decode tables.  We always need to build the main
-	 * and length decode tables.  For aligned blocks we additionally need to
-	 * build the aligned offset decode table.
-	 */
-
-	if (make_huffman_decode_table(d->maincode_decode_table,
-				      d->num_main_syms,
-				      LZX_MAINCODE_TABLEBITS,
-				      d->maincode_lens,
-				      LZX_MAX_MAIN_CODEWORD_LEN,
-				      d->maincode_working_space))
-		return -1;
-
-	if (make_huffman_decode_table(d->lencode_decode_table,
-				      LZX_LENCODE_NUM_SYMBOLS,
-				      LZX_LENCODE_TABLEBITS,
-				      d->lencode_lens,
-				      LZX_MAX_LEN_CODEWORD_LEN,
-				      d->lencode_working_space))
-		return -1;
-
-	if (block_type == LZX_BLOCKTYPE_ALIGNED) {
-		if (make_huffman_decode_table(d->alignedcode_decode_table,
-					      LZX_ALIGNEDCODE_NUM_SYMBOLS,
-					      LZX_ALIGNEDCODE_TABLEBITS,
-					      d->alignedcode_lens,
-					      LZX_MAX_ALIGNED_CODEWORD_LEN,
-					      d->alignedcode_working_space))
-			return -1;
-		min_aligned_offset_slot = LZX_MIN_ALIGNED_OFFSET_SLOT;
-		memcpy(d->extra_offset_bits, d->extra_offset_bits_minus_aligned,
-		       sizeof(lzx_extra_offset_bits));
-	} else {
-		min_aligned_offset_slot = LZX_MAX_OFFSET_SLOTS;
-		memcpy(d->extra_offset_bits, lzx_extra_offset_bits,
-		       sizeof(lzx_extra_offset_bits));
-	}
-
-	/* Decode the literals and matches. */
-
 	do {
 		unsigned mainsym;
 		unsigned length;
@@ -436,10 +455,192 @@ lzx_decompress_block(struct lzx_decompressor *d, struct input_bitstream *is,
 	return 0;
 }
 
-int
-lzx_decompress(struct lzx_decompressor *restrict d,
-	       const void *restrict compressed_data, size_t compressed_size,
-	       void *restrict uncompressed_data, size_t uncompressed_size)
+
+/*
+ * Decode the literals and matches of a compressed block, using the wide
+ * bitstream.  This is the same as lzx_decode_items(), except that the bits for
+ * each match header (main and length symbols) and for each explicit offset
+ * (extra offset bits and aligned offset symbol) are loaded with one refill.
+ */
+static forceinline int
+lzx_decode_items_wide_template(struct lzx_decompressor *d,
+			       struct input_bitstream *is,
+			       u8 * const out_begin, u8 *out_next,
+			       u8 * const block_end, u32 recent_offsets[],
+			       unsigned min_aligned_offset_slot)
+{
+	struct wide_input_bitstream ws;
+
+	wide_bitstream_begin(&ws, is);
+	do {
+		unsigned mainsym;
+		unsigned length;
+		u32 offset;
+		unsigned offset_slot;
+
+		wide_bitstream_ensure_bits(&ws, LZX_MAX_MAIN_CODEWORD_LEN +
+						LZX_MAX_LEN_CODEWORD_LEN);
+
+		mainsym = read_mainsym_wide(d, &ws);
+		if (mainsym < LZX_NUM_CHARS) {
+			/* Literal */
+			*out_next++ = mainsym;
+			continue;
+		}
+
+		/* Match */
+
+		/* Decode the length header and offset slot.  */
+		length = mainsym % LZX_NUM_LEN_HEADERS;
+		offset_slot = (mainsym - LZX_NUM_CHARS) / LZX_NUM_LEN_HEADERS;
+
+		/* If needed, read a length symbol to decode the full length. */
+		if (length == LZX_NUM_PRIMARY_LENS)
+			length += read_lensym_wide(d, &ws);
+		length += LZX_MIN_MATCH_LEN;
+
+		if (offset_slot < LZX_NUM_RECENT_OFFSETS) {
+			/* Repeat offset  */
+			offset = recent_offsets[offset_slot];
+			recent_offsets[offset_slot] = recent_offsets[0];
+		} else {
+			/* Explicit offset  */
+			wide_bitstream_ensure_bits(&ws, LZX_MAX_NUM_EXTRA_BITS +
+						LZX_MAX_ALIGNED_CODEWORD_LEN);
+			offset = wide_bitstream_pop_bits(&ws,
+					d->extra_offset_bits[offset_slot]);
+			if (offset_slot >= min_aligned_offset_slot) {
+				offset = (offset << LZX_NUM_ALIGNED_OFFSET_BITS) |
+					 read_alignedsym_wide(d, &ws);
+			}
+			offset += lzx_offset_slot_base[offset_slot];
+
+			/* Update the match offset LRU queue.  */
+			recent_offsets[2] = recent_offsets[1];
+			recent_offsets[1] = recent_offsets[0];
+		}
+		recent_offsets[0] = offset;
+
+		/* Validate the match and copy it to the current position.  */
+		if (unlikely(lz_copy(length, offset, out_begin,
+				     out_next, block_end, LZX_MIN_MATCH_LEN)))
+			return -1;
+		out_next += length;
+	} while (out_next != block_end);
+
+	wide_bitstream_end(&ws, is);
+	return 0;
+}
+
+static int
+lzx_decode_items_wide(struct lzx_decompressor *d, struct input_bitstream *is,
+		      u8 *out_begin, u8 *out_next, u8 *block_end,
+		      u32 recent_offsets[], unsigned min_aligned_offset_slot)
+{
+	return lzx_decode_items_wide_template(d, is, out_begin, out_next,
+					      block_end, recent_offsets,
+					      min_aligned_offset_slot);
+}
+
+#if X86_CPU_DISPATCH
+/* The same, but compiled to use the BMI2 shift instructions, which take the
+ * shift count in any register and don't modify the flags.  */
+static int _target_attribute("bmi2")
+lzx_decode_items_wide_bmi2(struct lzx_decompressor *d,
+			   struct input_bitstream *is, u8 *out_begin,
+			   u8 *out_next, u8 *block_end, u32 recent_offsets[],
+			   unsigned min_aligned_offset_slot)
+{
+	return lzx_decode_items_wide_template(d, is, out_begin, out_next,
+					      block_end, recent_offsets,
+					      min_aligned_offset_slot);
+}
+#endif
+
+/* Decompress a block of LZX-compressed data. */
+static forceinline int
+lzx_decompress_block(struct lzx_decompressor *d, struct input_bitstream *is,
+		     int block_type, u32 block_size,
+		     u8 * const out_begin, u8 *out_next, u32 recent_offsets[],
+		     const unsigned num_main_syms)
+{
+	u8 * const block_end = out_next + block_size;
+	unsigned min_aligned_offset_slot;
+
+	/*
+	 * Build the Huffman decode tables.  We always need the main and length
+	 * decode tables, but they needn't be rebuilt if the codes are the same
+	 * as those which they were last built for.  For aligned blocks we
+	 * additionally need to build the aligned offset decode table.
+	 */
+
+	if (!d->tables_valid ||
+	    memcmp(d->table_maincode_lens, d->maincode_lens,
+		   num_main_syms) != 0 ||
+	    memcmp(d->table_lencode_lens, d->lencode_lens,
+		   LZX_LENCODE_NUM_SYMBOLS) != 0) {
+
+		d->tables_valid = 0;
+
+		if (make_huffman_decode_table(d->maincode_decode_table,
+					      num_main_syms,
+					      LZX_MAINCODE_TABLEBITS,
+					      d->maincode_lens,
+					      LZX_MAX_MAIN_CODEWORD_LEN,
+					      d->maincode_working_space))
+			return -1;
+
+		if (make_huffman_decode_table(d->lencode_decode_table,
+					      LZX_LENCODE_NUM_SYMBOLS,
+					      LZX_LENCODE_TABLEBITS,
+					      d->lencode_lens,
+					      LZX_MAX_LEN_CODEWORD_LEN,
+					      d->lencode_working_space))
+			return -1;
+
+		memcpy(d->table_maincode_lens, d->maincode_lens,
+		       num_main_syms);
+		memcpy(d->table_lencode_lens, d->lencode_lens,
+		       LZX_LENCODE_NUM_SYMBOLS);
+		d->tables_valid = 1;
+	}
+
+	if (block_type == LZX_BLOCKTYPE_ALIGNED) {
+		if (make_huffman_decode_table(d->alignedcode_decode_table,
+					      LZX_ALIGNEDCODE_NUM_SYMBOLS,
+					      LZX_ALIGNEDCODE_TABLEBITS,
+					      d->alignedcode_lens,
+					      LZX_MAX_ALIGNED_CODEWORD_LEN,
+					      d->alignedcode_working_space))
+			return -1;
+		min_aligned_offset_slot = LZX_MIN_ALIGNED_OFFSET_SLOT;
+		memcpy(d->extra_offset_bits, d->extra_offset_bits_minus_aligned,
+		       sizeof(lzx_extra_offset_bits));
+	} else {
+		min_aligned_offset_slot = LZX_MAX_OFFSET_SLOTS;
+		memcpy(d->extra_offset_bits, lzx_extra_offset_bits,
+		       sizeof(lzx_extra_offset_bits));
+	}
+
+	/* Decode the literals and matches. */
+	return (*d->decode_items)(d, is, out_begin, out_next, block_end,
+				  recent_offsets, min_aligned_offset_slot);
+}
+
+/*
+ * Decompress a chunk.  This is instantiated for the 32768-byte window that
+ * system compression uses, so that the sizes of the main code, and the
+ * comparisons and copies of its codeword lengths, are known at compile time;
+ * and once more for other window orders, which are only taken at runtime.
+ */
+static forceinline int
+lzx_decompress_template(struct lzx_decompressor *restrict d,
+			const void *restrict compressed_data,
+			size_t compressed_size,
+			void *restrict uncompressed_data,
+			size_t uncompressed_size,
+			const unsigned window_order,
+			const unsigned num_main_syms)
 {
 	u8 * const out_begin = uncompressed_data;
 	u8 *out_next = out_begin;
@@ -447,12 +648,12 @@ lzx_decompress(struct lzx_decompressor *restrict d,
 	struct input_bitstream is;
 	STATIC_ASSERT(LZX_NUM_RECENT_OFFSETS == 3);
 	u32 recent_offsets[LZX_NUM_RECENT_OFFSETS] = {1, 1, 1};
-	unsigned may_have_e8_byte = 0;
+	u8 *e8_begin = out_end;
 
 	init_input_bitstream(&is, compressed_data, compressed_size);
 
 	/* Codeword lengths begin as all 0's for delta encoding purposes. */
-	memset(d->maincode_lens, 0, d->num_main_syms);
+	memset(d->maincode_lens, 0, num_main_syms);
 	memset(d->lencode_lens, 0, LZX_LENCODE_NUM_SYMBOLS);
 
 	/* Decompress blocks until we have all the uncompressed data. */
@@ -462,7 +663,8 @@ lzx_decompress(struct lzx_decompressor *restrict d,
 		u32 block_size;
 
 		if (lzx_read_block_header(d, &is, recent_offsets,
-					  &block_type, &block_size))
+					  &block_type, &block_size,
+					  window_order, num_main_syms))
 			return -1;
 
 		if (block_size < 1 || block_size > out_end - out_next)
@@ -473,12 +675,14 @@ lzx_decompress(struct lzx_decompressor *restrict d,
 			/* Compressed block */
 			if (lzx_decompress_block(d, &is, block_type, block_size,
 						 out_begin, out_next,
-						 recent_offsets))
+						 recent_offsets,
+						 num_main_syms))
 				return -1;
 
 			/* If the first E8 byte was in this block, then it must
 			 * have been encoded as a literal using mainsym E8. */
-			may_have_e8_byte |= d->maincode_lens[0xE8];
+			if (e8_begin == out_end && d->maincode_lens[0xE8])
+				e8_begin = out_next;
 		} else {
 
 			/* Uncompressed block */
@@ -489,19 +693,58 @@ lzx_decompress(struct lzx_decompressor *restrict d,
 			if (block_size & 1)
 				bitstream_read_byte(&is);
 
-			/* There may have been an E8 byte in the block. */
-			may_have_e8_byte = 1;
+			/* Find the first E8 byte if it was in this block. */
+			if (e8_begin == out_end) {
+				u8 *e8 = memchr(out_next, 0xE8, block_size);
+
+				if (e8)
+					e8_begin = e8;
+			}
 		}
 		out_next += block_size;
 	}
 
-	/* Postprocess the data unless it cannot possibly contain E8 bytes. */
-	if (may_have_e8_byte)
-		lzx_postprocess(uncompressed_data, uncompressed_size);
+	/* Postprocess the data, starting where the first E8 byte may be, unless
+	 * it cannot possibly contain E8 bytes. */
+	if (e8_begin != out_end)
+		lzx_postprocess(uncompressed_data, uncompressed_size,
+				e8_begin - out_begin);
 
 	return 0;
 }
 
+static int
+lzx_decompress_32k(struct lzx_decompressor *restrict d,
+		   const void *restrict compressed_data, size_t compressed_size,
+		   void *restrict uncompressed_data, size_t uncompressed_size)
+{
+	return lzx_decompress_template(d, compressed_data, compressed_size,
+				       uncompressed_data, uncompressed_size,
+				       LZX_32K_WINDOW_ORDER,
+				       LZX_32K_NUM_MAIN_SYMS);
+}
+
+static int
+lzx_decompress_generic(struct lzx_decompressor *restrict d,
+		       const void *restrict compressed_data,
+		       size_t compressed_size,
+		       void *restrict uncompressed_data,
+		       size_t uncompressed_size)
+{
+	return lzx_decompress_template(d, compressed_data, compressed_size,
+				       uncompressed_data, uncompressed_size,
+				       d->window_order, d->num_main_syms);
+}
+
+int
+lzx_decompress(struct lzx_decompressor *restrict d,
+	       const void *restrict compressed_data, size_t compressed_size,
+	       void *restrict uncompressed_data, size_t uncompressed_size)
+{
+	return (*d->decompress)(d, compressed_data, compressed_size,
+				uncompressed_data, uncompressed_size);
+}
+
 struct lzx_decompressor *
 lzx_allocate_decompressor(size_t max_block_size)
 {
@@ -514,12 +757,29 @@ lzx_allocate_decompressor(size_t max_block_size)
 		return NULL;
 	}
 
-	d = aligned_malloc(sizeof(*d), DECODE_TABLE_ALIGNMENT);
+	d = buffer_arena_alloc(sizeof(*d));
 	if (!d)
 		return NULL;
 
 	d->window_order = window_order;
 	d->num_main_syms = lzx_get_num_main_syms(window_order);
+	d->tables_valid = 0;
+
+	d->decompress = lzx_decompress_generic;
+	if (window_order == LZX_32K_WINDOW_ORDER &&
+	    d->num_main_syms == LZX_32K_NUM_MAIN_SYMS)
+		d->decompress = lzx_decompress_32k;
+
+	/* Choose how to decode the literals and matches.  The wide bitstream
+	 * only pays off with 64-bit registers.  */
+	d->decode_items = lzx_decode_items;
+	if (WORDBITS == 64) {
+		d->decode_items = lzx_decode_items_wide;
+#if X86_CPU_DISPATCH
+		if (x86_have_cpu_feature("bmi2"))
+			d->decode_items = lzx_decode_items_wide_bmi2;
+#endif
+	}
 
 	/* Initialize 'd->extra_offset_bits_minus_aligned'. */
 	STATIC_ASSERT(sizeof(d->extra_offset_bits_minus_aligned) ==
@@ -541,5 +801,5 @@ lzx_allocate_decompressor(size_t max_block_size)
 void
 lzx_free_decompressor(struct lzx_decompressor *d)
 {
-	aligned_free(d);
+	buffer_arena_free(d, sizeof(*d));
 }
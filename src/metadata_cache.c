@@ -0,0 +1,194 @@
+/*
+ * metadata_cache.c - Cache of system-compressed file metadata
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Getting the attributes of a system-compressed file requires parsing its
+ * reparse point and looking up its WofCompressedData stream to get the
+ * compressed size.  Programs like 'find', 'du', and 'ls -l' do this for every
+ * file, often more than once.  This file implements a per-volume cache of the
+ * results, which is consulted when getting a file's attributes and when opening
+ * it.
+ *
+ * The cache is a direct-mapped table indexed by a hash of the MFT record
+ * number, so a new entry simply replaces any entry it collides with.  Each
+ * entry records the file's full MFT reference, including the sequence number,
+ * and its uncompressed size.  An entry is only used if both still match, so a
+ * deleted file whose MFT record has been reused can never be mistaken for the
+ * new file.  A volume's cache is freed when the volume is unmounted, since
+ * another volume may later be mounted at the same address.
+ *
+ * The caches are protected by a single lock, since each operation on them is
+ * only a few memory accesses.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <ntfs-3g/layout.h>
+#include <ntfs-3g/misc.h>
+
+#include "metadata_cache.h"
+
+/* The default number of entries per volume  */
+#define DEFAULT_NUM_ENTRIES	8192
+
+struct metadata_cache_entry {
+	/* The MFT reference of the file, or 0 if the entry is unused.  MFT
+	 * record 0 is the MFT itself, which is never system-compressed.  */
+	u64 mref;
+
+	u64 uncompressed_size;
+	u64 compressed_size;
+
+	/* The compression format, as stored in the reparse point  */
+	u32 format;
+};
+
+struct metadata_cache {
+	/* The volume this cache belongs to, and the next cache in the list of
+	 * all caches  */
+	const ntfs_volume *vol;
+	struct metadata_cache *next;
+
+	/* The table of 2^order entries  */
+	struct metadata_cache_entry *entries;
+	unsigned order;
+};
+
+/* The list of all caches.  'lock' protects it and the caches' entries.  */
+static struct metadata_cache *all_caches;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned cache_num_entries = DEFAULT_NUM_ENTRIES;
+
+/*
+ * Set the number of entries of each volume's metadata cache, which is rounded
+ * up to a power of 2.  0 disables the cache.  This only affects caches that
+ * haven't been created yet.
+ */
+void
+metadata_cache_set_num_entries(unsigned num_entries)
+{
+	cache_num_entries = min(num_entries, 1U << 24);
+}
+
+static forceinline size_t
+entry_index(const struct metadata_cache *cache, u64 mref)
+{
+	return (MREF(mref) * 0x9E3779B97F4A7C15ULL) >> (64 - cache->order);
+}
+
+/*
+ * Return the metadata cache for the specified volume, creating it if needed.
+ * Return NULL if caching is disabled or if memory couldn't be allocated; the
+ * caller should then just proceed without the cache.
+ */
+struct metadata_cache *
+metadata_cache_get(const ntfs_volume *vol)
+{
+	struct metadata_cache *cache;
+
+	pthread_mutex_lock(&lock);
+	for (cache = all_caches; cache; cache = cache->next)
+		if (cache->vol == vol)
+			goto out;
+
+	if (cache_num_entries == 0)
+		goto out;
+
+	cache = ntfs_calloc(sizeof(*cache));
+	if (!cache)
+		goto out;
+	cache->order = max(ilog2_ceil(cache_num_entries), 1);
+	cache->entries = ntfs_calloc(sizeof(cache->entries[0]) << cache->order);
+	if (!cache->entries) {
+		free(cache);
+		cache = NULL;
+		goto out;
+	}
+	cache->vol = vol;
+	cache->next = all_caches;
+	all_caches = cache;
+out:
+	pthread_mutex_unlock(&lock);
+	return cache;
+}
+
+/* Free the metadata cache for the specified volume, if it has one.  No
+ * decompression context may be using the cache.  */
+void
+metadata_cache_free(const ntfs_volume *vol)
+{
+	struct metadata_cache **pp, *cache;
+
+	pthread_mutex_lock(&lock);
+	for (pp = &all_caches; (cache = *pp); pp = &cache->next)
+		if (cache->vol == vol)
+			break;
+	if (cache)
+		*pp = cache->next;
+	pthread_mutex_unlock(&lock);
+	if (cache) {
+		free(cache->entries);
+		free(cache);
+	}
+}
+
+/*
+ * Look up the cached metadata of the file with MFT reference @mref, which must
+ * have uncompressed size @uncompressed_size.  On a hit, return 0 and the
+ * compression format and compressed size.  On a miss, return -1.
+ */
+int
+metadata_cache_lookup(struct metadata_cache *cache, u64 mref,
+		      u64 uncompressed_size, u32 *format_ret,
+		      u64 *compressed_size_ret)
+{
+	const struct metadata_cache_entry *entry =
+		&cache->entries[entry_index(cache, mref)];
+	int ret = -1;
+
+	pthread_mutex_lock(&lock);
+	if (entry->mref == mref &&
+	    entry->uncompressed_size == uncompressed_size) {
+		*format_ret = entry->format;
+		*compressed_size_ret = entry->compressed_size;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+/* Cache the metadata of the file with MFT reference @mref, replacing any
+ * entry it collides with.  */
+void
+metadata_cache_insert(struct metadata_cache *cache, u64 mref,
+		      u64 uncompressed_size, u32 format, u64 compressed_size)
+{
+	struct metadata_cache_entry *entry =
+		&cache->entries[entry_index(cache, mref)];
+
+	pthread_mutex_lock(&lock);
+	entry->mref = mref;
+	entry->uncompressed_size = uncompressed_size;
+	entry->compressed_size = compressed_size;
+	entry->format = format;
+	pthread_mutex_unlock(&lock);
+}
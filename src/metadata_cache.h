@@ -0,0 +1,34 @@
+/*
+ * metadata_cache.h
+ *
+ * Declarations for the per-volume cache of system-compressed file metadata.
+ */
+
+#ifndef _METADATA_CACHE_H
+#define _METADATA_CACHE_H
+
+#include <ntfs-3g/volume.h>
+
+#include "common_defs.h"
+
+struct metadata_cache;
+
+extern void
+metadata_cache_set_num_entries(unsigned num_entries);
+
+extern struct metadata_cache *
+metadata_cache_get(const ntfs_volume *vol);
+
+extern void
+metadata_cache_free(const ntfs_volume *vol);
+
+extern int
+metadata_cache_lookup(struct metadata_cache *cache, u64 mref,
+		      u64 uncompressed_size, u32 *format_ret,
+		      u64 *compressed_size_ret);
+
+extern void
+metadata_cache_insert(struct metadata_cache *cache, u64 mref,
+		      u64 uncompressed_size, u32 format, u64 compressed_size);
+
+#endif /* _METADATA_CACHE_H */
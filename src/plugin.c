@@ -28,8 +28,21 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
 
 #include <ntfs-3g/inode.h>
+#include <ntfs-3g/logging.h>
 #include <ntfs-3g/plugin.h>
 
 #include "system_compression.h"
@@ -39,11 +52,13 @@
  * ntfs_system_decompression_ctx for the file in the FUSE file handle.
  *
  * A decompression context includes a decompressor, cached data, and cached
- * metadata.  It does not include an open ntfs_inode for the file or an open
- * ntfs_attr for the file's compressed stream.  This is necessary because
- * NTFS-3G is not guaranteed to keep the inode open the whole time the file is
- * open.  Indeed, NTFS-3G may close an inode after a read request and re-open it
- * for the next one, though it does maintain an open inode cache.
+ * metadata.  It does not include an open ntfs_inode for the file.  This is
+ * necessary because NTFS-3G is not guaranteed to keep the inode open the whole
+ * time the file is open.  Indeed, NTFS-3G may close an inode after a read
+ * request and re-open it for the next one, though it does maintain an open
+ * inode cache.  The context does keep the file's compressed stream open, but it
+ * only reuses it for reads through the same open inode; otherwise it reopens
+ * the stream.
  *
  * As a result of the decompression context caching, the results of reads from a
  * system-compressed file that has been written to since being opened for
@@ -55,6 +70,91 @@
 #define DECOMPRESSION_CTX(fi) \
 	((struct ntfs_system_decompression_ctx *)(uintptr_t)((fi)->fh))
 
+/* Whether to log the counters of each file that was read when it's closed, and
+ * the totals when the plugin is unloaded; see the "stats" option  */
+static int stats_enabled;
+
+static void log_stats(const char *what,
+		      const struct ntfs_system_decompression_stats *stats)
+{
+	const u64 *chunks = stats->chunks_decompressed;
+
+	ntfs_log_info("System compression plugin: %s: returned %llu bytes, "
+		      "read %llu compressed bytes, decompressed %llu chunks "
+		      "(xpress4k %llu, xpress8k %llu, xpress16k %llu, "
+		      "lzx %llu) in %llu us, filled %llu zero chunks, "
+		      "chunk buffer %llu/%llu hits, "
+		      "cache %llu/%llu hits, disk cache %llu/%llu hits, "
+		      "read chunk offsets %llu times\n",
+		      what,
+		      (unsigned long long)stats->bytes_returned,
+		      (unsigned long long)stats->compressed_bytes_read,
+		      (unsigned long long)(chunks[0] + chunks[1] +
+					   chunks[2] + chunks[3]),
+		      (unsigned long long)chunks[0],
+		      (unsigned long long)chunks[2],
+		      (unsigned long long)chunks[3],
+		      (unsigned long long)chunks[1],
+		      (unsigned long long)(stats->decompress_ns / 1000),
+		      (unsigned long long)stats->zero_chunks,
+		      (unsigned long long)stats->chunk_buffer_hits,
+		      (unsigned long long)(stats->chunk_buffer_hits +
+					   stats->chunk_buffer_misses),
+		      (unsigned long long)stats->cache_hits,
+		      (unsigned long long)(stats->cache_hits +
+					   stats->cache_misses),
+		      (unsigned long long)stats->disk_cache_hits,
+		      (unsigned long long)(stats->disk_cache_hits +
+					   stats->disk_cache_misses),
+		      (unsigned long long)stats->chunk_offset_reads);
+}
+
+/* Log the latency percentiles of each stage of reading chunks that was timed.
+ * This logs nothing if the plugin was built without --enable-tracing.  */
+static void log_latencies(void)
+{
+	static const char * const stage_names[NTFS_DECOMPRESSION_NUM_STAGES] = {
+		[NTFS_DECOMPRESSION_STAGE_OFFSETS_READ] = "chunk offset reads",
+		[NTFS_DECOMPRESSION_STAGE_DATA_READ] = "chunk data reads",
+		[NTFS_DECOMPRESSION_STAGE_DECOMPRESS + 0] = "xpress4k decompression",
+		[NTFS_DECOMPRESSION_STAGE_DECOMPRESS + 1] = "lzx decompression",
+		[NTFS_DECOMPRESSION_STAGE_DECOMPRESS + 2] = "xpress8k decompression",
+		[NTFS_DECOMPRESSION_STAGE_DECOMPRESS + 3] = "xpress16k decompression",
+	};
+	static const double percentiles[3] = { 50, 90, 99 };
+	struct ntfs_system_decompression_histogram hist;
+	unsigned long long us[3];
+	unsigned stage;
+	int i;
+
+	for (stage = 0; stage < NTFS_DECOMPRESSION_NUM_STAGES; stage++) {
+		if (ntfs_get_system_decompression_latency(stage, &hist) ||
+		    hist.count == 0)
+			continue;
+		for (i = 0; i < 3; i++)
+			us[i] = ntfs_system_decompression_latency_percentile(
+					&hist, percentiles[i]) / 1000;
+		ntfs_log_info("System compression plugin: %s: %llu times, "
+			      "p50 %llu us, p90 %llu us, p99 %llu us, "
+			      "max %llu us\n",
+			      stage_names[stage],
+			      (unsigned long long)hist.count,
+			      us[0], us[1], us[2],
+			      (unsigned long long)(hist.max_ns / 1000));
+	}
+}
+
+static void __attribute__((destructor)) log_total_stats(void)
+{
+	struct ntfs_system_decompression_stats stats;
+
+	if (stats_enabled) {
+		ntfs_get_system_decompression_stats(NULL, &stats);
+		log_stats("all files", &stats);
+		log_latencies();
+	}
+}
+
 static int compressed_getattr(ntfs_inode *ni, const REPARSE_POINT *reparse,
 			      struct stat *stbuf)
 {
@@ -88,10 +188,22 @@ static int compressed_open(ntfs_inode *ni, const REPARSE_POINT *reparse,
 	return 0;
 }
 
-static int compressed_release(ntfs_inode *ni __attribute__((unused)),
+static int compressed_release(ntfs_inode *ni,
 			   const REPARSE_POINT *reparse __attribute__((unused)),
 			   struct fuse_file_info *fi)
 {
+	if (stats_enabled) {
+		struct ntfs_system_decompression_stats stats;
+		char what[32];
+
+		ntfs_get_system_decompression_stats(DECOMPRESSION_CTX(fi),
+						    &stats);
+		if (stats.bytes_returned) {
+			snprintf(what, sizeof(what), "inode %llu",
+				 (unsigned long long)ni->mft_no);
+			log_stats(what, &stats);
+		}
+	}
 	ntfs_close_system_decompression_ctx(DECOMPRESSION_CTX(fi));
 	return 0;
 }
@@ -116,10 +228,204 @@ static const struct plugin_operations ops = {
 	.read = compressed_read,
 };
 
+/*
+ * NTFS-3G has no way to pass options to plugins, so the plugin takes its
+ * options from the OPTIONS_ENV_VAR environment variable of the ntfs-3g process,
+ * formatted as a comma-separated list of name=value pairs, for example
+ * "cache_size=64M".  The options are:
+ *
+ *	cache_size=SIZE	The maximum amount of decompressed data to cache per
+ *			volume, shared by all open files.  A K, M, or G suffix
+ *			may be given.  0 disables the cache.  Default: 16M.
+ *
+ *	metadata_cache=N
+ *			The number of files per volume whose compression format
+ *			and compressed size are cached for getattr and open.
+ *			0 disables the cache.  Default: 8192.
+ *
+ *	readahead=SIZE	The amount of uncompressed data to decompress in the
+ *			background ahead of a sequential reader.  Requires the
+ *			shared cache.  0 disables readahead.  Default: 0.
+ *
+ *	threads=N	The maximum number of threads which may decompress the
+ *			chunks of a single large read in parallel.  Default: 1.
+ *
+ *	chunk_table_max=SIZE
+ *			The maximum amount of memory to use for the whole chunk
+ *			offset table of a large file.  Larger tables are read
+ *			piecewise as needed.  0 disables loading whole tables.
+ *			Default: 4M.
+ *
+ *	stats=0|1	Whether to log, at info level, counters of the work
+ *			done to read each file when it's closed, and the totals
+ *			for all files when the plugin is unloaded.  Default: 0.
+ *
+ *	direct_read=0|1	Whether to read the compressed data of files on
+ *			volumes mounted read-only directly from the device,
+ *			once each file's location on the device has been looked
+ *			up.  Default: 1.
+ *
+ *	disk_cache=DIR	A directory in which to keep decompressed chunks, so
+ *			that later mounts don't need to decompress them again.
+ *			The path can't contain commas.  Default: none.
+ *
+ *	disk_cache_size=SIZE
+ *			The maximum size of the disk_cache directory.  The least
+ *			recently used files are deleted from it as needed.
+ *			Default: 1G.
+ *
+ *	huge_pages=0|1	Whether to back the memory for decompressors and
+ *			decompressed chunks by transparent huge pages.
+ *			Default: 0.
+ *
+ *	wim=PATH	A WIM file which backs WIMBoot files on the volume, so
+ *			that they can be read.  May be given more than once.
+ *			The path can't contain commas.  Default: none.
+ */
+#define OPTIONS_ENV_VAR "NTFS_SYSTEM_COMPRESSION_OPTIONS"
+
+/* Parse a size in bytes, optionally followed by K, M, or G.  On failure, return
+ * -1 and set errno to EINVAL, or to ERANGE if the size is too large.  */
+static int parse_size(const char *str, size_t *size_ret)
+{
+	unsigned long long size;
+	unsigned shift = 0;
+	char *end;
+
+	/* strtoull() would accept and negate a leading '-'.  */
+	if (*str < '0' || *str > '9') {
+		errno = EINVAL;
+		return -1;
+	}
+	errno = 0;
+	size = strtoull(str, &end, 10);
+	if (errno)
+		return -1;
+	switch (*end) {
+	case 'G': case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M': case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K': case 'k':
+		shift += 10;
+		end++;
+		break;
+	}
+	if (*end) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (size > (SIZE_MAX >> shift)) {
+		errno = ERANGE;
+		return -1;
+	}
+	*size_ret = (size_t)size << shift;
+	return 0;
+}
+
+/* Parse an unsigned integer.  On failure, return -1 and set errno like
+ * parse_size().  */
+static int parse_uint(const char *str, unsigned *value_ret)
+{
+	unsigned long value;
+	char *end;
+
+	if (*str < '0' || *str > '9') {
+		errno = EINVAL;
+		return -1;
+	}
+	errno = 0;
+	value = strtoul(str, &end, 10);
+	if (errno)
+		return -1;
+	if (*end) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (value > UINT_MAX) {
+		errno = ERANGE;
+		return -1;
+	}
+	*value_ret = value;
+	return 0;
+}
+
+static void parse_options(void)
+{
+	const char *env = getenv(OPTIONS_ENV_VAR);
+	char *options, *name, *value, *saveptr = NULL;
+	size_t size;
+	unsigned num;
+
+	if (!env)
+		return;
+	options = strdup(env);
+	if (!options)
+		return;
+
+	for (name = strtok_r(options, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr))
+	{
+		value = strchr(name, '=');
+		if (value)
+			*value++ = '\0';
+
+		if (!strcmp(name, "cache_size") && value &&
+		    !parse_size(value, &size)) {
+			ntfs_set_system_decompression_cache_size(size);
+		} else if (!strcmp(name, "chunk_table_max") && value &&
+			   !parse_size(value, &size)) {
+			ntfs_set_system_decompression_chunk_table_max(size);
+		} else if (!strcmp(name, "direct_read") && value &&
+			   !parse_uint(value, &num) && num <= 1) {
+			ntfs_set_system_decompression_direct_read(num);
+		} else if (!strcmp(name, "disk_cache") && value && *value) {
+			if (ntfs_set_system_decompression_disk_cache(value))
+				ntfs_log_perror("System compression plugin: "
+						"disk_cache");
+		} else if (!strcmp(name, "disk_cache_size") && value &&
+			   !parse_size(value, &size)) {
+			ntfs_set_system_decompression_disk_cache_size(size);
+		} else if (!strcmp(name, "huge_pages") && value &&
+			   !parse_uint(value, &num) && num <= 1) {
+			ntfs_set_system_decompression_huge_pages(num);
+		} else if (!strcmp(name, "metadata_cache") && value &&
+			   !parse_uint(value, &num)) {
+			ntfs_set_system_decompression_metadata_cache(num);
+		} else if (!strcmp(name, "readahead") && value &&
+			   !parse_size(value, &size)) {
+			ntfs_set_system_decompression_readahead(size);
+		} else if (!strcmp(name, "stats") && value &&
+			   !parse_uint(value, &num) && num <= 1) {
+			stats_enabled = num;
+		} else if (!strcmp(name, "threads") && value &&
+			   !parse_uint(value, &num)) {
+			ntfs_set_system_decompression_threads(num);
+		} else if (!strcmp(name, "wim") && value && *value) {
+			if (ntfs_add_system_decompression_wim(value))
+				ntfs_log_perror("System compression plugin: "
+						"wim \"%s\"", value);
+		} else {
+			ntfs_log_error("System compression plugin: invalid "
+				       "option \"%s\"\n", name);
+		}
+	}
+	free(options);
+}
+
 const struct plugin_operations *init(le32 tag)
 {
-	if (tag == IO_REPARSE_TAG_WOF)
+	static int options_parsed;
+
+	if (tag == IO_REPARSE_TAG_WOF) {
+		if (!options_parsed) {
+			parse_options();
+			options_parsed = 1;
+		}
 		return &ops;
+	}
 	errno = EINVAL;
 	return NULL;
 }
@@ -0,0 +1,425 @@
+/*
+ * readahead.c - Background decompression of chunks that will be read soon
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * When a file is being read sequentially, the chunks following the current
+ * read will most likely be needed next.  Decompressing them in the background
+ * lets the next read find them already decompressed, so that decompression
+ * overlaps with whatever the reader does between reads.
+ *
+ * libntfs-3g is not thread-safe, so the compressed data of the chunks is read
+ * by the thread handling the read request, into the compressed data buffer of
+ * a 'struct readahead'.  The readahead is then submitted to a single background
+ * thread, which decompresses each chunk into its slot.  The owner of the
+ * readahead collects the decompressed chunks once the background thread is done
+ * with them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ntfs-3g/misc.h>
+
+#include "readahead.h"
+#include "system_compression.h"
+
+enum readahead_state {
+	RA_IDLE,
+	RA_QUEUED,
+	RA_RUNNING,
+	RA_DONE,
+};
+
+struct readahead_chunk {
+	const u8 *compressed_data;
+	u64 chunk_idx;
+	u32 stored_size;
+	u32 uncompressed_size;
+	int result;
+};
+
+struct readahead {
+	/* Whether the chunks use LZX (otherwise XPRESS), and their maximum
+	 * uncompressed size  */
+	int is_lzx;
+	u32 chunk_size;
+
+	/* The chunks which have been added, and the maximum number of them  */
+	unsigned num_chunks;
+	unsigned max_chunks;
+	struct readahead_chunk *chunks;
+
+	/* The compressed data of the chunks, and how much of it is in use.
+	 * Its size is 'max_chunks * chunk_size'.  */
+	u8 *compressed_data;
+	size_t compressed_used;
+
+	/* A slot of 'chunk_size' bytes for the uncompressed data of each
+	 * chunk  */
+	u8 *uncompressed_data;
+
+	/* The state, and the next readahead in the queue.  These are protected
+	 * by the thread's lock.  */
+	enum readahead_state state;
+	struct readahead *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+
+	/* Signaled when a readahead is queued or when the thread should exit  */
+	pthread_cond_t work_cond;
+
+	/* Signaled when a readahead is done  */
+	pthread_cond_t done_cond;
+
+	/* The readaheads waiting for the thread  */
+	struct readahead *queue_head;
+	struct readahead **queue_tail;
+
+	/* The maximum amount of uncompressed data per readahead  */
+	size_t size;
+
+	pthread_t thread;
+	struct lzx_decompressor *lzx;
+	struct xpress_decompressor *xpress;
+	int started;
+	int running;
+	int exiting;
+} ra_thread = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+	.queue_tail = &ra_thread.queue_head,
+};
+
+/*
+ * Set the maximum amount of uncompressed data, in bytes, which each readahead
+ * may hold.  0 disables readahead.  This only affects readaheads that haven't
+ * been allocated yet.
+ */
+void
+readahead_set_size(size_t size)
+{
+	ra_thread.size = size;
+}
+
+static void
+decompress_chunks(struct readahead *ra)
+{
+	unsigned i;
+
+	for (i = 0; i < ra->num_chunks; i++) {
+		struct readahead_chunk *chunk = &ra->chunks[i];
+		const u8 *in = chunk->compressed_data;
+		u8 *out = &ra->uncompressed_data[(size_t)i * ra->chunk_size];
+
+		/* Chunks stored uncompressed were copied into their slot when
+		 * they were added.  */
+		if (chunk->stored_size == chunk->uncompressed_size)
+			continue;
+
+		if (ra->is_lzx)
+			chunk->result = lzx_decompress(ra_thread.lzx,
+						       in, chunk->stored_size,
+						       out,
+						       chunk->uncompressed_size);
+		else
+			chunk->result = xpress_decompress(ra_thread.xpress,
+							  in,
+							  chunk->stored_size,
+							  out,
+							  chunk->uncompressed_size);
+	}
+}
+
+static void *
+readahead_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&ra_thread.lock);
+	for (;;) {
+		struct readahead *ra = ra_thread.queue_head;
+
+		if (ra_thread.exiting)
+			break;
+
+		if (!ra) {
+			pthread_cond_wait(&ra_thread.work_cond, &ra_thread.lock);
+			continue;
+		}
+
+		ra_thread.queue_head = ra->next;
+		if (!ra_thread.queue_head)
+			ra_thread.queue_tail = &ra_thread.queue_head;
+		ra->state = RA_RUNNING;
+		pthread_mutex_unlock(&ra_thread.lock);
+
+		decompress_chunks(ra);
+
+		pthread_mutex_lock(&ra_thread.lock);
+		ra->state = RA_DONE;
+		pthread_cond_broadcast(&ra_thread.done_cond);
+	}
+	pthread_mutex_unlock(&ra_thread.lock);
+	return NULL;
+}
+
+/* Start the background thread.  The lock must be held.  */
+static void
+start_thread(void)
+{
+	ra_thread.started = 1;
+
+	ra_thread.lzx = lzx_allocate_decompressor(32768);
+	ra_thread.xpress = xpress_allocate_decompressor();
+	if (!ra_thread.lzx || !ra_thread.xpress ||
+	    pthread_create(&ra_thread.thread, NULL, readahead_thread, NULL)) {
+		lzx_free_decompressor(ra_thread.lzx);
+		xpress_free_decompressor(ra_thread.xpress);
+		ra_thread.lzx = NULL;
+		ra_thread.xpress = NULL;
+		return;
+	}
+	ra_thread.running = 1;
+}
+
+/* Stop the background thread before the plugin is unloaded.  */
+static void __attribute__((destructor))
+stop_thread(void)
+{
+	pthread_mutex_lock(&ra_thread.lock);
+	ra_thread.exiting = 1;
+	pthread_cond_broadcast(&ra_thread.work_cond);
+	pthread_mutex_unlock(&ra_thread.lock);
+
+	if (ra_thread.running) {
+		pthread_join(ra_thread.thread, NULL);
+		lzx_free_decompressor(ra_thread.lzx);
+		xpress_free_decompressor(ra_thread.xpress);
+		ra_thread.running = 0;
+	}
+}
+
+/*
+ * Allocate a readahead for chunks of up to @chunk_size bytes.  Return NULL if
+ * readahead is disabled or unavailable, or if memory couldn't be allocated.
+ */
+struct readahead *
+readahead_alloc(int is_lzx, u32 chunk_size)
+{
+	struct readahead *ra;
+	size_t max_chunks;
+
+	if (ra_thread.size == 0)
+		return NULL;
+
+	pthread_mutex_lock(&ra_thread.lock);
+	if (!ra_thread.started)
+		start_thread();
+	pthread_mutex_unlock(&ra_thread.lock);
+	if (!ra_thread.running)
+		return NULL;
+
+	max_chunks = max(ra_thread.size / chunk_size, (size_t)1);
+	max_chunks = min(max_chunks, (size_t)UINT_MAX);
+
+	ra = ntfs_calloc(sizeof(*ra));
+	if (!ra)
+		return NULL;
+	ra->chunks = ntfs_malloc(max_chunks * sizeof(ra->chunks[0]));
+	ra->compressed_data = ntfs_malloc(max_chunks * chunk_size);
+	ra->uncompressed_data = ntfs_malloc(max_chunks * chunk_size);
+	if (!ra->chunks || !ra->compressed_data || !ra->uncompressed_data) {
+		free(ra->uncompressed_data);
+		free(ra->compressed_data);
+		free(ra->chunks);
+		free(ra);
+		return NULL;
+	}
+	ra->is_lzx = is_lzx;
+	ra->chunk_size = chunk_size;
+	ra->max_chunks = max_chunks;
+	ra->state = RA_IDLE;
+	return ra;
+}
+
+/* Free a readahead, first cancelling it or waiting for it if needed.  */
+void
+readahead_free(struct readahead *ra)
+{
+	if (!ra)
+		return;
+
+	pthread_mutex_lock(&ra_thread.lock);
+	if (ra->state == RA_QUEUED) {
+		struct readahead **pp = &ra_thread.queue_head;
+
+		while (*pp != ra)
+			pp = &(*pp)->next;
+		*pp = ra->next;
+		if (!*pp)
+			ra_thread.queue_tail = pp;
+	}
+	while (ra->state == RA_RUNNING)
+		pthread_cond_wait(&ra_thread.done_cond, &ra_thread.lock);
+	pthread_mutex_unlock(&ra_thread.lock);
+
+	free(ra->uncompressed_data);
+	free(ra->compressed_data);
+	free(ra->chunks);
+	free(ra);
+}
+
+/*
+ * Return a pointer to the free space in the compressed data buffer of an idle
+ * readahead, and its size in *@size_ret.  The space is enough for the stored
+ * data of every chunk the readahead still has room for.
+ */
+void *
+readahead_get_buffer(struct readahead *ra, size_t *size_ret)
+{
+	*size_ret = (size_t)ra->max_chunks * ra->chunk_size -
+		    ra->compressed_used;
+	return &ra->compressed_data[ra->compressed_used];
+}
+
+/*
+ * Add chunk @chunk_idx to an idle readahead, which must not be full.  The
+ * stored data of the chunks must have been read, in the order the chunks are
+ * added, into the space returned by the last call to readahead_get_buffer();
+ * @compressed_data must be where the previous chunk's data ended.  If
+ * @stored_size is equal to @uncompressed_size, then the chunk is stored
+ * uncompressed.
+ */
+void
+readahead_add(struct readahead *ra, u64 chunk_idx, const void *compressed_data,
+	      u32 stored_size, u32 uncompressed_size)
+{
+	struct readahead_chunk *chunk = &ra->chunks[ra->num_chunks];
+
+	if (stored_size == uncompressed_size)
+		memcpy(&ra->uncompressed_data[(size_t)ra->num_chunks *
+					      ra->chunk_size],
+		       compressed_data, uncompressed_size);
+
+	chunk->compressed_data = compressed_data;
+	chunk->chunk_idx = chunk_idx;
+	chunk->stored_size = stored_size;
+	chunk->uncompressed_size = uncompressed_size;
+	chunk->result = 0;
+	ra->num_chunks++;
+	ra->compressed_used += stored_size;
+}
+
+/*
+ * Skip @size bytes of the space returned by the last call to
+ * readahead_get_buffer(), which hold the stored data of a chunk that the caller
+ * didn't add.
+ */
+void
+readahead_skip(struct readahead *ra, u32 size)
+{
+	ra->compressed_used += size;
+}
+
+/* Queue the chunks of an idle readahead for decompression.  */
+void
+readahead_submit(struct readahead *ra)
+{
+	if (!ra->num_chunks)
+		return;
+
+	pthread_mutex_lock(&ra_thread.lock);
+	ra->state = RA_QUEUED;
+	ra->next = NULL;
+	*ra_thread.queue_tail = ra;
+	ra_thread.queue_tail = &ra->next;
+	pthread_cond_signal(&ra_thread.work_cond);
+	pthread_mutex_unlock(&ra_thread.lock);
+}
+
+/* Return true if the readahead has been submitted but not yet completed.  */
+int
+readahead_busy(struct readahead *ra)
+{
+	int busy;
+
+	pthread_mutex_lock(&ra_thread.lock);
+	busy = (ra->state == RA_QUEUED || ra->state == RA_RUNNING);
+	pthread_mutex_unlock(&ra_thread.lock);
+	return busy;
+}
+
+/* Wait for a submitted readahead to complete.  */
+void
+readahead_wait(struct readahead *ra)
+{
+	pthread_mutex_lock(&ra_thread.lock);
+	while (ra->state == RA_QUEUED || ra->state == RA_RUNNING)
+		pthread_cond_wait(&ra_thread.done_cond, &ra_thread.lock);
+	pthread_mutex_unlock(&ra_thread.lock);
+}
+
+/* Return the maximum number of chunks a readahead can hold.  */
+unsigned
+readahead_max_chunks(const struct readahead *ra)
+{
+	return ra->max_chunks;
+}
+
+/* Return the number of chunks which have been added to a readahead.  */
+unsigned
+readahead_num_chunks(const struct readahead *ra)
+{
+	return ra->num_chunks;
+}
+
+/*
+ * Get the uncompressed data of the @i'th chunk of a completed readahead, and
+ * its index, stored size, and uncompressed size.  Return NULL if the chunk
+ * couldn't be decompressed.
+ */
+const void *
+readahead_chunk(const struct readahead *ra, unsigned i, u64 *chunk_idx_ret,
+		u32 *stored_size_ret, u32 *size_ret)
+{
+	const struct readahead_chunk *chunk = &ra->chunks[i];
+
+	*chunk_idx_ret = chunk->chunk_idx;
+	*stored_size_ret = chunk->stored_size;
+	*size_ret = chunk->uncompressed_size;
+	if (chunk->result)
+		return NULL;
+	return &ra->uncompressed_data[(size_t)i * ra->chunk_size];
+}
+
+/* Make a readahead which isn't busy idle and empty again.  */
+void
+readahead_reset(struct readahead *ra)
+{
+	ra->num_chunks = 0;
+	ra->compressed_used = 0;
+	ra->state = RA_IDLE;
+}
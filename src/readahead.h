@@ -0,0 +1,56 @@
+/*
+ * readahead.h
+ *
+ * Declarations for background decompression of chunks that are expected to be
+ * read soon.
+ */
+
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+#include "common_defs.h"
+
+struct readahead;
+
+extern void
+readahead_set_size(size_t size);
+
+extern struct readahead *
+readahead_alloc(int is_lzx, u32 chunk_size);
+
+extern void
+readahead_free(struct readahead *ra);
+
+extern void *
+readahead_get_buffer(struct readahead *ra, size_t *size_ret);
+
+extern void
+readahead_add(struct readahead *ra, u64 chunk_idx, const void *compressed_data,
+	      u32 stored_size, u32 uncompressed_size);
+
+extern void
+readahead_skip(struct readahead *ra, u32 size);
+
+extern void
+readahead_submit(struct readahead *ra);
+
+extern int
+readahead_busy(struct readahead *ra);
+
+extern void
+readahead_wait(struct readahead *ra);
+
+extern unsigned
+readahead_max_chunks(const struct readahead *ra);
+
+extern unsigned
+readahead_num_chunks(const struct readahead *ra);
+
+extern const void *
+readahead_chunk(const struct readahead *ra, unsigned i, u64 *chunk_idx_ret,
+		u32 *stored_size_ret, u32 *size_ret);
+
+extern void
+readahead_reset(struct readahead *ra);
+
+#endif /* _READAHEAD_H */
@@ -0,0 +1,165 @@
+/*
+ * resource_pool.c - Pool of decompressors and chunk buffers
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Programs such as file scanners may open a huge number of system-compressed
+ * files, often without reading them at all.  To avoid allocating and freeing a
+ * decompressor and chunk-sized buffers for every open, decompression contexts
+ * get these from this pool when they're first needed to read data, and they
+ * return them to the pool when they're closed.  Up to MAX_FREE_PER_FORMAT sets
+ * of resources are kept for each compression format; beyond that, returned
+ * resources are freed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <ntfs-3g/misc.h>
+
+#include "buffer_arena.h"
+#include "resource_pool.h"
+#include "system_compression.h"
+
+/* The maximum number of unused sets of resources to keep per format  */
+#define MAX_FREE_PER_FORMAT	8
+
+/* The formats are distinguished by their chunk order, which ranges from 12 for
+ * XPRESS4K to 15 for LZX.  */
+#define MIN_CHUNK_ORDER		12
+#define MAX_CHUNK_ORDER		15
+#define NUM_FORMATS		(MAX_CHUNK_ORDER - MIN_CHUNK_ORDER + 1)
+
+static struct {
+	pthread_mutex_t lock;
+	struct decompression_resources *free_list[NUM_FORMATS];
+	unsigned num_free[NUM_FORMATS];
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int
+decompress_lzx(void *decompressor,
+	       const void *compressed_data, size_t compressed_size,
+	       void *uncompressed_data, size_t uncompressed_size)
+{
+	return lzx_decompress(decompressor, compressed_data, compressed_size,
+			      uncompressed_data, uncompressed_size);
+}
+
+static int
+decompress_xpress(void *decompressor,
+		  const void *compressed_data, size_t compressed_size,
+		  void *uncompressed_data, size_t uncompressed_size)
+{
+	return xpress_decompress(decompressor, compressed_data, compressed_size,
+				 uncompressed_data, uncompressed_size);
+}
+
+static void
+free_resources(struct decompression_resources *res)
+{
+	if (res->is_lzx)
+		lzx_free_decompressor(res->decompressor);
+	else
+		xpress_free_decompressor(res->decompressor);
+	free(res->run_buffer);
+	buffer_arena_free(res->cached_chunk, (size_t)1 << res->chunk_order);
+	buffer_arena_free(res->temp_buffer, res->temp_buffer_size);
+	free(res);
+}
+
+static struct decompression_resources *
+allocate_resources(int is_lzx, u32 chunk_order, size_t temp_buffer_size)
+{
+	struct decompression_resources *res;
+
+	res = ntfs_calloc(sizeof(*res));
+	if (!res)
+		return NULL;
+	res->is_lzx = is_lzx;
+	res->chunk_order = chunk_order;
+	res->temp_buffer_size = temp_buffer_size;
+	if (is_lzx) {
+		res->decompressor = lzx_allocate_decompressor(32768);
+		res->decompress = decompress_lzx;
+	} else {
+		res->decompressor = xpress_allocate_decompressor();
+		res->decompress = decompress_xpress;
+	}
+	res->temp_buffer = buffer_arena_alloc(temp_buffer_size);
+	res->cached_chunk = buffer_arena_alloc((size_t)1 << chunk_order);
+	if (!res->decompressor || !res->temp_buffer || !res->cached_chunk) {
+		free_resources(res);
+		return NULL;
+	}
+	return res;
+}
+
+/*
+ * Get a decompressor and buffers for the format whose chunks have size
+ * 2^@chunk_order, reusing ones from the pool if possible.  @temp_buffer_size
+ * must always be the same for the same format.  On failure, return NULL and set
+ * errno.
+ */
+struct decompression_resources *
+resource_pool_get(int is_lzx, u32 chunk_order, size_t temp_buffer_size)
+{
+	struct decompression_resources *res = NULL;
+
+	if (chunk_order >= MIN_CHUNK_ORDER && chunk_order <= MAX_CHUNK_ORDER) {
+		const unsigned i = chunk_order - MIN_CHUNK_ORDER;
+
+		pthread_mutex_lock(&pool.lock);
+		res = pool.free_list[i];
+		if (res) {
+			pool.free_list[i] = res->next;
+			pool.num_free[i]--;
+		}
+		pthread_mutex_unlock(&pool.lock);
+	}
+	if (!res)
+		res = allocate_resources(is_lzx, chunk_order, temp_buffer_size);
+	return res;
+}
+
+/* Return resources to the pool, or free them if the pool is full.  */
+void
+resource_pool_put(struct decompression_resources *res)
+{
+	if (!res)
+		return;
+
+	if (res->chunk_order >= MIN_CHUNK_ORDER &&
+	    res->chunk_order <= MAX_CHUNK_ORDER) {
+		const unsigned i = res->chunk_order - MIN_CHUNK_ORDER;
+
+		pthread_mutex_lock(&pool.lock);
+		if (pool.num_free[i] < MAX_FREE_PER_FORMAT) {
+			res->next = pool.free_list[i];
+			pool.free_list[i] = res;
+			pool.num_free[i]++;
+			res = NULL;
+		}
+		pthread_mutex_unlock(&pool.lock);
+	}
+	if (res)
+		free_resources(res);
+}
@@ -0,0 +1,49 @@
+/*
+ * resource_pool.h
+ *
+ * Declarations for the pool of decompressors and chunk buffers which are
+ * reused by decompression contexts.
+ */
+
+#ifndef _RESOURCE_POOL_H
+#define _RESOURCE_POOL_H
+
+#include "common_defs.h"
+
+/* The per-format resources which a decompression context needs to read data  */
+struct decompression_resources {
+
+	/* The decompressor for the format, and the function which decompresses
+	 * a chunk with it  */
+	void *decompressor;
+	int (*decompress)(void *decompressor,
+			  const void *compressed_data, size_t compressed_size,
+			  void *uncompressed_data, size_t uncompressed_size);
+
+	/* A buffer of 'temp_buffer_size' bytes, as given to
+	 * resource_pool_get()  */
+	void *temp_buffer;
+
+	/* A buffer of 'chunk_size' bytes  */
+	void *cached_chunk;
+
+	/* A buffer for the stored data of a run of chunks, allocated by the
+	 * user when first needed and kept while the resources are pooled, or
+	 * NULL  */
+	void *run_buffer;
+	u32 run_buffer_size;
+
+	/* For the pool's use  */
+	int is_lzx;
+	u32 chunk_order;
+	size_t temp_buffer_size;
+	struct decompression_resources *next;
+};
+
+extern struct decompression_resources *
+resource_pool_get(int is_lzx, u32 chunk_order, size_t temp_buffer_size);
+
+extern void
+resource_pool_put(struct decompression_resources *res);
+
+#endif /* _RESOURCE_POOL_H */
@@ -0,0 +1,148 @@
+/*
+ * sha1.c - SHA-1 message digests
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * WIMBoot reparse points identify their backing WIM by the SHA-1 message digest
+ * of the WIM's blob table.  That's the only use of SHA-1 here, so this is a
+ * straightforward implementation of FIPS 180-4 without any attempt at speed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "sha1.h"
+
+static forceinline u32
+rol32(u32 v, unsigned bits)
+{
+	return (v << bits) | (v >> (32 - bits));
+}
+
+static u32
+get_be32(const u8 *p)
+{
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) |
+	       ((u32)p[2] << 8) | p[3];
+}
+
+static void
+put_be32(u8 *p, u32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* Process one 64-byte block.  */
+static void
+sha1_transform(u32 h[5], const u8 block[64])
+{
+	u32 w[80];
+	u32 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	unsigned i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = get_be32(&block[4 * i]);
+	for (; i < 80; i++)
+		w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	for (i = 0; i < 80; i++) {
+		u32 f, k, t;
+
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		t = rol32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol32(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+void
+sha1_init(struct sha1_ctx *ctx)
+{
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xEFCDAB89;
+	ctx->h[2] = 0x98BADCFE;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xC3D2E1F0;
+	ctx->bytecount = 0;
+}
+
+void
+sha1_update(struct sha1_ctx *ctx, const void *data, size_t len)
+{
+	const u8 *p = data;
+	unsigned used = ctx->bytecount % 64;
+
+	ctx->bytecount += len;
+
+	if (used) {
+		const unsigned n = min(len, (size_t)(64 - used));
+
+		memcpy(&ctx->buffer[used], p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha1_transform(ctx->h, ctx->buffer);
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha1_transform(ctx->h, p);
+	memcpy(ctx->buffer, p, len);
+}
+
+void
+sha1_final(struct sha1_ctx *ctx, u8 hash[SHA1_HASH_SIZE])
+{
+	const u64 bitcount = ctx->bytecount * 8;
+	u8 pad[72] = { 0x80 };
+	unsigned padlen = 64 - (ctx->bytecount + 8) % 64;
+	unsigned i;
+
+	/* Pad with 0x80, then zeroes, then the 64-bit message length in bits,
+	 * to a multiple of 64 bytes.  */
+	for (i = 0; i < 8; i++)
+		pad[padlen + i] = bitcount >> (56 - 8 * i);
+	sha1_update(ctx, pad, padlen + 8);
+
+	for (i = 0; i < 5; i++)
+		put_be32(&hash[4 * i], ctx->h[i]);
+}
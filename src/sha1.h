@@ -0,0 +1,29 @@
+/*
+ * sha1.h
+ *
+ * Declarations for computing SHA-1 message digests.
+ */
+
+#ifndef _SHA1_H
+#define _SHA1_H
+
+#include "common_defs.h"
+
+#define SHA1_HASH_SIZE		20
+
+struct sha1_ctx {
+	u32 h[5];
+	u64 bytecount;
+	u8 buffer[64];
+};
+
+extern void
+sha1_init(struct sha1_ctx *ctx);
+
+extern void
+sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+
+extern void
+sha1_final(struct sha1_ctx *ctx, u8 hash[SHA1_HASH_SIZE]);
+
+#endif /* _SHA1_H */
@@ -0,0 +1,204 @@
+/*
+ * stream_map.c - Reading compressed streams directly from the device
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each ntfs_attr_pread() of a non-resident attribute looks up the runlist
+ * element containing the read position by scanning the runlist from its
+ * beginning, and maps more of the runlist from the MFT if needed.  For heavily
+ * fragmented compressed streams, which are common on images of Windows systems,
+ * that's a significant part of the cost of reading a chunk.
+ *
+ * So on volumes mounted read-only, where the runlist can't change, the whole
+ * runlist of the compressed stream is instead mapped once and converted into a
+ * sorted array of extents giving the device offset of each part of the stream.
+ * Reads then find their extents by binary search and read the data straight
+ * from the device with ntfs_pread(), into the same buffers as before.
+ *
+ * Streams which NTFS-3G would have to do more than that for --- resident,
+ * NTFS-compressed, or encrypted streams, or ones whose initialized size is less
+ * than their size --- are still read with ntfs_attr_pread().
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ntfs-3g/misc.h>
+#include <ntfs-3g/runlist.h>
+
+#include "stream_map.h"
+
+static int stream_map_enabled = 1;
+
+/* Enable or disable reading compressed streams directly from the device.  */
+void
+stream_map_set_enabled(int enabled)
+{
+	stream_map_enabled = enabled;
+}
+
+/* Return true if compressed streams on @vol may be read directly from the
+ * device.  */
+int
+stream_map_allowed(const ntfs_volume *vol)
+{
+	return stream_map_enabled && NVolReadOnly(vol);
+}
+
+/*
+ * Map the whole runlist of the stream @na on @vol and build the stream map for
+ * it.  On failure, or if the stream can't be read directly from the device,
+ * return NULL; the stream can still be read with ntfs_attr_pread().
+ */
+struct stream_map *
+stream_map_create(const ntfs_volume *vol, ntfs_attr *na)
+{
+	const u32 cluster_bits = vol->cluster_size_bits;
+	const u64 size = na->data_size;
+	struct stream_map *map;
+	const runlist_element *rl;
+	size_t num_runs = 0;
+	size_t n = 0;
+
+	if (!NAttrNonResident(na) || NAttrCompressed(na) ||
+	    NAttrEncrypted(na) || na->initialized_size != na->data_size ||
+	    na->data_size <= 0)
+		return NULL;
+
+	if (ntfs_attr_map_whole_runlist(na))
+		return NULL;
+
+	for (rl = na->rl; rl && rl->length; rl++)
+		num_runs++;
+
+	map = ntfs_malloc(sizeof(*map) +
+			  (num_runs + 1) * sizeof(map->extents[0]));
+	if (!map)
+		return NULL;
+	map->dev = vol->dev;
+
+	/* Convert the runs up to the end of the stream into extents, merging
+	 * runs which are contiguous on the device.  */
+	for (rl = na->rl; rl && rl->length; rl++) {
+		const u64 offset = (u64)rl->vcn << cluster_bits;
+		s64 dev_offset;
+
+		if (offset >= size)
+			break;
+
+		if (rl->lcn >= 0)
+			dev_offset = rl->lcn << cluster_bits;
+		else if (rl->lcn == LCN_HOLE)
+			dev_offset = -1;
+		else
+			goto unusable;
+
+		/* The runlist should have no gaps.  */
+		if (offset != (n ? map->extents[n].offset : 0))
+			goto unusable;
+
+		if (n && ((dev_offset < 0 &&
+			   map->extents[n - 1].dev_offset < 0) ||
+			  (dev_offset >= 0 &&
+			   map->extents[n - 1].dev_offset >= 0 &&
+			   map->extents[n - 1].dev_offset +
+				(s64)(offset - map->extents[n - 1].offset) ==
+				dev_offset))) {
+			/* Extend the previous extent.  */
+			map->extents[n].offset += (u64)rl->length <<
+						  cluster_bits;
+			continue;
+		}
+		map->extents[n].offset = offset;
+		map->extents[n].dev_offset = dev_offset;
+		n++;
+		map->extents[n].offset = offset +
+					 ((u64)rl->length << cluster_bits);
+	}
+
+	/* The runs must cover the whole stream.  */
+	if (n == 0 || map->extents[n].offset < size)
+		goto unusable;
+	map->extents[n].offset = size;
+	map->extents[n].dev_offset = -1;
+	map->num_extents = n;
+	return map;
+
+unusable:
+	free(map);
+	return NULL;
+}
+
+/*
+ * Read @count bytes at offset @pos in the stream into @buf.  Holes read as
+ * zeroes.  Return the number of bytes read, which is less than @count only if
+ * the end of the stream was reached, or -1 with errno set on failure.
+ */
+s64
+stream_map_pread(const struct stream_map *map, u64 pos, size_t count,
+		 void *buf)
+{
+	const struct stream_extent *extents = map->extents;
+	size_t lo = 0, hi = map->num_extents;
+	u8 *p = buf;
+
+	if (pos >= extents[map->num_extents].offset)
+		return 0;
+	count = min(count, extents[map->num_extents].offset - pos);
+
+	/* Find the extent containing @pos.  */
+	while (hi - lo > 1) {
+		const size_t mid = lo + (hi - lo) / 2;
+
+		if (extents[mid].offset <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	for (; count; lo++) {
+		const u64 offset_in_extent = pos - extents[lo].offset;
+		const size_t len = min(count, extents[lo + 1].offset - pos);
+
+		if (extents[lo].dev_offset < 0) {
+			memset(p, 0, len);
+		} else {
+			s64 res = ntfs_pread(map->dev,
+					     extents[lo].dev_offset +
+						offset_in_extent, len, p);
+			if (res < 0 || (size_t)res != len) {
+				if (res >= 0)
+					errno = EIO;
+				return -1;
+			}
+		}
+		p += len;
+		pos += len;
+		count -= len;
+	}
+	return p - (u8 *)buf;
+}
+
+void
+stream_map_free(struct stream_map *map)
+{
+	free(map);
+}
@@ -0,0 +1,51 @@
+/*
+ * stream_map.h
+ *
+ * Declarations for reading compressed streams directly from the device.
+ */
+
+#ifndef _STREAM_MAP_H
+#define _STREAM_MAP_H
+
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/device.h>
+#include <ntfs-3g/volume.h>
+
+#include "common_defs.h"
+
+/* A physically contiguous range of a stream.  The range ends where the next
+ * extent begins.  */
+struct stream_extent {
+	/* The offset of the range in the stream  */
+	u64 offset;
+
+	/* The offset of the range on the device, or -1 if it's a hole  */
+	s64 dev_offset;
+};
+
+struct stream_map {
+	struct ntfs_device *dev;
+
+	/* The extents of the stream, in order, followed by an extra entry
+	 * whose offset is the size of the stream  */
+	size_t num_extents;
+	struct stream_extent extents[];
+};
+
+extern void
+stream_map_set_enabled(int enabled);
+
+extern int
+stream_map_allowed(const ntfs_volume *vol);
+
+extern struct stream_map *
+stream_map_create(const ntfs_volume *vol, ntfs_attr *na);
+
+extern s64
+stream_map_pread(const struct stream_map *map, u64 pos, size_t count,
+		 void *buf);
+
+extern void
+stream_map_free(struct stream_map *map);
+
+#endif /* _STREAM_MAP_H */
@@ -50,6 +50,15 @@
  * discovered from the chunk offset table, "random access" reads are possible
  * with chunk granularity.  Writes are not possible, in general, without
  * rewriting the entire file.
+ *
+ * Several reads of the same decompression context may run at once, e.g. when
+ * the FUSE filesystem is multithreaded.  The first of them uses the context
+ * itself, and the others each use a "spare" context, which is a copy of the
+ * context's description of the file with its own decompressor, buffers, and
+ * chunk offsets window.  Spare contexts are kept for reuse until the context is
+ * closed.  libntfs-3g isn't thread-safe, so all calls into it are serialized by
+ * 'libntfs_lock'.  That excludes reads straight from the device, which don't
+ * touch any libntfs-3g state, and the decompression itself.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -58,14 +67,28 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <ntfs-3g/attrib.h>
 #include <ntfs-3g/layout.h>
 #include <ntfs-3g/misc.h>
 
+#include "buffer_arena.h"
+#include "chunk_cache.h"
+#include "chunk_table.h"
+#include "decompress_pool.h"
+#include "disk_cache.h"
+#include "latency.h"
+#include "metadata_cache.h"
+#include "readahead.h"
+#include "resource_pool.h"
+#include "stream_map.h"
 #include "system_compression.h"
+#include "wimboot.h"
 
 /******************************************************************************/
 
@@ -116,6 +139,33 @@ typedef struct {
 
 } __attribute__((packed)) WOF_FILE_PROVIDER_REPARSE_POINT_V1;
 
+/* Known versions of the WIM provider's reparse point data  */
+typedef enum {
+	WIM_PROVIDER_REPARSE_DATA_VERSION	= const_cpu_to_le32(2),
+} WIM_PROVIDER_REPARSE_DATA_VERSION_T;
+
+/* Format of the reparse point attribute of WIMBoot files, whose data is a
+ * resource in a WIM file  */
+typedef struct {
+	REPARSE_POINT reparse;
+	WOF_EXTERNAL_INFO wof;
+
+	/* The metadata specific to the WIM provider  */
+	le32 version;
+	le32 flags;
+	le64 data_source_id;
+	u8 unnamed_data_stream_hash[SHA1_HASH_SIZE];
+	u8 blob_table_hash[SHA1_HASH_SIZE];
+
+	/* The uncompressed size of the file, and the size and offset of its
+	 * resource in the WIM.  The resource is stored uncompressed if and only
+	 * if its size is the uncompressed size.  */
+	le64 unnamed_data_stream_size;
+	le64 unnamed_data_stream_size_in_wim;
+	le64 unnamed_data_stream_offset_in_wim;
+
+} __attribute__((packed)) WIM_PROVIDER_REPARSE_POINT;
+
 /* The available compression formats for system compressed files  */
 typedef enum {
 	FORMAT_XPRESS4K		= const_cpu_to_le32(0),
@@ -146,6 +196,24 @@ static ntfschar compressed_stream_name[] = {
  * divided by the maximum chunk size.  */
 #define NUM_CHUNK_OFFSETS	128
 
+/* The number of consecutive sequential reads after which readahead begins  */
+#define READAHEAD_MIN_SEQUENTIAL_READS	2
+
+/* The size of the buffer for reading the stored data of a run of chunks
+ * without parallel decompression, and the maximum number of chunks that are
+ * read at once  */
+#define RUN_BUFFER_SIZE		(256 << 10)
+#define MAX_RUN_CHUNKS		64
+
+/* The size of the buffer into which chunks are decompressed when extracting a
+ * whole file  */
+#define EXTRACT_BUFFER_SIZE	(1 << 20)
+
+/* Compressed chunks of at most this stored size are checked for decompressing
+ * to all zeroes, until this many of them haven't  */
+#define ZERO_CHUNK_MAX_STORED_SIZE	512
+#define ZERO_CHUNK_MAX_MISSES		16
+
 /* A special marker value not used by any chunk index  */
 #define INVALID_CHUNK_INDEX	UINT64_MAX
 
@@ -155,9 +223,6 @@ struct ntfs_system_decompression_ctx {
 	/* The compression format of the file  */
 	WOF_FILE_PROVIDER_COMPRESSION_FORMAT format;
 
-	/* The decompressor for the file  */
-	void *decompressor;
-
 	/* The uncompressed size of the file in bytes  */
 	u64 uncompressed_size;
 
@@ -187,55 +252,199 @@ struct ntfs_system_decompression_ctx {
 	u64 base_chunk_offset;
 	u32 chunk_offsets[NUM_CHUNK_OFFSETS];
 
-	/* A temporary buffer used to hold the compressed chunk currently being
-	 * decompressed or the chunk offset data currently being parsed.  */
-	void *temp_buffer;
+	/*
+	 * The whole chunk offset table, shared with other decompression
+	 * contexts for the same file, or NULL if it isn't loaded.  For files
+	 * with too many chunks for the chunk offsets cache to hold all of
+	 * them, the whole table is loaded when it is first needed, if it isn't
+	 * too large; 'want_chunk_table' is set until then.
+	 */
+	struct chunk_table *chunk_table;
+	int want_chunk_table;
 
 	/*
-	 * A cache for the most recently decompressed chunk.  'cached_chunk' is
-	 * a buffer which, if 'cached_chunk_idx != INVALID_CHUNK_INDEX',
-	 * contains the uncompressed data of the chunk with index
-	 * 'cached_chunk_idx'.
+	 * The decompressor and buffers, which are taken from the resource pool
+	 * on the first read, or NULL before then:
+	 *
+	 * - 'res->decompressor' is the decompressor for the file, and
+	 *   'res->decompress' decompresses a chunk with it.
+	 *
+	 * - 'res->temp_buffer' is a temporary buffer used to hold the
+	 *   compressed chunk currently being decompressed or the chunk offset
+	 *   data currently being parsed.
 	 *
-	 * This cache is intended to prevent adjacent reads with lengths shorter
-	 * than the chunk size from causing redundant chunk decompressions.
-	 * It's not intended to be a general purpose data cache.
+	 * - 'res->run_buffer' is a buffer for the stored data of a run of
+	 *   consecutive chunks.  It's allocated when first needed; if that
+	 *   fails, 'temp_buffer' is used instead, one chunk at a time.
+	 *
+	 * - 'res->cached_chunk' is a cache for the most recently decompressed
+	 *   chunk.  If 'cached_chunk_idx != INVALID_CHUNK_INDEX', it contains
+	 *   the uncompressed data of the chunk with index 'cached_chunk_idx'.
+	 *   This cache is intended to prevent adjacent reads with lengths
+	 *   shorter than the chunk size from causing redundant chunk
+	 *   decompressions.  It's not intended to be a general purpose data
+	 *   cache.
 	 */
-	void *cached_chunk;
+	struct decompression_resources *res;
 	u64 cached_chunk_idx;
+
+	/*
+	 * The stored data of the file's chunks which decompress to all zeroes,
+	 * once one has been found.  A compressor encodes all such chunks the
+	 * same way, so chunks whose stored data matches are filled with zeroes
+	 * rather than decompressed, and are the holes found by
+	 * ntfs_seek_system_compressed_data().  Until then, 'zero_chunk_size' is
+	 * 0, and compressed chunks of full size whose stored size is at most
+	 * ZERO_CHUNK_MAX_STORED_SIZE are checked after being decompressed;
+	 * 'zero_chunk_misses' counts those that weren't zero, and the checks
+	 * stop after ZERO_CHUNK_MAX_MISSES of them.
+	 */
+	u8 zero_chunk[ZERO_CHUNK_MAX_STORED_SIZE];
+	u32 zero_chunk_size;
+	unsigned zero_chunk_misses;
+
+	/* The cache of decompressed chunks shared by all decompression contexts
+	 * on the volume, or for a WIMBoot file in the WIM, or NULL if it is
+	 * disabled.  Chunks of this file are identified in it, and the file's
+	 * whole chunk table in the list of loaded tables, by 'data_id'.  That's
+	 * the file's MFT reference, 'mref', or for a WIMBoot file, the offset of
+	 * its resource in the WIM, which files with the same data share.  */
+	struct chunk_cache *shared_cache;
+	u64 data_id;
+	u64 mref;
+
+	/*
+	 * For a WIMBoot file, the WIM which holds the file's data, and the
+	 * offset of the file's resource in it, or 'wim == NULL' for a
+	 * system-compressed file.  The resource takes the place of the
+	 * compressed stream.  If it's stored uncompressed, then it has no chunk
+	 * table, and 'stored_uncompressed' is set.
+	 */
+	const struct wim_file *wim;
+	u64 wim_offset;
+	int stored_uncompressed;
+
+	/*
+	 * The file's cache file in the persistent cache directory, or NULL if
+	 * there isn't one.  It's opened on the first read, if
+	 * 'want_disk_cache' is set.  'change_time' is the time the file's MFT
+	 * record was last changed, which tells whether the cache file is stale.
+	 */
+	struct disk_cache_file *disk_cache;
+	int want_disk_cache;
+	u64 change_time;
+
+	/* The volume containing the file  */
+	const ntfs_volume *vol;
+
+	/*
+	 * The file's compressed stream, kept open between reads, or NULL if it
+	 * isn't open.  NTFS-3G may close the file's inode between reads, so
+	 * this is only reused while reads are done through the same open inode
+	 * that it was opened with; otherwise it's reopened.
+	 */
+	ntfs_attr *compressed_na;
+
+	/*
+	 * The map of the compressed stream's location on the device, used to
+	 * read it directly from the device, or NULL if it isn't used.  It's
+	 * built when the stream is first opened, if 'want_stream_map' is set.
+	 */
+	struct stream_map *stream_map;
+	int want_stream_map;
+
+	/*
+	 * Sequential read detection.  'next_read_offset' is the offset at which
+	 * the previous read ended, and 'sequential_reads' is the number of
+	 * consecutive reads which began where the previous read ended.
+	 */
+	u64 next_read_offset;
+	unsigned sequential_reads;
+
+	/*
+	 * Readahead of the chunks following a sequential read, or NULL if it
+	 * hasn't been needed yet.  'readahead_unavailable' is set if it couldn't
+	 * be allocated.  The chunks most recently added to the readahead lie in
+	 * the range 'ra_first_chunk' through 'ra_end_chunk - 1'.  Decompressed
+	 * chunks are moved from the readahead to the shared cache.
+	 */
+	struct readahead *readahead;
+	int readahead_unavailable;
+	u64 ra_first_chunk;
+	u64 ra_end_chunk;
+
+	/* Counters of the work done to read the file, which are added to
+	 * 'total_stats' when the context is closed  */
+	struct ntfs_system_decompression_stats stats;
+
+	/*
+	 * Concurrent reads.  'busy' is set while a read is using this context,
+	 * and 'spares' is the list of spare contexts not in use by any read,
+	 * linked by 'next_spare'.  Both are protected by 'lock'.  Spare contexts
+	 * don't use these fields.
+	 */
+	pthread_mutex_t lock;
+	int busy;
+	struct ntfs_system_decompression_ctx *spares;
+	struct ntfs_system_decompression_ctx *next_spare;
 };
 
-static int allocate_decompressor(struct ntfs_system_decompression_ctx *ctx)
+/* Serializes all calls into libntfs-3g, which isn't thread-safe  */
+static pthread_mutex_t libntfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The counters of all decompression contexts which have been closed  */
+static struct ntfs_system_decompression_stats total_stats;
+static pthread_mutex_t total_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Add the counters in @src to those in @dst.  */
+static void add_stats(struct ntfs_system_decompression_stats *dst,
+		      const struct ntfs_system_decompression_stats *src)
 {
-	if (ctx->format == FORMAT_LZX)
-		ctx->decompressor = lzx_allocate_decompressor(32768);
-	else
-		ctx->decompressor = xpress_allocate_decompressor();
-	if (!ctx->decompressor)
-		return -1;
-	return 0;
+	const u64 *s = (const u64 *)src;
+	u64 *d = (u64 *)dst;
+	size_t i;
+
+	for (i = 0; i < sizeof(*dst) / sizeof(u64); i++)
+		d[i] += s[i];
 }
 
-static void free_decompressor(struct ntfs_system_decompression_ctx *ctx)
+/* Return the current time in nanoseconds, for timing decompression.  */
+static u64 now_ns(void)
 {
-	if (ctx->format == FORMAT_LZX)
-		lzx_free_decompressor(ctx->decompressor);
-	else
-		xpress_free_decompressor(ctx->decompressor);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Count one chunk decompressed for @ctx.  */
+static void count_chunk_decompressed(struct ntfs_system_decompression_ctx *ctx)
+{
+	ctx->stats.chunks_decompressed[le32_to_cpu(ctx->format)]++;
 }
 
 static int decompress(struct ntfs_system_decompression_ctx *ctx,
 		      const void *compressed_data, size_t compressed_size,
 		      void *uncompressed_data, size_t uncompressed_size)
 {
-	if (ctx->format == FORMAT_LZX)
-		return lzx_decompress(ctx->decompressor,
+	const u32 format = le32_to_cpu(ctx->format);
+	u64 start;
+	u64 ns;
+	int ret;
+
+	trace_point(decompress__start, format, compressed_size,
+		    uncompressed_size);
+	start = now_ns();
+	ret = (*ctx->res->decompress)(ctx->res->decompressor,
 				      compressed_data, compressed_size,
 				      uncompressed_data, uncompressed_size);
-	else
-		return xpress_decompress(ctx->decompressor,
-					 compressed_data, compressed_size,
-					 uncompressed_data, uncompressed_size);
+	ns = now_ns() - start;
+	trace_point(decompress__done, format, ret, ns);
+
+	count_chunk_decompressed(ctx);
+	ctx->stats.decompress_ns += ns;
+	latency_record(NTFS_DECOMPRESSION_STAGE_DECOMPRESS + format, ns);
+	return ret;
 }
 
 static int get_compression_format(ntfs_inode *ni, const REPARSE_POINT *reparse,
@@ -334,6 +543,145 @@ static s64 get_compressed_size(ntfs_inode *ni)
 	return ret;
 }
 
+/* Return the MFT reference of an open inode, which includes the sequence number
+ * of its MFT record.  */
+static u64 get_mref(const ntfs_inode *ni)
+{
+	return MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number));
+}
+
+/*
+ * Get the compression format and the compressed size of a system compressed
+ * file.  The results are cached per volume, so that this is cheap for files
+ * whose attributes are retrieved repeatedly.  On failure, return -1 and set
+ * errno.  If the file is not a system compressed file, return -1 and set errno
+ * to EOPNOTSUPP.
+ */
+static int get_file_info(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			 WOF_FILE_PROVIDER_COMPRESSION_FORMAT *format_ret,
+			 s64 *compressed_size_ret)
+{
+	const u64 mref = get_mref(ni);
+	struct metadata_cache *cache;
+	u32 format;
+	u64 compressed_size;
+	s64 csize;
+
+	/* Files that are no longer reparse points can't be system compressed,
+	 * regardless of what's cached.  */
+	if (!(ni->flags & FILE_ATTR_REPARSE_POINT)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	cache = metadata_cache_get(ni->vol);
+	if (cache && !metadata_cache_lookup(cache, mref, ni->data_size,
+					    &format, &compressed_size)) {
+		*format_ret = (WOF_FILE_PROVIDER_COMPRESSION_FORMAT)format;
+		*compressed_size_ret = compressed_size;
+		return 0;
+	}
+
+	pthread_mutex_lock(&libntfs_lock);
+	if (get_compression_format(ni, reparse, format_ret))
+		csize = -1;
+	else
+		csize = get_compressed_size(ni);
+	pthread_mutex_unlock(&libntfs_lock);
+	if (csize < 0)
+		return -1;
+
+	if (cache)
+		metadata_cache_insert(cache, mref, ni->data_size,
+				      (u32)*format_ret, csize);
+	*compressed_size_ret = csize;
+	return 0;
+}
+
+/* The location of the data of a WIMBoot file  */
+struct wim_backing {
+	const struct wim_file *wim;
+	u64 offset;
+	u64 size_in_wim;
+
+	/* The system compression format which is equivalent to the WIM's
+	 * compression format and chunk size  */
+	WOF_FILE_PROVIDER_COMPRESSION_FORMAT format;
+};
+
+/*
+ * If @ni is a WIMBoot file whose WIM has been given, then get the location of
+ * its data in the WIM.  Otherwise, return -1 and set errno, to EOPNOTSUPP if it
+ * isn't such a file.
+ */
+static int get_wim_backing(ntfs_inode *ni, const REPARSE_POINT *reparse,
+			   struct wim_backing *backing)
+{
+	WIM_PROVIDER_REPARSE_POINT *rp;
+	s64 rpbuflen;
+	int ret = -1;
+
+	if (!(ni->flags & FILE_ATTR_REPARSE_POINT)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (reparse) {
+		rp = (WIM_PROVIDER_REPARSE_POINT *)reparse;
+		rpbuflen = sizeof(REPARSE_POINT) +
+			   le16_to_cpu(reparse->reparse_data_length);
+	} else {
+		pthread_mutex_lock(&libntfs_lock);
+		rp = ntfs_attr_readall(ni, AT_REPARSE_POINT, AT_UNNAMED, 0,
+				       &rpbuflen);
+		pthread_mutex_unlock(&libntfs_lock);
+		if (!rp)
+			return -1;
+	}
+
+	errno = EOPNOTSUPP;
+	if (rpbuflen >= (s64)sizeof(WIM_PROVIDER_REPARSE_POINT) &&
+	    rp->reparse.reparse_tag == IO_REPARSE_TAG_WOF &&
+	    rp->wof.version == WOF_CURRENT_VERSION &&
+	    rp->wof.provider == WOF_PROVIDER_WIM &&
+	    rp->version == WIM_PROVIDER_REPARSE_DATA_VERSION &&
+	    (backing->wim = wimboot_find_wim(rp->blob_table_hash)))
+	{
+		const u64 size = le64_to_cpu(rp->unnamed_data_stream_size);
+		const int compression = backing->wim->compression;
+		const u32 chunk_order = backing->wim->chunk_order;
+
+		backing->offset =
+			le64_to_cpu(rp->unnamed_data_stream_offset_in_wim);
+		backing->size_in_wim =
+			le64_to_cpu(rp->unnamed_data_stream_size_in_wim);
+
+		if (compression == WIM_COMPRESSION_LZX)
+			backing->format = FORMAT_LZX;
+		else if (chunk_order == 13)
+			backing->format = FORMAT_XPRESS8K;
+		else if (chunk_order == 14)
+			backing->format = FORMAT_XPRESS16K;
+		else
+			backing->format = FORMAT_XPRESS4K;
+
+		/* The file's size must be its data's uncompressed size, and
+		 * only WIMs with compression can have compressed resources,
+		 * which must be smaller than their data.  */
+		if (size != (u64)ni->data_size ||
+		    backing->size_in_wim > size ||
+		    (compression == WIM_COMPRESSION_NONE &&
+		     backing->size_in_wim != size))
+			errno = EINVAL;
+		else
+			ret = 0;
+	}
+
+	if ((const REPARSE_POINT *)rp != reparse)
+		free(rp);
+	return ret;
+}
+
 /*
  * ntfs_get_system_compressed_file_size - Return the compressed size of a system
  * compressed file
@@ -341,64 +689,143 @@ static s64 get_compressed_size(ntfs_inode *ni)
  * @ni:		The NTFS inode for the file
  * @reparse:	(Optional) the contents of the file's reparse point attribute
  *
- * On success, return the compressed size in bytes.  On failure, return -1 and
- * set errno.  If the file is not a system compressed file, return -1 and set
- * errno to EOPNOTSUPP.
+ * On success, return the compressed size in bytes; for a WIMBoot file, that's
+ * the size of its data in the WIM.  On failure, return -1 and set errno.  If
+ * the file is neither a system compressed file nor a WIMBoot file whose WIM has
+ * been given, return -1 and set errno to EOPNOTSUPP.
  */
 s64 ntfs_get_system_compressed_file_size(ntfs_inode *ni,
 					 const REPARSE_POINT *reparse)
 {
 	WOF_FILE_PROVIDER_COMPRESSION_FORMAT format;
+	struct wim_backing backing;
+	s64 csize;
 
-	/* Verify this is a system compressed file.  */
-	if (get_compression_format(ni, reparse, &format))
-		return -1;
+	/* Verify this is a system compressed file or a WIMBoot file.  */
+	if (get_file_info(ni, reparse, &format, &csize)) {
+		if (errno != EOPNOTSUPP ||
+		    get_wim_backing(ni, reparse, &backing))
+			return -1;
+		csize = backing.size_in_wim;
+	}
 
-	return get_compressed_size(ni);
+	return csize;
 }
 
 /*
- * ntfs_open_system_decompression_ctx - Prepare to read a system-compressed file
+ * ntfs_set_system_decompression_cache_size - Set the size of the chunk cache
  *
- * @ni:		The NTFS inode for the file
- * @reparse:	(Optional) the contents of the file's reparse point attribute
+ * @max_size:	The maximum number of bytes of decompressed data to cache per
+ *		volume, or 0 to disable the cache
  *
- * On success, return a pointer to the decompression context.  On failure,
- * return NULL and set errno.  If the file is not a system-compressed file,
- * return NULL and set errno to EOPNOTSUPP.
+ * Decompressed chunks are cached per volume and shared across all decompression
+ * contexts, so that files which are opened many times, e.g. by many different
+ * processes, aren't decompressed over and over again.  This sets the memory
+ * budget for that cache.  It must be called before any decompression context is
+ * opened on the volume to have any effect.
  */
-struct ntfs_system_decompression_ctx *
-ntfs_open_system_decompression_ctx(ntfs_inode *ni, const REPARSE_POINT *reparse)
+void ntfs_set_system_decompression_cache_size(size_t max_size)
 {
-	WOF_FILE_PROVIDER_COMPRESSION_FORMAT format;
-	struct ntfs_system_decompression_ctx *ctx;
-	s64 csize;
+	chunk_cache_set_max_size(max_size);
+}
 
-	/* Get the compression format.  This also validates that the file really
-	 * is a system-compressed file.  */
-	if (get_compression_format(ni, reparse, &format))
-		goto err;
+/*
+ * ntfs_set_system_decompression_threads - Set the number of decompression
+ * threads
+ *
+ * @num_threads:	The maximum number of threads which may decompress the
+ *			chunks of a single read, including the calling thread
+ *
+ * Large reads that span several chunks can have their chunks decompressed in
+ * parallel.  By default, only the calling thread is used.  This must be called
+ * before the first read to have any effect.
+ */
+void ntfs_set_system_decompression_threads(unsigned num_threads)
+{
+	decompress_pool_set_threads(num_threads);
+}
 
-	/* Allocate the decompression context.  */
-	ctx = ntfs_malloc(sizeof(struct ntfs_system_decompression_ctx));
-	if (!ctx)
-		goto err;
+/*
+ * ntfs_set_system_decompression_readahead - Set the readahead size
+ *
+ * @size:	The maximum amount of uncompressed data, in bytes, to decompress
+ *		ahead of a sequential reader, or 0 to disable readahead
+ *
+ * When a file is read sequentially, the chunks following each read are
+ * decompressed by a background thread and added to the shared chunk cache, so
+ * readahead has no effect if the shared cache is disabled.  This only affects
+ * files opened after it's called.
+ */
+void ntfs_set_system_decompression_readahead(size_t size)
+{
+	readahead_set_size(size);
+}
 
-	/* Allocate the decompressor.  */
-	ctx->format = format;
-	if (allocate_decompressor(ctx))
-		goto err_free_ctx;
+/*
+ * ntfs_set_system_decompression_metadata_cache - Set the size of the metadata
+ * cache
+ *
+ * @num_entries:	The number of files whose metadata may be cached per
+ *			volume, or 0 to disable the cache
+ *
+ * The compression format and compressed size of system-compressed files are
+ * cached per volume, so that retrieving the attributes of a file again doesn't
+ * require parsing its reparse point and looking up its compressed stream.  It
+ * must be called before the metadata of any file on the volume is retrieved to
+ * have any effect.
+ */
+void ntfs_set_system_decompression_metadata_cache(unsigned num_entries)
+{
+	metadata_cache_set_num_entries(num_entries);
+}
 
-	/* Determine the compressed size of the file.  */
-	csize = get_compressed_size(ni);
-	if (csize < 0)
-		goto err_free_decompressor;
-	ctx->compressed_size = csize;
+/*
+ * ntfs_set_system_decompression_chunk_table_max - Set the maximum size of a
+ * loaded chunk table
+ *
+ * @max_size:	The maximum size in bytes, or 0 to never load whole chunk tables
+ *
+ * For files with many chunks, the whole chunk offset table, which gives the
+ * location of each chunk in the compressed stream, is loaded into memory and
+ * shared by all decompression contexts for the file, so that random reads don't
+ * need to read the chunk offset table again.  Files whose table would take more
+ * than @max_size bytes of memory instead cache only part of it at a time.
+ */
+void ntfs_set_system_decompression_chunk_table_max(size_t max_size)
+{
+	chunk_table_set_max_size(max_size);
+}
 
-	/* The uncompressed size of a system-compressed file is the size of its
-	 * unnamed data stream, which should be sparse so that it consumes no
-	 * disk space (though we don't rely on it being sparse).  */
-	ctx->uncompressed_size = ni->data_size;
+/*
+ * ntfs_set_system_decompression_direct_read - Enable or disable reading
+ * directly from the device
+ *
+ * @enabled:	Whether compressed streams may be read directly from the device
+ *
+ * On volumes mounted read-only, the location of each file's compressed stream
+ * on the device is looked up once, when the file is first read, and the
+ * compressed data is then read directly from the device rather than through
+ * NTFS-3G's attribute reads.  This is enabled by default.  It only affects
+ * files opened after it's called.
+ */
+void ntfs_set_system_decompression_direct_read(int enabled)
+{
+	stream_map_set_enabled(enabled);
+}
+
+/*
+ * Initialize a decompression context for the file with MFT reference @mref on
+ * @vol, whose MFT record was last changed at @change_time, and which has the
+ * specified compression format and sizes.
+ */
+static void init_ctx(struct ntfs_system_decompression_ctx *ctx,
+		     const ntfs_volume *vol, u64 mref, u64 change_time,
+		     WOF_FILE_PROVIDER_COMPRESSION_FORMAT format,
+		     u64 uncompressed_size, u64 compressed_size)
+{
+	ctx->format = format;
+	ctx->compressed_size = compressed_size;
+	ctx->uncompressed_size = uncompressed_size;
 
 	/* Get the chunk size, which depends on the compression format.  */
 	ctx->chunk_order = get_chunk_order(ctx->format);
@@ -410,82 +837,437 @@ ntfs_open_system_decompression_ctx(ntfs_inode *ni, const REPARSE_POINT *reparse)
 
 	/* Initially, no chunk offsets are cached.  */
 	ctx->base_chunk_idx = INVALID_CHUNK_INDEX;
+	ctx->chunk_table = NULL;
+	ctx->want_chunk_table = ctx->num_chunks >= NUM_CHUNK_OFFSETS &&
+				chunk_table_allowed(ctx->num_chunks);
 
-	/* Allocate buffers for chunk data.  */
-	ctx->temp_buffer = ntfs_malloc(max(ctx->chunk_size,
-					   NUM_CHUNK_OFFSETS * sizeof(u64)));
-	ctx->cached_chunk = ntfs_malloc(ctx->chunk_size);
+	/* The decompressor and buffers for chunk data aren't needed until the
+	 * first read.  */
+	ctx->res = NULL;
 	ctx->cached_chunk_idx = INVALID_CHUNK_INDEX;
-	if (!ctx->temp_buffer || !ctx->cached_chunk)
-		goto err_free_buffers;
+	ctx->zero_chunk_size = 0;
+	ctx->zero_chunk_misses = 0;
+
+	/* Look up the volume's shared chunk cache.  This is optional, so
+	 * proceed without it if it isn't available.  */
+	ctx->shared_cache = chunk_cache_get(vol);
+	ctx->data_id = mref;
+	ctx->mref = mref;
+	ctx->wim = NULL;
+	ctx->wim_offset = 0;
+	ctx->stored_uncompressed = 0;
+	ctx->disk_cache = NULL;
+	ctx->want_disk_cache = 1;
+	ctx->change_time = change_time;
+	ctx->vol = vol;
+	ctx->compressed_na = NULL;
+	ctx->stream_map = NULL;
+	ctx->want_stream_map = stream_map_allowed(vol);
+
+	ctx->next_read_offset = 0;
+	ctx->sequential_reads = 0;
+	ctx->readahead = NULL;
+	ctx->readahead_unavailable = 0;
+	ctx->ra_first_chunk = 0;
+	ctx->ra_end_chunk = 0;
+
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->busy = 0;
+	ctx->spares = NULL;
+	ctx->next_spare = NULL;
+}
 
-	return ctx;
+/* Make @ctx read the file's data from the resource at @offset in @wim rather
+ * than from a compressed stream.  @stored_uncompressed is set if the resource
+ * is stored uncompressed.  */
+static void set_wim_backing(struct ntfs_system_decompression_ctx *ctx,
+			    const struct wim_file *wim, u64 offset,
+			    int stored_uncompressed)
+{
+	ctx->wim = wim;
+	ctx->wim_offset = offset;
+	ctx->stored_uncompressed = stored_uncompressed;
+	ctx->data_id = offset;
+	ctx->shared_cache = chunk_cache_get(wim);
+	ctx->want_stream_map = 0;
+	if (stored_uncompressed)
+		ctx->want_chunk_table = 0;
+}
 
-err_free_buffers:
-	free(ctx->cached_chunk);
-	free(ctx->temp_buffer);
-err_free_decompressor:
-	free_decompressor(ctx);
-err_free_ctx:
+/* Free a decompression context and everything it holds.  */
+static void destroy_ctx(struct ntfs_system_decompression_ctx *ctx)
+{
+	if (ctx->compressed_na) {
+		pthread_mutex_lock(&libntfs_lock);
+		ntfs_attr_close(ctx->compressed_na);
+		pthread_mutex_unlock(&libntfs_lock);
+	}
+	readahead_free(ctx->readahead);
+	disk_cache_close(ctx->disk_cache);
+	stream_map_free(ctx->stream_map);
+	chunk_table_put(ctx->chunk_table);
+	resource_pool_put(ctx->res);
+	pthread_mutex_destroy(&ctx->lock);
 	free(ctx);
-err:
-	return NULL;
 }
 
-/* Retrieve the stored offset and size of a chunk stored in the compressed file
- * stream.  */
-static int get_chunk_location(struct ntfs_system_decompression_ctx *ctx,
-			      ntfs_attr *na, u64 chunk_idx,
-			      u64 *offset_ret, u32 *stored_size_ret)
+/*
+ * ntfs_set_system_decompression_disk_cache - Set the persistent cache directory
+ *
+ * @dir:	The directory in which to keep decompressed chunks, or NULL to
+ *		disable the persistent cache
+ *
+ * Decompressed chunks can be kept in a directory, so that later mounts of the
+ * same volume don't need to decompress them again.  The directory is created if
+ * it doesn't exist.  This is disabled by default.  It only affects files opened
+ * after it's called.  On failure, return -1 and set errno.
+ */
+int ntfs_set_system_decompression_disk_cache(const char *dir)
 {
-	size_t cache_idx;
-
-	/* To get the stored size of the chunk, we need its offset and the next
-	 * chunk's offset.  Use the cached values if possible; otherwise load
-	 * the needed offsets into the cache.  To reduce the number of chunk
-	 * table reads that may be required later, also load some extra.  */
-	if (chunk_idx < ctx->base_chunk_idx ||
-	    chunk_idx + 1 >= ctx->base_chunk_idx + NUM_CHUNK_OFFSETS)
-	{
-		const u64 start_chunk = chunk_idx;
-		const u64 end_chunk =
-			chunk_idx + min(NUM_CHUNK_OFFSETS - 1,
-					ctx->num_chunks - chunk_idx);
-		const int entry_shift =
-			(ctx->uncompressed_size <= UINT32_MAX) ? 2 : 3;
-		le32 * const offsets32 = ctx->temp_buffer;
-		le64 * const offsets64 = ctx->temp_buffer;
-		u64 first_entry_to_read;
-		size_t num_entries_to_read;
-		size_t i, j;
-		s64 res;
-
-		num_entries_to_read = end_chunk - start_chunk;
-
-		/* The first chunk has no explicit chunk table entry.  */
-		if (start_chunk == 0) {
-			num_entries_to_read--;
-			first_entry_to_read = 0;
-		} else {
-			first_entry_to_read = start_chunk - 1;
-		}
-
-		if (end_chunk != ctx->num_chunks)
-			num_entries_to_read++;
+	return disk_cache_set_dir(dir);
+}
 
-		/* Read the chunk table entries into a temporary buffer.  */
-		res = ntfs_attr_pread(na, first_entry_to_read << entry_shift,
-				      num_entries_to_read << entry_shift,
-				      ctx->temp_buffer);
+/*
+ * ntfs_set_system_decompression_disk_cache_size - Set the size of the
+ * persistent cache
+ *
+ * @max_size:	The maximum size in bytes of the persistent cache directory
+ *
+ * When the directory grows larger than this, the least recently used files'
+ * chunks are deleted from it.  The default is 1 GiB.
+ */
+void ntfs_set_system_decompression_disk_cache_size(u64 max_size)
+{
+	disk_cache_set_max_size(max_size);
+}
 
-		if ((u64)res != num_entries_to_read << entry_shift) {
-			if (res >= 0)
-				errno = EINVAL;
-			ctx->base_chunk_idx = INVALID_CHUNK_INDEX;
-			return -1;
-		}
+/*
+ * ntfs_set_system_decompression_huge_pages - Enable or disable huge pages
+ *
+ * @enabled:	Whether to back decompressors and decompressed chunks by
+ *		transparent huge pages
+ *
+ * These are allocated from 2 MiB slabs, which with this enabled are backed by
+ * transparent huge pages where the system supports them.  This is disabled by
+ * default, since each slab then uses all of its memory as soon as any of it is
+ * used.  It only affects slabs allocated after it's called.
+ */
+void ntfs_set_system_decompression_huge_pages(int enabled)
+{
+	buffer_arena_set_huge_pages(enabled);
+}
 
-		/* Prepare the cached chunk offsets.  */
+/*
+ * ntfs_add_system_decompression_wim - Give a WIM which backs WIMBoot files
+ *
+ * @path:	The path to the WIM file
+ *
+ * Files whose reparse points refer to the WIM, by the SHA-1 message digest of
+ * its blob table, can then be read like system-compressed files.  Only
+ * standalone WIMs compressed with XPRESS or LZX, or uncompressed, are
+ * supported.  On failure, return -1 and set errno.
+ */
+int ntfs_add_system_decompression_wim(const char *path)
+{
+	return wimboot_add_wim(path);
+}
+
+/*
+ * ntfs_open_system_decompression_ctx - Prepare to read a system-compressed file
+ *
+ * @ni:		The NTFS inode for the file
+ * @reparse:	(Optional) the contents of the file's reparse point attribute
+ *
+ * WIMBoot files whose WIM has been given with
+ * ntfs_add_system_decompression_wim() can be read too.
+ *
+ * On success, return a pointer to the decompression context.  On failure,
+ * return NULL and set errno.  If the file is neither a system-compressed file
+ * nor such a WIMBoot file, return NULL and set errno to EOPNOTSUPP.
+ */
+struct ntfs_system_decompression_ctx *
+ntfs_open_system_decompression_ctx(ntfs_inode *ni, const REPARSE_POINT *reparse)
+{
+	WOF_FILE_PROVIDER_COMPRESSION_FORMAT format;
+	struct wim_backing backing = { .wim = NULL };
+	struct ntfs_system_decompression_ctx *ctx;
+	s64 csize;
+
+	/* Get the compression format and the compressed size of the file.  This
+	 * also validates that the file really is a system-compressed file, or
+	 * else a WIMBoot file.  */
+	if (get_file_info(ni, reparse, &format, &csize)) {
+		if (errno != EOPNOTSUPP ||
+		    get_wim_backing(ni, reparse, &backing))
+			goto err;
+		format = backing.format;
+		csize = backing.size_in_wim;
+	}
+
+	/* Allocate the decompression context.  */
+	ctx = ntfs_malloc(sizeof(struct ntfs_system_decompression_ctx));
+	if (!ctx)
+		goto err;
+
+	/* The uncompressed size of a system-compressed file is the size of its
+	 * unnamed data stream, which should be sparse so that it consumes no
+	 * disk space (though we don't rely on it being sparse).  */
+	init_ctx(ctx, ni->vol, get_mref(ni),
+		 sle64_to_cpu(ni->last_mft_change_time), format,
+		 ni->data_size, csize);
+	if (backing.wim)
+		set_wim_backing(ctx, backing.wim, backing.offset,
+				backing.size_in_wim == (u64)ni->data_size);
+	return ctx;
+
+err:
+	return NULL;
+}
+
+/*
+ * Get a decompression context for a read of @ctx: @ctx itself if no other read
+ * is using it, otherwise a spare context, which is allocated if none is free.
+ * Spare contexts don't do readahead, since sequential reads are only detected
+ * per context.  On failure, return NULL and set errno.
+ */
+static struct ntfs_system_decompression_ctx *
+get_reader(struct ntfs_system_decompression_ctx *ctx)
+{
+	struct ntfs_system_decompression_ctx *reader;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (!ctx->busy) {
+		ctx->busy = 1;
+		reader = ctx;
+	} else {
+		reader = ctx->spares;
+		if (reader)
+			ctx->spares = reader->next_spare;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (!reader) {
+		reader = ntfs_malloc(sizeof(*reader));
+		if (!reader)
+			return NULL;
+		init_ctx(reader, ctx->vol, ctx->mref, ctx->change_time,
+			 ctx->format, ctx->uncompressed_size,
+			 ctx->compressed_size);
+		if (ctx->wim)
+			set_wim_backing(reader, ctx->wim, ctx->wim_offset,
+					ctx->stored_uncompressed);
+		reader->readahead_unavailable = 1;
+	}
+	return reader;
+}
+
+/* Finish a read of @ctx which used @reader.  */
+static void put_reader(struct ntfs_system_decompression_ctx *ctx,
+		       struct ntfs_system_decompression_ctx *reader)
+{
+	pthread_mutex_lock(&ctx->lock);
+	if (reader == ctx) {
+		ctx->busy = 0;
+	} else {
+		reader->next_spare = ctx->spares;
+		ctx->spares = reader;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Return the uncompressed size of the specified chunk.  All chunks decompress
+ * to 'chunk_size' bytes except possibly the last, which decompresses to
+ * whatever remains.  */
+static u32 get_chunk_uncompressed_size(const struct ntfs_system_decompression_ctx *ctx,
+				       u64 chunk_idx)
+{
+	if (chunk_idx == ctx->num_chunks - 1)
+		return ((ctx->uncompressed_size - 1) & (ctx->chunk_size - 1)) + 1;
+	return ctx->chunk_size;
+}
+
+/* Read @count bytes at offset @pos in the compressed stream @na into @buf,
+ * directly from the device if possible, or for a WIMBoot file, from its
+ * resource in the WIM.  @stage tells whether this reads chunk offsets or chunk
+ * data.  Return the number of bytes read, or -1 with errno set on failure.  */
+static s64 read_compressed_stream(struct ntfs_system_decompression_ctx *ctx,
+				  ntfs_attr *na, u64 pos, size_t count,
+				  void *buf, unsigned stage)
+{
+	u64 start;
+	s64 res;
+
+	trace_point(read__start, stage, ctx->data_id, pos, count);
+	start = latency_clock();
+
+	if (ctx->wim) {
+		res = wim_pread(ctx->wim, ctx->wim_offset + pos, count, buf);
+	} else if (ctx->stream_map) {
+		res = stream_map_pread(ctx->stream_map, pos, count, buf);
+	} else {
+		pthread_mutex_lock(&libntfs_lock);
+		res = ntfs_attr_pread(na, pos, count, buf);
+		pthread_mutex_unlock(&libntfs_lock);
+	}
+	latency_record(stage, latency_clock() - start);
+	trace_point(read__done, stage, ctx->data_id, pos, res);
+	if (res > 0)
+		ctx->stats.compressed_bytes_read += res;
+	return res;
+}
+
+/* Look up chunk @chunk_idx of the file in the shared cache, which must be
+ * enabled.  On a hit, copy @size bytes of it, starting at @offset, into @buf
+ * and return 0.  On a miss, return -1.  */
+static int read_shared_cache(struct ntfs_system_decompression_ctx *ctx,
+			     u64 chunk_idx, u32 offset, u32 size, void *buf)
+{
+	if (chunk_cache_read(ctx->shared_cache, ctx->data_id, chunk_idx,
+			     offset, size, buf)) {
+		ctx->stats.cache_misses++;
+		return -1;
+	}
+	ctx->stats.cache_hits++;
+	return 0;
+}
+
+/* Look up chunk @chunk_idx of the file in the persistent cache, which must be
+ * enabled.  On a hit, read the whole chunk into @buf, add it to the shared
+ * cache, and return 0.  On a miss, return -1.  */
+static int read_disk_cache(struct ntfs_system_decompression_ctx *ctx,
+			   u64 chunk_idx, void *buf)
+{
+	const u32 size = get_chunk_uncompressed_size(ctx, chunk_idx);
+
+	if (disk_cache_read(ctx->disk_cache, chunk_idx, buf, size)) {
+		ctx->stats.disk_cache_misses++;
+		return -1;
+	}
+	ctx->stats.disk_cache_hits++;
+	if (ctx->shared_cache)
+		chunk_cache_insert(ctx->shared_cache, ctx->data_id, chunk_idx,
+				   buf, size);
+	return 0;
+}
+
+/* Add the uncompressed data of chunk @chunk_idx to the shared cache and the
+ * persistent cache, if they're enabled and don't already have it.  */
+static void cache_chunk(struct ntfs_system_decompression_ctx *ctx,
+			u64 chunk_idx, const void *data)
+{
+	const u32 size = get_chunk_uncompressed_size(ctx, chunk_idx);
+
+	if (ctx->shared_cache &&
+	    !chunk_cache_contains(ctx->shared_cache, ctx->data_id, chunk_idx))
+		chunk_cache_insert(ctx->shared_cache, ctx->data_id, chunk_idx,
+				   data, size);
+	if (ctx->disk_cache)
+		disk_cache_write(ctx->disk_cache, chunk_idx, data, size);
+}
+
+/* The compressed stream of a file, for loading its chunk table  */
+struct stream_ref {
+	struct ntfs_system_decompression_ctx *ctx;
+	ntfs_attr *na;
+};
+
+static s64 read_stream_ref(void *arg, u64 pos, size_t count, void *buf)
+{
+	const struct stream_ref *ref = arg;
+
+	return read_compressed_stream(ref->ctx, ref->na, pos, count, buf,
+				      NTFS_DECOMPRESSION_STAGE_OFFSETS_READ);
+}
+
+/* Retrieve the stored offset and size of a chunk stored in the compressed file
+ * stream.  */
+static int get_chunk_location(struct ntfs_system_decompression_ctx *ctx,
+			      ntfs_attr *na, u64 chunk_idx,
+			      u64 *offset_ret, u32 *stored_size_ret)
+{
+	const int entry_shift = (ctx->uncompressed_size <= UINT32_MAX) ? 2 : 3;
+	size_t cache_idx;
+
+	/* A WIM resource stored uncompressed is just the file's data.  */
+	if (ctx->stored_uncompressed) {
+		*offset_ret = chunk_idx << ctx->chunk_order;
+		*stored_size_ret = get_chunk_uncompressed_size(ctx, chunk_idx);
+		return 0;
+	}
+
+	/* Load the whole chunk offset table if wanted.  If this fails, then
+	 * fall back to the chunk offsets cache.  */
+	if (ctx->want_chunk_table) {
+		struct stream_ref ref = { .ctx = ctx, .na = na };
+
+		ctx->want_chunk_table = 0;
+		ctx->chunk_table = chunk_table_get(ctx->wim ? (const void *)ctx->wim
+							    : ctx->vol,
+						   ctx->data_id,
+						   read_stream_ref, &ref,
+						   ctx->num_chunks,
+						   ctx->chunk_size,
+						   entry_shift,
+						   ctx->compressed_size);
+	}
+
+	if (ctx->chunk_table) {
+		*offset_ret = chunk_table_offset(ctx->chunk_table, chunk_idx);
+		*stored_size_ret = chunk_table_offset(ctx->chunk_table,
+						      chunk_idx + 1) -
+				   *offset_ret;
+		return 0;
+	}
+
+	/* To get the stored size of the chunk, we need its offset and the next
+	 * chunk's offset.  Use the cached values if possible; otherwise load
+	 * the needed offsets into the cache.  To reduce the number of chunk
+	 * table reads that may be required later, also load some extra.  */
+	if (chunk_idx < ctx->base_chunk_idx ||
+	    chunk_idx + 1 >= ctx->base_chunk_idx + NUM_CHUNK_OFFSETS)
+	{
+		const u64 start_chunk = chunk_idx;
+		const u64 end_chunk =
+			chunk_idx + min(NUM_CHUNK_OFFSETS - 1,
+					ctx->num_chunks - chunk_idx);
+		le32 * const offsets32 = ctx->res->temp_buffer;
+		le64 * const offsets64 = ctx->res->temp_buffer;
+		u64 first_entry_to_read;
+		size_t num_entries_to_read;
+		size_t i, j;
+		s64 res;
+
+		num_entries_to_read = end_chunk - start_chunk;
+
+		/* The first chunk has no explicit chunk table entry.  */
+		if (start_chunk == 0) {
+			num_entries_to_read--;
+			first_entry_to_read = 0;
+		} else {
+			first_entry_to_read = start_chunk - 1;
+		}
+
+		if (end_chunk != ctx->num_chunks)
+			num_entries_to_read++;
+
+		/* Read the chunk table entries into a temporary buffer.  */
+		ctx->stats.chunk_offset_reads++;
+		res = read_compressed_stream(ctx, na,
+					     first_entry_to_read << entry_shift,
+					     num_entries_to_read << entry_shift,
+					     ctx->res->temp_buffer,
+					     NTFS_DECOMPRESSION_STAGE_OFFSETS_READ);
+
+		if ((u64)res != num_entries_to_read << entry_shift) {
+			if (res >= 0)
+				errno = EINVAL;
+			ctx->base_chunk_idx = INVALID_CHUNK_INDEX;
+			return -1;
+		}
+
+		/* Prepare the cached chunk offsets.  */
 
 		i = 0;
 		if (start_chunk == 0) {
@@ -537,9 +1319,17 @@ static int get_chunk_location(struct ntfs_system_decompression_ctx *ctx,
 	return 0;
 }
 
-/* Retrieve into @buffer the uncompressed data of chunk @chunk_idx.  */
-static int read_and_decompress_chunk(struct ntfs_system_decompression_ctx *ctx,
-				     ntfs_attr *na, u64 chunk_idx, void *buffer)
+/*
+ * Read the stored data of chunk @chunk_idx.  If the chunk is stored
+ * uncompressed, then it is read directly into @buffer.  Otherwise, its
+ * compressed data is read into @compressed_buffer, which must have space for
+ * 'chunk_size' bytes.  On success, return the stored size of the chunk, which
+ * is less than its uncompressed size if and only if the chunk is stored
+ * compressed.  On failure, return 0 and set errno.
+ */
+static u32 read_stored_chunk(struct ntfs_system_decompression_ctx *ctx,
+			     ntfs_attr *na, u64 chunk_idx, void *buffer,
+			     void *compressed_buffer)
 {
 	u64 offset;
 	u32 stored_size;
@@ -549,20 +1339,14 @@ static int read_and_decompress_chunk(struct ntfs_system_decompression_ctx *ctx,
 
 	/* Get the location of the chunk data as stored in the file.  */
 	if (get_chunk_location(ctx, na, chunk_idx, &offset, &stored_size))
-		return -1;
+		return 0;
 
-	/* All chunks decompress to 'chunk_size' bytes except possibly the last,
-	 * which decompresses to whatever remains.  */
-	if (chunk_idx == ctx->num_chunks - 1)
-		uncompressed_size = ((ctx->uncompressed_size - 1) &
-				     (ctx->chunk_size - 1)) + 1;
-	else
-		uncompressed_size = ctx->chunk_size;
+	uncompressed_size = get_chunk_uncompressed_size(ctx, chunk_idx);
 
 	/* Forbid strange compressed sizes.  */
 	if (stored_size <= 0 || stored_size > uncompressed_size) {
 		errno = EINVAL;
-		return -1;
+		return 0;
 	}
 
 	/* Chunks that didn't compress to less than their original size are
@@ -572,130 +1356,1188 @@ static int read_and_decompress_chunk(struct ntfs_system_decompression_ctx *ctx,
 		read_buffer = buffer;
 	} else {
 		/* Chunk is stored compressed  */
-		read_buffer = ctx->temp_buffer;
+		read_buffer = compressed_buffer;
 	}
 
 	/* Read the stored chunk data.  */
-	res = ntfs_attr_pread(na, offset, stored_size, read_buffer);
+	res = read_compressed_stream(ctx, na, offset, stored_size, read_buffer,
+				     NTFS_DECOMPRESSION_STAGE_DATA_READ);
 	if (res != stored_size) {
 		if (res >= 0)
 			errno = EINVAL;
-		return -1;
+		return 0;
 	}
 
-	/* If the chunk was stored uncompressed, then we're done.  */
-	if (read_buffer == buffer)
-		return 0;
+	return stored_size;
+}
 
-	/* The chunk was stored compressed.  Decompress its data.  */
-	if (decompress(ctx, read_buffer, stored_size,
-		       buffer, uncompressed_size)) {
-		errno = EINVAL;
-		return -1;
+/*
+ * Read into @buffer, which has space for @buffer_size bytes, the stored data of
+ * a run of up to @max_chunks consecutive chunks beginning with chunk
+ * @chunk_idx.  The chunks are stored contiguously, so this takes only one read.
+ * The run ends early at the first chunk that doesn't fit in @buffer or whose
+ * location can't be determined; @buffer must have space for at least the first
+ * chunk.  On success, return the number of chunks read and their stored sizes
+ * in @stored_sizes.  On failure, return 0 and set errno.
+ */
+static unsigned read_stored_chunk_run(struct ntfs_system_decompression_ctx *ctx,
+				      ntfs_attr *na, u64 chunk_idx,
+				      unsigned max_chunks, void *buffer,
+				      size_t buffer_size, u32 *stored_sizes)
+{
+	u64 start_offset = 0;
+	size_t run_size = 0;
+	unsigned num_chunks = 0;
+	s64 res;
+
+	while (num_chunks < max_chunks) {
+		u64 offset;
+		u32 stored_size;
+
+		if (get_chunk_location(ctx, na, chunk_idx + num_chunks,
+				       &offset, &stored_size)) {
+			if (num_chunks)
+				break;
+			return 0;
+		}
+
+		/* Forbid strange compressed sizes.  If this isn't the first
+		 * chunk of the run, then leave the error to the next run.  */
+		if (stored_size <= 0 ||
+		    stored_size > get_chunk_uncompressed_size(ctx, chunk_idx +
+								 num_chunks)) {
+			if (num_chunks)
+				break;
+			errno = EINVAL;
+			return 0;
+		}
+
+		if (stored_size > buffer_size - run_size)
+			break;
+
+		if (num_chunks == 0)
+			start_offset = offset;
+		stored_sizes[num_chunks++] = stored_size;
+		run_size += stored_size;
 	}
 
-	return 0;
+	res = read_compressed_stream(ctx, na, start_offset, run_size, buffer,
+				     NTFS_DECOMPRESSION_STAGE_DATA_READ);
+	if (res < 0 || (size_t)res != run_size) {
+		if (res >= 0)
+			errno = EINVAL;
+		return 0;
+	}
+	return num_chunks;
 }
 
-/* Retrieve a pointer to the uncompressed data of the specified chunk.  On
- * failure, return NULL and set errno.  */
-static const void *get_chunk_data(struct ntfs_system_decompression_ctx *ctx,
-				  ntfs_attr *na, u64 chunk_idx)
+/* Return true if the @size bytes at @p are all zero.  */
+static int is_all_zero(const u8 *p, size_t size)
 {
-	if (chunk_idx != ctx->cached_chunk_idx) {
-		ctx->cached_chunk_idx = INVALID_CHUNK_INDEX;
-		if (read_and_decompress_chunk(ctx, na, chunk_idx,
-					      ctx->cached_chunk))
-			return NULL;
-		ctx->cached_chunk_idx = chunk_idx;
-	}
-	return ctx->cached_chunk;
+	return size == 0 || (p[0] == 0 && !memcmp(p, p + 1, size - 1));
 }
 
-/*
- * ntfs_read_system_compressed_data - Read data from a system-compressed file
- *
- * @ctx:	The decompression context for the file
- * @ni:		The NTFS inode for the file
- * @pos:	The byte offset into the uncompressed data to read from
- * @count:	The number of bytes of uncompressed data to read
- * @buf:	The buffer into which to read the data
- *
- * On full or partial success, return the number of bytes read (0 indicates
- * end-of-file).  On complete failure, return -1 and set errno.
- */
-ssize_t ntfs_read_system_compressed_data(struct ntfs_system_decompression_ctx *ctx,
-					 ntfs_inode *ni, s64 pos, size_t count,
-					 void *buf)
+/* Return true if a compressed chunk with @stored_size bytes of stored data at
+ * @cdata, which decompresses to @size bytes, is known to decompress to all
+ * zeroes.  */
+static int matches_zero_chunk(const struct ntfs_system_decompression_ctx *ctx,
+			      const void *cdata, u32 stored_size, u32 size)
 {
-	u64 offset;
-	ntfs_attr *na;
-	u8 *p;
-	u8 *end_p;
-	u64 chunk_idx;
-	u32 offset_in_chunk;
-	u32 chunk_size;
+	return stored_size == ctx->zero_chunk_size && size == ctx->chunk_size &&
+	       stored_size != 0 && !memcmp(cdata, ctx->zero_chunk, stored_size);
+}
 
-	if (!ctx || !ni || pos < 0) {
-		errno = EINVAL;
-		return -1;
-	}
+/* Return true if a compressed chunk with @stored_size bytes of stored data,
+ * which decompresses to @size bytes, should be checked for decompressing to all
+ * zeroes.  */
+static int is_zero_chunk_candidate(const struct ntfs_system_decompression_ctx *ctx,
+				   u32 stored_size, u32 size)
+{
+	return ctx->zero_chunk_size == 0 &&
+	       ctx->zero_chunk_misses < ZERO_CHUNK_MAX_MISSES &&
+	       size == ctx->chunk_size && stored_size < size &&
+	       stored_size <= ZERO_CHUNK_MAX_STORED_SIZE;
+}
 
-	offset = (u64)pos;
-	if (offset >= ctx->uncompressed_size)
-		return 0;
+/* Return true if a chunk with @stored_size bytes of stored data at @cdata,
+ * which decompresses to @size bytes, may decompress to all zeroes.  */
+static int may_be_zero_chunk(const struct ntfs_system_decompression_ctx *ctx,
+			     const void *cdata, u32 stored_size, u32 size)
+{
+	return matches_zero_chunk(ctx, cdata, stored_size, size) ||
+	       is_zero_chunk_candidate(ctx, stored_size, size);
+}
 
-	count = min(count, ctx->uncompressed_size - offset);
-	if (!count)
+/*
+ * Decompress the compressed chunk with @stored_size bytes of stored data at
+ * @cdata into @buffer, which has space for its @size bytes of uncompressed
+ * data, or just fill @buffer with zeroes if the chunk is known to decompress to
+ * them.  On failure, return -1.
+ */
+static int decompress_chunk(struct ntfs_system_decompression_ctx *ctx,
+			    const void *cdata, u32 stored_size,
+			    void *buffer, u32 size)
+{
+	if (matches_zero_chunk(ctx, cdata, stored_size, size)) {
+		memset(buffer, 0, size);
+		ctx->stats.zero_chunks++;
 		return 0;
+	}
 
-	na = ntfs_attr_open(ni, AT_DATA, compressed_stream_name,
-			    sizeof(compressed_stream_name) /
-				sizeof(compressed_stream_name[0]));
-	if (!na)
+	if (decompress(ctx, cdata, stored_size, buffer, size))
 		return -1;
 
-	p = buf;
-	end_p = p + count;
-	chunk_idx = offset >> ctx->chunk_order;
-	offset_in_chunk = offset & (ctx->chunk_size - 1);
-	chunk_size = ctx->chunk_size;
-	do {
-		u32 len_to_copy;
-		const u8 *chunk;
-
-		if (chunk_idx == ctx->num_chunks - 1)
-			chunk_size = ((ctx->uncompressed_size - 1) &
-				      (ctx->chunk_size - 1)) + 1;
+	if (is_zero_chunk_candidate(ctx, stored_size, size)) {
+		if (is_all_zero(buffer, size)) {
+			memcpy(ctx->zero_chunk, cdata, stored_size);
+			ctx->zero_chunk_size = stored_size;
+		} else {
+			ctx->zero_chunk_misses++;
+		}
+	}
+	return 0;
+}
 
-		len_to_copy = min((size_t)(end_p - p),
-				  chunk_size - offset_in_chunk);
+/* Return true if a chunk with @stored_size bytes of stored data, whose @size
+ * bytes of uncompressed data are at @data, should be added to the caches:
+ * chunks stored uncompressed and chunks filled with zeroes are cheaper to read
+ * again than to keep.  */
+static int chunk_data_is_worth_caching(const struct ntfs_system_decompression_ctx *ctx,
+				       u32 stored_size, u32 size,
+				       const void *data)
+{
+	return stored_size != size &&
+	       !(stored_size == ctx->zero_chunk_size &&
+		 size == ctx->chunk_size && is_all_zero(data, size));
+}
 
-		chunk = get_chunk_data(ctx, na, chunk_idx);
-		if (!chunk)
-			break;
+/*
+ * If chunk *@chunk_idx_p is stored uncompressed, then read it, and the
+ * following chunks which are stored uncompressed and entirely fit in the buffer
+ * beginning at *@p_p and ending at @end_p, straight into the buffer with one
+ * read.  Such chunks need neither decompressing nor caching, since reading them
+ * again costs no more than copying them out of a cache.  *@chunk_idx_p and
+ * *@p_p are advanced past the chunks read.  Return 0 on success, including if
+ * no chunks were read, or -1 with errno set on failure.
+ */
+static int read_uncompressed_run(struct ntfs_system_decompression_ctx *ctx,
+				 ntfs_attr *na, u64 *chunk_idx_p, u8 **p_p,
+				 u8 *end_p)
+{
+	u64 chunk_idx = *chunk_idx_p;
+	u64 start_offset = 0;
+	size_t run_size = 0;
+	s64 res;
 
-		memcpy(p, &chunk[offset_in_chunk], len_to_copy);
+	while (chunk_idx < ctx->num_chunks) {
+		const u32 size = get_chunk_uncompressed_size(ctx, chunk_idx);
+		u64 offset;
+		u32 stored_size;
 
-		p += len_to_copy;
+		if ((size_t)(end_p - *p_p) - run_size < size)
+			break;
+		if (get_chunk_location(ctx, na, chunk_idx, &offset,
+				       &stored_size)) {
+			if (run_size)
+				break;
+			return -1;
+		}
+		if (stored_size != size)
+			break;
+		if (run_size == 0)
+			start_offset = offset;
+		run_size += size;
 		chunk_idx++;
-		offset_in_chunk = 0;
-	} while (p != end_p);
+	}
 
-	ntfs_attr_close(na);
+	if (run_size == 0)
+		return 0;
 
-	return (p == buf) ? -1 : p - (u8 *)buf;
+	res = read_compressed_stream(ctx, na, start_offset, run_size, *p_p,
+				     NTFS_DECOMPRESSION_STAGE_DATA_READ);
+	if (res < 0 || (size_t)res != run_size) {
+		if (res >= 0)
+			errno = EINVAL;
+		return -1;
+	}
+	*chunk_idx_p = chunk_idx;
+	*p_p += run_size;
+	return 0;
 }
 
-/*
- * ntfs_close_system_decompression_ctx - Close a system-compressed file
- */
+/* Retrieve into @buffer the uncompressed data of chunk @chunk_idx, and return
+ * its stored size in *@stored_size_ret.  */
+static int read_and_decompress_chunk(struct ntfs_system_decompression_ctx *ctx,
+				     ntfs_attr *na, u64 chunk_idx, void *buffer,
+				     u32 *stored_size_ret)
+{
+	u32 stored_size;
+	u32 uncompressed_size;
+
+	stored_size = read_stored_chunk(ctx, na, chunk_idx, buffer,
+					ctx->res->temp_buffer);
+	if (!stored_size)
+		return -1;
+	*stored_size_ret = stored_size;
+
+	/* If the chunk was stored uncompressed, then we're done.  */
+	uncompressed_size = get_chunk_uncompressed_size(ctx, chunk_idx);
+	if (stored_size == uncompressed_size)
+		return 0;
+
+	/* The chunk was stored compressed.  Decompress its data.  */
+	if (decompress_chunk(ctx, ctx->res->temp_buffer, stored_size,
+			     buffer, uncompressed_size)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Retrieve into @buffer @size bytes of the uncompressed data of chunk
+ * @chunk_idx, starting @offset bytes into the chunk.  The chunk is decompressed
+ * into 'cached_chunk', where it may be reused by an adjacent read.  Unless it's
+ * stored uncompressed or all zeroes, it's also added to the caches.  On
+ * failure, return -1 and set errno.
+ */
+static int read_partial_chunk(struct ntfs_system_decompression_ctx *ctx,
+			      ntfs_attr *na, u64 chunk_idx, u32 offset,
+			      u32 size, void *buffer)
+{
+	u32 uncompressed_size = get_chunk_uncompressed_size(ctx, chunk_idx);
+	u32 stored_size;
+
+	if (chunk_idx == ctx->cached_chunk_idx) {
+		ctx->stats.chunk_buffer_hits++;
+		memcpy(buffer, (const u8 *)ctx->res->cached_chunk + offset,
+		       size);
+		return 0;
+	}
+	ctx->stats.chunk_buffer_misses++;
+
+	if (ctx->shared_cache &&
+	    !read_shared_cache(ctx, chunk_idx, offset, size, buffer))
+		return 0;
+
+	ctx->cached_chunk_idx = INVALID_CHUNK_INDEX;
+	if (!ctx->disk_cache ||
+	    read_disk_cache(ctx, chunk_idx, ctx->res->cached_chunk)) {
+		if (read_and_decompress_chunk(ctx, na, chunk_idx,
+					      ctx->res->cached_chunk,
+					      &stored_size))
+			return -1;
+		if (chunk_data_is_worth_caching(ctx, stored_size,
+						uncompressed_size,
+						ctx->res->cached_chunk))
+			cache_chunk(ctx, chunk_idx, ctx->res->cached_chunk);
+	}
+	ctx->cached_chunk_idx = chunk_idx;
+
+	memcpy(buffer, (const u8 *)ctx->res->cached_chunk + offset, size);
+	return 0;
+}
+
+/*
+ * Retrieve into @buffer the uncompressed data of chunk @chunk_idx.  Unlike
+ * read_partial_chunk(), this decompresses the chunk directly into @buffer
+ * rather than into 'cached_chunk' then copying it, so it should be used when
+ * the whole chunk is needed.  The chunk is still taken from, and unless it's
+ * stored uncompressed or all zeroes added to, the caches.
+ */
+static int read_whole_chunk(struct ntfs_system_decompression_ctx *ctx,
+			    ntfs_attr *na, u64 chunk_idx, void *buffer)
+{
+	u32 uncompressed_size = get_chunk_uncompressed_size(ctx, chunk_idx);
+	u32 stored_size;
+
+	if (chunk_idx == ctx->cached_chunk_idx) {
+		ctx->stats.chunk_buffer_hits++;
+		memcpy(buffer, ctx->res->cached_chunk, uncompressed_size);
+		return 0;
+	}
+	ctx->stats.chunk_buffer_misses++;
+
+	if (ctx->shared_cache &&
+	    !read_shared_cache(ctx, chunk_idx, 0, uncompressed_size, buffer))
+		return 0;
+
+	if (ctx->disk_cache && !read_disk_cache(ctx, chunk_idx, buffer))
+		return 0;
+
+	if (read_and_decompress_chunk(ctx, na, chunk_idx, buffer, &stored_size))
+		return -1;
+
+	if (chunk_data_is_worth_caching(ctx, stored_size, uncompressed_size,
+					buffer))
+		cache_chunk(ctx, chunk_idx, buffer);
+	return 0;
+}
+
+/* Return true if chunk @chunk_idx is in the shared cache or the persistent
+ * cache.  */
+static int chunk_is_cached(struct ntfs_system_decompression_ctx *ctx,
+			   u64 chunk_idx)
+{
+	return (ctx->shared_cache &&
+		chunk_cache_contains(ctx->shared_cache, ctx->data_id,
+				     chunk_idx)) ||
+	       (ctx->disk_cache &&
+		disk_cache_contains(ctx->disk_cache, chunk_idx));
+}
+
+/*
+ * Read whole chunks, starting at chunk *@chunk_idx_p, into the buffer beginning
+ * at *@p_p and ending at @end_p.  Chunks that aren't cached are read in runs of
+ * consecutive chunks, with one read per run.  If @batch is not NULL, then the
+ * chunks are decompressed in parallel using @batch, and reading stops when the
+ * batch is full; otherwise they're decompressed by this thread.  Either way,
+ * chunks are decompressed directly into the buffer, and runs of chunks stored
+ * uncompressed are read directly into it.  Stop when the next chunk doesn't
+ * entirely fit.  If @add_to_caches is set, then the chunks which were
+ * decompressed, and are worth caching, are added to the caches.  Their stored
+ * sizes are known at that point, so the chunk offset table isn't needed again.
+ * *@chunk_idx_p and *@p_p are advanced past the chunks that were successfully
+ * read.  Return 0 on success or -1 with errno set if a chunk couldn't be read.
+ */
+static int read_whole_chunks(struct ntfs_system_decompression_ctx *ctx,
+			     ntfs_attr *na, struct decompress_batch *batch,
+			     u64 *chunk_idx_p, u8 **p_p, u8 *end_p,
+			     int add_to_caches)
+{
+	u64 chunk_idx = *chunk_idx_p;
+	u8 *p = *p_p;
+	u8 *failed = NULL;
+	int ret = 0;
+
+	/* The chunks decompressed by the batch which are to be added to the
+	 * caches once the batch is finished  */
+	u8 *batch_chunks[DECOMPRESS_BATCH_MAX_JOBS];
+	unsigned num_batch_chunks = 0;
+	unsigned i;
+
+	if (!ctx->shared_cache && !ctx->disk_cache)
+		add_to_caches = 0;
+
+	/* Without a batch, read the runs into the run buffer.  */
+	if (!batch && !ctx->res->run_buffer) {
+		ctx->res->run_buffer = ntfs_malloc(RUN_BUFFER_SIZE);
+		ctx->res->run_buffer_size =
+			ctx->res->run_buffer ? RUN_BUFFER_SIZE : 0;
+	}
+
+	while (end_p - p >= get_chunk_uncompressed_size(ctx, chunk_idx)) {
+		u32 stored_sizes[MAX_RUN_CHUNKS];
+		u32 size = get_chunk_uncompressed_size(ctx, chunk_idx);
+		u8 *in;
+		u32 buffer_size;
+		unsigned max_chunks;
+		unsigned num_chunks;
+		u8 *q;
+
+		if ((ctx->shared_cache &&
+		     !read_shared_cache(ctx, chunk_idx, 0, size, p)) ||
+		    (ctx->disk_cache && !read_disk_cache(ctx, chunk_idx, p))) {
+			p += size;
+			chunk_idx++;
+			continue;
+		}
+
+		/* Read chunks stored uncompressed straight into the
+		 * buffer.  */
+		q = p;
+		if (read_uncompressed_run(ctx, na, &chunk_idx, &p, end_p)) {
+			ret = -1;
+			break;
+		}
+		if (p != q)
+			continue;
+
+		/* Find the space to read the run into.  */
+		if (batch) {
+			in = decompress_batch_get_buffer(batch, ctx->chunk_size,
+							 &buffer_size,
+							 &max_chunks);
+			if (!in)
+				break;
+			max_chunks = min(max_chunks, (unsigned)MAX_RUN_CHUNKS);
+		} else if (ctx->res->run_buffer) {
+			in = ctx->res->run_buffer;
+			buffer_size = ctx->res->run_buffer_size;
+			max_chunks = MAX_RUN_CHUNKS;
+		} else {
+			in = ctx->res->temp_buffer;
+			buffer_size = ctx->chunk_size;
+			max_chunks = 1;
+		}
+
+		/* The run consists of the following chunks which fit entirely
+		 * and aren't cached.  */
+		num_chunks = 1;
+		q = p + size;
+		while (num_chunks < max_chunks &&
+		       chunk_idx + num_chunks < ctx->num_chunks &&
+		       end_p - q >= get_chunk_uncompressed_size(ctx,
+							chunk_idx + num_chunks) &&
+		       !chunk_is_cached(ctx, chunk_idx + num_chunks)) {
+			q += get_chunk_uncompressed_size(ctx,
+							 chunk_idx + num_chunks);
+			num_chunks++;
+		}
+
+		num_chunks = read_stored_chunk_run(ctx, na, chunk_idx,
+						   num_chunks, in,
+						   buffer_size, stored_sizes);
+		if (!num_chunks) {
+			ret = -1;
+			break;
+		}
+
+		for (i = 0; i < num_chunks; i++) {
+			size = get_chunk_uncompressed_size(ctx, chunk_idx);
+
+			/* This thread handles chunks which may be all zeroes
+			 * itself, since they're usually just filled with
+			 * zeroes; its decompressor isn't used by the batch
+			 * until the batch is finished.  */
+			if (batch &&
+			    may_be_zero_chunk(ctx, in, stored_sizes[i], size)) {
+				decompress_batch_skip(batch, stored_sizes[i]);
+				if (decompress_chunk(ctx, in, stored_sizes[i],
+						     p, size)) {
+					failed = p;
+					break;
+				}
+				if (add_to_caches &&
+				    chunk_data_is_worth_caching(ctx,
+							stored_sizes[i],
+							size, p))
+					cache_chunk(ctx, chunk_idx, p);
+			} else if (batch) {
+				decompress_batch_add(batch, in,
+						     stored_sizes[i], p, size);
+				if (stored_sizes[i] != size) {
+					count_chunk_decompressed(ctx);
+					if (add_to_caches)
+						batch_chunks[num_batch_chunks++] = p;
+				}
+			} else if (stored_sizes[i] == size) {
+				memcpy(p, in, size);
+			} else {
+				if (decompress_chunk(ctx, in, stored_sizes[i],
+						     p, size)) {
+					failed = p;
+					break;
+				}
+				if (add_to_caches &&
+				    chunk_data_is_worth_caching(ctx,
+							stored_sizes[i],
+							size, p))
+					cache_chunk(ctx, chunk_idx, p);
+			}
+			in += stored_sizes[i];
+			p += size;
+			chunk_idx++;
+		}
+		if (failed)
+			break;
+	}
+
+	if (batch) {
+		const u64 start = now_ns();
+		u8 *batch_failed = decompress_batch_finish(batch);
+
+		/* The jobs in the batch precede any chunk this thread failed to
+		 * decompress.  */
+		if (batch_failed)
+			failed = batch_failed;
+		ctx->stats.decompress_ns += now_ns() - start;
+	}
+	if (failed) {
+		p = failed;
+		errno = EINVAL;
+		ret = -1;
+	}
+
+	/* Add the chunks decompressed by the batch to the caches, up to the
+	 * first one that failed.  They weren't candidates for being all
+	 * zeroes, which this thread handled itself.  */
+	for (i = 0; i < num_batch_chunks && batch_chunks[i] < p; i++) {
+		cache_chunk(ctx, *chunk_idx_p +
+			    ((batch_chunks[i] - *p_p) >> ctx->chunk_order),
+			    batch_chunks[i]);
+	}
+
+	/* Only the file's last chunk can be shorter than 'chunk_size'.  */
+	*chunk_idx_p += (p - *p_p + ctx->chunk_size - 1) >> ctx->chunk_order;
+	*p_p = p;
+	return ret;
+}
+
+/*
+ * Move the chunks decompressed by the readahead to the shared cache, except
+ * those which are all zeroes.  If the readahead is still in progress, then wait
+ * for it only if it contains chunks needed by the current read, which spans
+ * @first_chunk through @last_chunk.
+ */
+static void collect_readahead(struct ntfs_system_decompression_ctx *ctx,
+			      u64 first_chunk, u64 last_chunk)
+{
+	struct readahead *ra = ctx->readahead;
+	unsigned i;
+
+	if (!ra || !readahead_num_chunks(ra))
+		return;
+
+	if (readahead_busy(ra)) {
+		u64 start;
+
+		if (last_chunk < ctx->ra_first_chunk ||
+		    first_chunk >= ctx->ra_end_chunk)
+			return;
+		start = now_ns();
+		readahead_wait(ra);
+		ctx->stats.decompress_ns += now_ns() - start;
+	}
+
+	for (i = 0; i < readahead_num_chunks(ra); i++) {
+		const void *data;
+		u64 chunk_idx;
+		u32 stored_size;
+		u32 size;
+
+		/* Chunks that failed to decompress are left for a later read
+		 * to retry and report.  */
+		data = readahead_chunk(ra, i, &chunk_idx, &stored_size, &size);
+		if (data &&
+		    chunk_data_is_worth_caching(ctx, stored_size, size, data))
+			cache_chunk(ctx, chunk_idx, data);
+	}
+	readahead_reset(ra);
+}
+
+/*
+ * Read the stored data of the chunks following a sequential read which ended
+ * at @end_offset, and submit the compressed ones to be decompressed in the
+ * background.  Chunks stored uncompressed are left for the reader to read
+ * straight into its buffer, since caching them wouldn't save anything.  The
+ * readahead stays at most one readahead's worth of chunks ahead of the reader.
+ * Errors are ignored, since the chunks will be read again if they're needed.
+ */
+static void start_readahead(struct ntfs_system_decompression_ctx *ctx,
+			    ntfs_attr *na, u64 end_offset)
+{
+	const u64 next_chunk = end_offset >> ctx->chunk_order;
+	const int saved_errno = errno;
+	struct readahead *ra = ctx->readahead;
+	u64 chunk_idx;
+	u64 end_chunk;
+
+	if (!ra) {
+		if (ctx->readahead_unavailable)
+			return;
+		ra = readahead_alloc(ctx->format == FORMAT_LZX,
+				     ctx->chunk_size);
+		if (!ra) {
+			ctx->readahead_unavailable = 1;
+			return;
+		}
+		ctx->readahead = ra;
+	}
+
+	/* Wait until the previous readahead has been collected.  */
+	if (readahead_num_chunks(ra))
+		return;
+
+	/* Continue where the previous readahead ended, unless the reader has
+	 * left its vicinity.  */
+	chunk_idx = ctx->ra_end_chunk;
+	if (chunk_idx < next_chunk ||
+	    chunk_idx > next_chunk + readahead_max_chunks(ra))
+		chunk_idx = next_chunk;
+	else if (chunk_idx == next_chunk + readahead_max_chunks(ra))
+		return;
+
+	end_chunk = min(next_chunk + readahead_max_chunks(ra), ctx->num_chunks);
+
+	ctx->ra_first_chunk = chunk_idx;
+	while (chunk_idx < end_chunk) {
+		u32 stored_sizes[MAX_RUN_CHUNKS];
+		u8 *in;
+		size_t buffer_size;
+		unsigned num_chunks;
+		unsigned i;
+
+		if (chunk_is_cached(ctx, chunk_idx)) {
+			chunk_idx++;
+			continue;
+		}
+
+		num_chunks = 1;
+		while (num_chunks < MAX_RUN_CHUNKS &&
+		       chunk_idx + num_chunks < end_chunk &&
+		       !chunk_is_cached(ctx, chunk_idx + num_chunks))
+			num_chunks++;
+
+		in = readahead_get_buffer(ra, &buffer_size);
+		num_chunks = read_stored_chunk_run(ctx, na, chunk_idx,
+						   num_chunks, in,
+						   buffer_size, stored_sizes);
+		if (!num_chunks)
+			break;
+
+		for (i = 0; i < num_chunks; i++) {
+			const u32 size = get_chunk_uncompressed_size(ctx,
+								     chunk_idx);
+
+			if (stored_sizes[i] == size) {
+				readahead_skip(ra, size);
+			} else {
+				readahead_add(ra, chunk_idx, in,
+					      stored_sizes[i], size);
+				count_chunk_decompressed(ctx);
+			}
+			in += stored_sizes[i];
+			chunk_idx++;
+		}
+	}
+	ctx->ra_end_chunk = chunk_idx;
+
+	readahead_submit(ra);
+	errno = saved_errno;
+}
+
+/*
+ * Get the compressed stream of the file, which is open through @ni.  Reuse the
+ * stream from the previous read if it was opened through the same inode, which
+ * must therefore have been kept open by NTFS-3G.  The check of the MFT
+ * reference guards against a different file's inode having been allocated at
+ * the same address.  On failure, return NULL and set errno.
+ */
+static ntfs_attr *get_compressed_stream(struct ntfs_system_decompression_ctx *ctx,
+					ntfs_inode *ni)
+{
+	if (ctx->compressed_na && ctx->compressed_na->ni == ni &&
+	    get_mref(ni) == ctx->mref)
+		return ctx->compressed_na;
+
+	pthread_mutex_lock(&libntfs_lock);
+	ntfs_attr_close(ctx->compressed_na);
+	ctx->compressed_na = ntfs_attr_open(ni, AT_DATA, compressed_stream_name,
+					    sizeof(compressed_stream_name) /
+						sizeof(compressed_stream_name[0]));
+
+	/* The stream's location doesn't change, since the volume is read-only,
+	 * so the stream map stays valid when the stream is reopened.  */
+	if (ctx->compressed_na && ctx->want_stream_map) {
+		ctx->want_stream_map = 0;
+		ctx->stream_map = stream_map_create(ctx->vol,
+						    ctx->compressed_na);
+	}
+	pthread_mutex_unlock(&libntfs_lock);
+	return ctx->compressed_na;
+}
+
+/*
+ * Prepare to read the file through @ni using the decompression context @ctx:
+ * get the decompressor and buffers if this is the first read, and the
+ * compressed stream, which is returned in *@na_ret.  WIMBoot files have no
+ * compressed stream, so for them it's NULL.  On failure, return -1 and set
+ * errno.
+ */
+static int begin_read(struct ntfs_system_decompression_ctx *ctx,
+		      ntfs_inode *ni, ntfs_attr **na_ret)
+{
+	if (!ctx->res) {
+		ctx->res = resource_pool_get(ctx->format == FORMAT_LZX,
+					     ctx->chunk_order,
+					     max(ctx->chunk_size,
+						 NUM_CHUNK_OFFSETS *
+							sizeof(u64)));
+		if (!ctx->res)
+			return -1;
+	}
+
+	*na_ret = NULL;
+	if (!ctx->wim) {
+		*na_ret = get_compressed_stream(ctx, ni);
+		if (!*na_ret)
+			return -1;
+	}
+
+	if (ctx->want_disk_cache) {
+		ctx->want_disk_cache = 0;
+		ctx->disk_cache = disk_cache_open(ctx->vol, ctx->mref,
+						  ctx->change_time,
+						  le32_to_cpu(ctx->format),
+						  ctx->chunk_order,
+						  ctx->uncompressed_size,
+						  ctx->compressed_size);
+	}
+	return 0;
+}
+
+/* Read @count bytes, which are all within the file, at @offset into @buf using
+ * the decompression context @ctx, which no other read is using.  */
+static ssize_t read_data(struct ntfs_system_decompression_ctx *ctx,
+			 ntfs_inode *ni, u64 offset, size_t count, void *buf)
+{
+	ntfs_attr *na;
+	u8 *p;
+	u8 *end_p;
+	u64 chunk_idx;
+	u32 offset_in_chunk;
+	u32 chunk_size;
+
+	/* Detect sequential reads, and pick up any chunks that were decompressed
+	 * in the background.  */
+	if (offset == ctx->next_read_offset)
+		ctx->sequential_reads++;
+	else
+		ctx->sequential_reads = 0;
+	collect_readahead(ctx, offset >> ctx->chunk_order,
+			  (offset + count - 1) >> ctx->chunk_order);
+
+	if (begin_read(ctx, ni, &na))
+		return -1;
+
+	p = buf;
+	end_p = p + count;
+	chunk_idx = offset >> ctx->chunk_order;
+	offset_in_chunk = offset & (ctx->chunk_size - 1);
+	do {
+		u32 len_to_copy;
+		struct decompress_batch *batch;
+
+		/* If at least two whole chunks remain, then read them in runs,
+		 * and try to decompress them in parallel.  */
+		if (offset_in_chunk == 0 && end_p - p >= 2 * ctx->chunk_size) {
+			batch = decompress_pool_begin(ctx->format == FORMAT_LZX,
+						      ctx->res->decompressor);
+			if (read_whole_chunks(ctx, na, batch,
+					      &chunk_idx, &p, end_p, 1))
+				break;
+			continue;
+		}
+
+		chunk_size = get_chunk_uncompressed_size(ctx, chunk_idx);
+
+		len_to_copy = min((size_t)(end_p - p),
+				  chunk_size - offset_in_chunk);
+
+		if (len_to_copy == chunk_size) {
+			/* Whole chunk: decompress it directly into the
+			 * caller's buffer.  */
+			if (read_whole_chunk(ctx, na, chunk_idx, p))
+				break;
+		} else {
+			/* Partial chunk: decompress it into 'cached_chunk',
+			 * where it may be reused by an adjacent read.  */
+			if (read_partial_chunk(ctx, na, chunk_idx,
+					       offset_in_chunk, len_to_copy, p))
+				break;
+		}
+
+		p += len_to_copy;
+		chunk_idx++;
+		offset_in_chunk = 0;
+	} while (p != end_p);
+
+	/* If the file is being read sequentially, then start decompressing the
+	 * next chunks in the background.  */
+	ctx->stats.bytes_returned += p - (u8 *)buf;
+	if (p != buf) {
+		ctx->next_read_offset = offset + (p - (u8 *)buf);
+		if (ctx->sequential_reads >= READAHEAD_MIN_SEQUENTIAL_READS &&
+		    ctx->shared_cache &&
+		    ctx->next_read_offset < ctx->uncompressed_size)
+			start_readahead(ctx, na, ctx->next_read_offset);
+	}
+
+	return (p == buf) ? -1 : p - (u8 *)buf;
+}
+
+/*
+ * ntfs_read_system_compressed_data - Read data from a system-compressed file
+ *
+ * @ctx:	The decompression context for the file
+ * @ni:		The NTFS inode for the file
+ * @pos:	The byte offset into the uncompressed data to read from
+ * @count:	The number of bytes of uncompressed data to read
+ * @buf:	The buffer into which to read the data
+ *
+ * On full or partial success, return the number of bytes read (0 indicates
+ * end-of-file).  On complete failure, return -1 and set errno.  Several reads
+ * of the same context may be done at once.
+ */
+ssize_t ntfs_read_system_compressed_data(struct ntfs_system_decompression_ctx *ctx,
+					 ntfs_inode *ni, s64 pos, size_t count,
+					 void *buf)
+{
+	struct ntfs_system_decompression_ctx *reader;
+	u64 offset;
+	ssize_t ret;
+
+	if (!ctx || !ni || pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	offset = (u64)pos;
+	if (offset >= ctx->uncompressed_size)
+		return 0;
+
+	count = min(count, ctx->uncompressed_size - offset);
+	if (!count)
+		return 0;
+
+	reader = get_reader(ctx);
+	if (!reader)
+		return -1;
+	ret = read_data(reader, ni, offset, count, buf);
+	put_reader(ctx, reader);
+	return ret;
+}
+
+/*
+ * Return 1 if chunk @chunk_idx is known to decompress to all zeroes, 0 if it
+ * isn't, or -1 with errno set on failure.  If no such chunk has been found yet,
+ * then a candidate is decompressed into 'cached_chunk' to check it.  Chunks
+ * which can't be decompressed count as data, so that reading them reports the
+ * error.
+ */
+static int chunk_is_zero(struct ntfs_system_decompression_ctx *ctx,
+			 ntfs_attr *na, u64 chunk_idx)
+{
+	const u32 size = get_chunk_uncompressed_size(ctx, chunk_idx);
+	u8 *cdata = ctx->res->temp_buffer;
+	u64 offset;
+	u32 stored_size;
+	s64 res;
+
+	if (get_chunk_location(ctx, na, chunk_idx, &offset, &stored_size))
+		return -1;
+
+	/* Only read chunks whose stored size allows them to be zero chunks.  */
+	if (stored_size == 0 ||
+	    (ctx->zero_chunk_size ?
+	     stored_size != ctx->zero_chunk_size || size != ctx->chunk_size :
+	     !is_zero_chunk_candidate(ctx, stored_size, size)))
+		return 0;
+
+	res = read_compressed_stream(ctx, na, offset, stored_size, cdata,
+				     NTFS_DECOMPRESSION_STAGE_DATA_READ);
+	if (res != stored_size) {
+		if (res >= 0)
+			errno = EINVAL;
+		return -1;
+	}
+	if (ctx->zero_chunk_size)
+		return matches_zero_chunk(ctx, cdata, stored_size, size);
+
+	ctx->cached_chunk_idx = INVALID_CHUNK_INDEX;
+	if (decompress_chunk(ctx, cdata, stored_size, ctx->res->cached_chunk,
+			     size))
+		return 0;
+	ctx->cached_chunk_idx = chunk_idx;
+	return ctx->zero_chunk_size != 0;
+}
+
+/* Find the next data, or if @hole is set the next hole, at or after @offset,
+ * which is within the file, using the decompression context @ctx, which no
+ * other read is using.  */
+static s64 seek_data(struct ntfs_system_decompression_ctx *ctx,
+		     ntfs_inode *ni, u64 offset, int hole)
+{
+	ntfs_attr *na;
+	u64 chunk_idx;
+
+	if (begin_read(ctx, ni, &na))
+		return -1;
+
+	for (chunk_idx = offset >> ctx->chunk_order;
+	     chunk_idx < ctx->num_chunks; chunk_idx++)
+	{
+		int res = chunk_is_zero(ctx, na, chunk_idx);
+
+		if (res < 0)
+			return -1;
+		if (res == hole)
+			return max(offset, chunk_idx << ctx->chunk_order);
+	}
+
+	/* The end of the file is a hole.  */
+	if (hole)
+		return ctx->uncompressed_size;
+	errno = ENXIO;
+	return -1;
+}
+
+/*
+ * ntfs_seek_system_compressed_data - Find data or a hole in a system-compressed
+ * file
+ *
+ * @ctx:	The decompression context for the file
+ * @ni:		The NTFS inode for the file
+ * @pos:	The byte offset into the uncompressed data to search from
+ * @whence:	SEEK_DATA to find the next data, or SEEK_HOLE to find the next
+ *		hole
+ *
+ * This is lseek() with SEEK_DATA or SEEK_HOLE, for tools which copy files
+ * sparsely.  The holes are the chunks which decompress to all zeroes, once the
+ * first of them has been found by decompressing it; the stored data of the
+ * others is then recognized without decompressing them.  Like NTFS-3G's own
+ * sparse files, a run of zeroes within a chunk doesn't count as a hole, and
+ * the end of the file is one.
+ *
+ * On success, return the offset found.  On failure, return -1 and set errno:
+ * to ENXIO if @pos is at or past the end of the file, or with SEEK_DATA if
+ * there's no data after @pos.
+ */
+s64 ntfs_seek_system_compressed_data(struct ntfs_system_decompression_ctx *ctx,
+				     ntfs_inode *ni, s64 pos, int whence)
+{
+	struct ntfs_system_decompression_ctx *reader;
+	s64 ret;
+
+	if (!ctx || !ni || pos < 0 ||
+	    (whence != SEEK_DATA && whence != SEEK_HOLE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((u64)pos >= ctx->uncompressed_size) {
+		errno = ENXIO;
+		return -1;
+	}
+
+	reader = get_reader(ctx);
+	if (!reader)
+		return -1;
+	ret = seek_data(reader, ni, pos, whence == SEEK_HOLE);
+	put_reader(ctx, reader);
+	return ret;
+}
+
+/*
+ * ntfs_extract_system_compressed_data - Decompress a whole system-compressed
+ * file
+ *
+ * @ctx:	The decompression context for the file
+ * @ni:		The NTFS inode for the file
+ * @write_fn:	The function to which to pass the uncompressed data
+ * @arg:	An argument to pass to @write_fn
+ *
+ * This is faster than reading the file with ntfs_read_system_compressed_data():
+ * the chunks are read in runs, decompressed in parallel if enabled, straight
+ * into a large buffer, which is then passed to @write_fn.  The chunks aren't
+ * added to the caches, since they're unlikely to be needed again.  @write_fn is
+ * called with consecutive pieces of the file, in order, and must return 0 on
+ * success or -1 with errno set on failure.
+ *
+ * On success, return 0.  On failure, return -1 and set errno; some of the data
+ * may have been passed to @write_fn.
+ */
+int ntfs_extract_system_compressed_data(struct ntfs_system_decompression_ctx *ctx,
+					ntfs_inode *ni,
+					int (*write_fn)(const void *data,
+							size_t size,
+							void *arg),
+					void *arg)
+{
+	struct ntfs_system_decompression_ctx *reader;
+	u64 chunk_idx = 0;
+	ntfs_attr *na;
+	u8 *buf = NULL;
+	u32 buf_size;
+	int ret = -1;
+
+	if (!ctx || !ni || !write_fn) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	reader = get_reader(ctx);
+	if (!reader)
+		return -1;
+
+	if (begin_read(reader, ni, &na))
+		goto out;
+
+	buf_size = max((u32)EXTRACT_BUFFER_SIZE, reader->chunk_size);
+	buf = ntfs_malloc(buf_size);
+	if (!buf)
+		goto out;
+
+	while (chunk_idx < reader->num_chunks) {
+		const u64 remaining = reader->uncompressed_size -
+				      (chunk_idx << reader->chunk_order);
+		u8 *p = buf;
+		struct decompress_batch *batch;
+
+		batch = decompress_pool_begin(reader->format == FORMAT_LZX,
+					      reader->res->decompressor);
+		if (read_whole_chunks(reader, na, batch, &chunk_idx, &p,
+				      buf + min((u64)buf_size, remaining), 0))
+			goto out;
+		if (p == buf) {
+			errno = EIO;
+			goto out;
+		}
+		if (write_fn(buf, p - buf, arg))
+			goto out;
+		reader->stats.bytes_returned += p - buf;
+	}
+	ret = 0;
+out:
+	free(buf);
+	put_reader(ctx, reader);
+	return ret;
+}
+
+/* Write all of @size bytes of @data to the file descriptor pointed to by
+ * @arg.  */
+static int write_to_fd(const void *data, size_t size, void *arg)
+{
+	const int fd = *(const int *)arg;
+	const u8 *p = data;
+
+	while (size) {
+		ssize_t res = write(fd, p, size);
+
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += res;
+		size -= res;
+	}
+	return 0;
+}
+
+/*
+ * ntfs_extract_system_compressed_data_to_fd - Decompress a whole
+ * system-compressed file to a file descriptor
+ *
+ * @ctx:	The decompression context for the file
+ * @ni:		The NTFS inode for the file
+ * @fd:		The file descriptor to which to write the uncompressed data
+ *
+ * This is ntfs_extract_system_compressed_data() with the data written to @fd.
+ * On success, return 0.  On failure, return -1 and set errno.
+ */
+int ntfs_extract_system_compressed_data_to_fd(struct ntfs_system_decompression_ctx *ctx,
+					      ntfs_inode *ni, int fd)
+{
+	return ntfs_extract_system_compressed_data(ctx, ni, write_to_fd, &fd);
+}
+
+/*
+ * ntfs_close_system_decompression_ctx - Close a system-compressed file
+ */
 void ntfs_close_system_decompression_ctx(struct ntfs_system_decompression_ctx *ctx)
 {
 	if (ctx) {
-		free(ctx->cached_chunk);
-		free(ctx->temp_buffer);
-		free_decompressor(ctx);
-		free(ctx);
+		while (ctx->spares) {
+			struct ntfs_system_decompression_ctx *spare =
+				ctx->spares;
+
+			ctx->spares = spare->next_spare;
+			add_stats(&ctx->stats, &spare->stats);
+			destroy_ctx(spare);
+		}
+
+		pthread_mutex_lock(&total_stats_lock);
+		add_stats(&total_stats, &ctx->stats);
+		pthread_mutex_unlock(&total_stats_lock);
+
+		destroy_ctx(ctx);
 	}
 }
+
+/*
+ * ntfs_system_decompression_volume_closed - Forget a volume that is being
+ * unmounted
+ *
+ * @vol:	The volume
+ *
+ * Free the data cached for the files of @vol.  A program which unmounts a
+ * volume and keeps using this library must call this after closing all of the
+ * volume's decompression contexts, and before ntfs_umount().  Otherwise, a
+ * volume mounted later may be allocated at the same address and would then get
+ * the cached data of the old volume's files.
+ */
+void ntfs_system_decompression_volume_closed(ntfs_volume *vol)
+{
+	chunk_cache_free(vol);
+	metadata_cache_free(vol);
+	disk_cache_forget_volume(vol);
+}
+
+/*
+ * ntfs_get_system_decompression_stats - Get the counters of the work done to
+ * read system-compressed files
+ *
+ * @ctx:	The decompression context of an open file, or NULL
+ * @stats:	The structure into which to copy the counters
+ *
+ * If @ctx is not NULL, then this gets the counters for the reads of the file
+ * since it was opened, which must not be in progress.  Otherwise it gets the
+ * totals for all files which have been closed.
+ */
+void ntfs_get_system_decompression_stats(struct ntfs_system_decompression_ctx *ctx,
+					 struct ntfs_system_decompression_stats *stats)
+{
+	if (ctx) {
+		const struct ntfs_system_decompression_ctx *spare;
+
+		pthread_mutex_lock(&ctx->lock);
+		*stats = ctx->stats;
+		for (spare = ctx->spares; spare; spare = spare->next_spare)
+			add_stats(stats, &spare->stats);
+		pthread_mutex_unlock(&ctx->lock);
+	} else {
+		pthread_mutex_lock(&total_stats_lock);
+		*stats = total_stats;
+		pthread_mutex_unlock(&total_stats_lock);
+	}
+}
+
+/*
+ * ntfs_get_system_decompression_latency - Get the latency histogram of a stage
+ * of reading chunks
+ *
+ * @stage:	The stage, from enum ntfs_system_decompression_stage
+ * @hist:	The histogram to fill in
+ *
+ * The latencies of each stage are recorded for all files since the plugin was
+ * loaded.  Decompression is only timed in the threads handling reads, not in
+ * the parallel decompression and readahead threads, whose time the read spends
+ * waiting is counted in 'decompress_ns' instead.  On success, return 0.  On
+ * failure, return -1 and set errno: to ENOSYS if the plugin was built without
+ * --enable-tracing, in which case latencies aren't recorded.
+ */
+int ntfs_get_system_decompression_latency(unsigned stage,
+					  struct ntfs_system_decompression_histogram *hist)
+{
+	return latency_get(stage, hist);
+}
+
+/*
+ * ntfs_system_decompression_latency_percentile - Get a percentile of a latency
+ * histogram
+ *
+ * @hist:	The histogram
+ * @percentile:	The percentile, from 0 to 100
+ *
+ * Return the latency in nanoseconds below which @percentile percent of the
+ * latencies in @hist fall, rounded up to the end of its bucket, or 0 if @hist
+ * is empty.
+ */
+u64 ntfs_system_decompression_latency_percentile(const struct ntfs_system_decompression_histogram *hist,
+						 double percentile)
+{
+	return latency_percentile(hist, percentile);
+}
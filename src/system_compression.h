@@ -22,17 +22,112 @@
 
 #include <stddef.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <ntfs-3g/inode.h>
 #include <ntfs-3g/types.h>
 
 /* System compressed file access  */
 
+/* The values of 'whence' for ntfs_seek_system_compressed_data(), for C
+ * libraries which don't define them  */
+#ifndef SEEK_DATA
+#  define SEEK_DATA	3
+#endif
+#ifndef SEEK_HOLE
+#  define SEEK_HOLE	4
+#endif
+
 struct ntfs_system_decompression_ctx;
 
+/* Counters of the work done to read system-compressed files  */
+struct ntfs_system_decompression_stats {
+	/* The number of chunks decompressed, including in the background,
+	 * indexed by compression format: XPRESS4K, LZX, XPRESS8K, XPRESS16K  */
+	u64 chunks_decompressed[4];
+
+	/* The number of chunks which were filled with zeroes rather than
+	 * decompressed, since they were known to decompress to all zeroes  */
+	u64 zero_chunks;
+
+	/* Lookups of chunks in the file's most recently decompressed chunk
+	 * which found the chunk, and which didn't  */
+	u64 chunk_buffer_hits;
+	u64 chunk_buffer_misses;
+
+	/* Lookups of chunks in the shared cache which found the chunk, and
+	 * which didn't  */
+	u64 cache_hits;
+	u64 cache_misses;
+
+	/* Lookups of chunks in the persistent cache which found the chunk, and
+	 * which didn't  */
+	u64 disk_cache_hits;
+	u64 disk_cache_misses;
+
+	/* The number of times part of the chunk offset table was read  */
+	u64 chunk_offset_reads;
+
+	/* The number of bytes read from compressed streams, and the number of
+	 * bytes of uncompressed data returned  */
+	u64 compressed_bytes_read;
+	u64 bytes_returned;
+
+	/* The time, in nanoseconds, that reads spent decompressing chunks or
+	 * waiting for them to be decompressed by other threads  */
+	u64 decompress_ns;
+};
+
+/* The stages of reading chunks whose latencies are recorded, if the plugin was
+ * built with --enable-tracing  */
+enum ntfs_system_decompression_stage {
+	/* Reads of entries of the chunk offset table  */
+	NTFS_DECOMPRESSION_STAGE_OFFSETS_READ,
+
+	/* Reads of the stored data of chunks  */
+	NTFS_DECOMPRESSION_STAGE_DATA_READ,
+
+	/* Decompression of chunks by the threads handling reads, one stage for
+	 * each compression format: XPRESS4K, LZX, XPRESS8K, XPRESS16K  */
+	NTFS_DECOMPRESSION_STAGE_DECOMPRESS,
+
+	NTFS_DECOMPRESSION_NUM_STAGES = NTFS_DECOMPRESSION_STAGE_DECOMPRESS + 4,
+};
+
+#define NTFS_DECOMPRESSION_HISTOGRAM_BUCKETS	256
+
+/* A histogram of the latencies of one stage, in nanoseconds.  The buckets are
+ * logarithmic, with four per power of two.  */
+struct ntfs_system_decompression_histogram {
+	u64 count;
+	u64 total_ns;
+	u64 max_ns;
+	u64 buckets[NTFS_DECOMPRESSION_HISTOGRAM_BUCKETS];
+};
+
 extern s64 ntfs_get_system_compressed_file_size(ntfs_inode *ni,
 						const REPARSE_POINT *reparse);
 
+extern void ntfs_set_system_decompression_cache_size(size_t max_size);
+
+extern void ntfs_set_system_decompression_threads(unsigned num_threads);
+
+extern void ntfs_set_system_decompression_readahead(size_t size);
+
+extern void ntfs_set_system_decompression_metadata_cache(unsigned num_entries);
+
+extern void ntfs_set_system_decompression_chunk_table_max(size_t max_size);
+
+extern void ntfs_set_system_decompression_direct_read(int enabled);
+
+extern int ntfs_set_system_decompression_disk_cache(const char *dir);
+
+extern void ntfs_set_system_decompression_disk_cache_size(u64 max_size);
+
+extern void ntfs_set_system_decompression_huge_pages(int enabled);
+
+extern int ntfs_add_system_decompression_wim(const char *path);
+
 extern struct ntfs_system_decompression_ctx *
 ntfs_open_system_decompression_ctx(ntfs_inode *ni,
 				   const REPARSE_POINT *reparse);
@@ -42,9 +137,39 @@ ntfs_read_system_compressed_data(struct ntfs_system_decompression_ctx *ctx,
 				 ntfs_inode *ni, s64 pos, size_t count,
 				 void *buf);
 
+extern s64
+ntfs_seek_system_compressed_data(struct ntfs_system_decompression_ctx *ctx,
+				 ntfs_inode *ni, s64 pos, int whence);
+
+extern int
+ntfs_extract_system_compressed_data(struct ntfs_system_decompression_ctx *ctx,
+				    ntfs_inode *ni,
+				    int (*write_fn)(const void *data,
+						    size_t size, void *arg),
+				    void *arg);
+
+extern int
+ntfs_extract_system_compressed_data_to_fd(struct ntfs_system_decompression_ctx *ctx,
+					  ntfs_inode *ni, int fd);
+
 extern void
 ntfs_close_system_decompression_ctx(struct ntfs_system_decompression_ctx *ctx);
 
+extern void
+ntfs_system_decompression_volume_closed(ntfs_volume *vol);
+
+extern void
+ntfs_get_system_decompression_stats(struct ntfs_system_decompression_ctx *ctx,
+				    struct ntfs_system_decompression_stats *stats);
+
+extern int
+ntfs_get_system_decompression_latency(unsigned stage,
+				      struct ntfs_system_decompression_histogram *hist);
+
+extern u64
+ntfs_system_decompression_latency_percentile(const struct ntfs_system_decompression_histogram *hist,
+					     double percentile);
+
 /* XPRESS decompression  */
 
 struct xpress_decompressor;
@@ -0,0 +1,283 @@
+/*
+ * wimboot.c - WIM files which back WIMBoot files
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * On a WIMBoot system, most files are reparse points for the WIM provider of
+ * WOF: their data isn't on the volume at all, but is a resource in a WIM file,
+ * usually on another partition.  The reparse point gives the location and sizes
+ * of the resource in the WIM, and identifies the WIM by the SHA-1 message
+ * digest of its blob table.  (It also gives a "data source ID", but that can
+ * only be resolved through the WimOverlay.dat file, whose paths refer to
+ * Windows devices.)
+ *
+ * So the WIMs must be given to the plugin.  Each WIM is opened when it's given,
+ * its header is checked, and its blob table is hashed.  A WIMBoot file is then
+ * read from the WIM whose blob table digest matches its reparse point.
+ *
+ * A compressed resource in a (non-solid) WIM has the same layout as the
+ * compressed stream of a system-compressed file: a table of chunk offsets,
+ * followed by the chunks, each compressed or, if that didn't make it smaller,
+ * stored uncompressed.  So it's read the same way.  The compression format and
+ * chunk size are given by the WIM's header.  Resources that are stored
+ * uncompressed are just the file's data.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ntfs-3g/misc.h>
+
+#include "wimboot.h"
+
+#ifndef O_CLOEXEC
+#  define O_CLOEXEC	0
+#endif
+
+/* The on-disk location of a resource in a WIM  */
+struct wim_reshdr_disk {
+	u8 size_in_wim[7];
+	u8 flags;
+	le64 offset_in_wim;
+	le64 uncompressed_size;
+} __attribute__((packed));
+
+/* The header at the beginning of a WIM  */
+struct wim_header_disk {
+	u8 magic[8];
+	le32 hdr_size;
+	le32 wim_version;
+	le32 wim_flags;
+	le32 chunk_size;
+	u8 guid[16];
+	le16 part_number;
+	le16 total_parts;
+	le32 image_count;
+	struct wim_reshdr_disk blob_table_reshdr;
+	struct wim_reshdr_disk xml_data_reshdr;
+	struct wim_reshdr_disk boot_metadata_reshdr;
+	le32 boot_idx;
+	struct wim_reshdr_disk integrity_table_reshdr;
+	u8 unused[60];
+} __attribute__((packed));
+
+#define WIM_MAGIC			"MSWIM\0\0\0"
+
+#define WIM_HDR_FLAG_COMPRESSION	0x00000002
+#define WIM_HDR_FLAG_COMPRESS_XPRESS	0x00020000
+#define WIM_HDR_FLAG_COMPRESS_LZX	0x00040000
+
+/* The chunk size of WIMs whose header doesn't give one  */
+#define DEFAULT_CHUNK_ORDER		15
+
+/* The size of the buffer used to hash the blob table  */
+#define HASH_BUFFER_SIZE		65536
+
+/* The WIMs that have been given, protected by 'wims_lock'  */
+static struct wim_file *wims;
+static pthread_mutex_t wims_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Read @count bytes at offset @pos in @wim into @buf.  Return the number of
+ * bytes read, which is less than @count only if the end of the WIM was reached,
+ * or -1 with errno set on failure.
+ */
+s64
+wim_pread(const struct wim_file *wim, u64 pos, size_t count, void *buf)
+{
+	u8 *p = buf;
+
+	while (count) {
+		ssize_t res = pread(wim->fd, p, count, pos);
+
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (res == 0)
+			break;
+		p += res;
+		pos += res;
+		count -= res;
+	}
+	return p - (u8 *)buf;
+}
+
+static u64
+get_le56(const u8 *p)
+{
+	u64 v = 0;
+	int i;
+
+	for (i = 6; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/* Compute the SHA-1 message digest of the blob table of @wim, as stored in the
+ * WIM.  */
+static int
+hash_blob_table(struct wim_file *wim, const struct wim_reshdr_disk *reshdr)
+{
+	u64 pos = le64_to_cpu(reshdr->offset_in_wim);
+	u64 remaining = get_le56(reshdr->size_in_wim);
+	struct sha1_ctx sha;
+	u8 *buf;
+	int ret = -1;
+
+	buf = ntfs_malloc(HASH_BUFFER_SIZE);
+	if (!buf)
+		return -1;
+
+	sha1_init(&sha);
+	while (remaining) {
+		const size_t count = min(remaining, (u64)HASH_BUFFER_SIZE);
+		s64 res = wim_pread(wim, pos, count, buf);
+
+		if (res < 0 || (size_t)res != count) {
+			if (res >= 0)
+				errno = EINVAL;
+			goto out;
+		}
+		sha1_update(&sha, buf, count);
+		pos += count;
+		remaining -= count;
+	}
+	sha1_final(&sha, wim->blob_table_hash);
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/* Read and check the header of @wim into @hdr, and set the WIM's compression
+ * type and chunk size.  */
+static int
+read_header(struct wim_file *wim, struct wim_header_disk *hdr)
+{
+	u32 flags;
+	u32 chunk_size;
+	s64 res;
+
+	res = wim_pread(wim, 0, sizeof(*hdr), hdr);
+	if (res < 0)
+		return -1;
+	if ((size_t)res != sizeof(*hdr) ||
+	    memcmp(hdr->magic, WIM_MAGIC, sizeof(hdr->magic)) ||
+	    le32_to_cpu(hdr->hdr_size) != sizeof(*hdr)) {
+		errno = EINVAL;
+		return -1;
+	}
+	flags = le32_to_cpu(hdr->wim_flags);
+	chunk_size = le32_to_cpu(hdr->chunk_size);
+
+	/* Split WIMs, and WIMs compressed with a format the decompressors
+	 * don't support (LZMS), can't be used.  */
+	if (le16_to_cpu(hdr->total_parts) != 1) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (!(flags & WIM_HDR_FLAG_COMPRESSION))
+		wim->compression = WIM_COMPRESSION_NONE;
+	else if (flags & WIM_HDR_FLAG_COMPRESS_XPRESS)
+		wim->compression = WIM_COMPRESSION_XPRESS;
+	else if (flags & WIM_HDR_FLAG_COMPRESS_LZX)
+		wim->compression = WIM_COMPRESSION_LZX;
+	else {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	/* The chunk size must be one that the system compression formats use
+	 * with the same compression format.  */
+	if (chunk_size == 0)
+		wim->chunk_order = DEFAULT_CHUNK_ORDER;
+	else if (chunk_size & (chunk_size - 1))
+		wim->chunk_order = 0;
+	else
+		wim->chunk_order = ilog2_ceil(chunk_size);
+	if (wim->compression == WIM_COMPRESSION_NONE)
+		wim->chunk_order = DEFAULT_CHUNK_ORDER;
+	if ((wim->compression == WIM_COMPRESSION_XPRESS &&
+	     (wim->chunk_order < 12 || wim->chunk_order > 14)) ||
+	    (wim->compression == WIM_COMPRESSION_LZX &&
+	     wim->chunk_order != 15)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Open the WIM file at @path for reading the WIMBoot files it backs.  On
+ * failure, return -1 and set errno.
+ */
+int
+wimboot_add_wim(const char *path)
+{
+	struct wim_header_disk hdr;
+	struct wim_file *wim;
+	int saved_errno;
+
+	wim = ntfs_calloc(sizeof(*wim));
+	if (!wim)
+		return -1;
+	wim->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (wim->fd < 0)
+		goto err;
+	if (read_header(wim, &hdr) ||
+	    hash_blob_table(wim, &hdr.blob_table_reshdr))
+		goto err;
+
+	pthread_mutex_lock(&wims_lock);
+	wim->next = wims;
+	wims = wim;
+	pthread_mutex_unlock(&wims_lock);
+	return 0;
+
+err:
+	saved_errno = errno;
+	if (wim->fd >= 0)
+		close(wim->fd);
+	free(wim);
+	errno = saved_errno;
+	return -1;
+}
+
+/* Return the WIM whose blob table has the SHA-1 message digest
+ * @blob_table_hash, or NULL if no such WIM has been given.  */
+const struct wim_file *
+wimboot_find_wim(const u8 blob_table_hash[SHA1_HASH_SIZE])
+{
+	struct wim_file *wim;
+
+	pthread_mutex_lock(&wims_lock);
+	for (wim = wims; wim; wim = wim->next)
+		if (!memcmp(wim->blob_table_hash, blob_table_hash,
+			    SHA1_HASH_SIZE))
+			break;
+	pthread_mutex_unlock(&wims_lock);
+	return wim;
+}
@@ -0,0 +1,44 @@
+/*
+ * wimboot.h
+ *
+ * Declarations for the WIM files which back WIMBoot files.
+ */
+
+#ifndef _WIMBOOT_H
+#define _WIMBOOT_H
+
+#include "common_defs.h"
+#include "sha1.h"
+
+/* How the resources in a WIM may be compressed  */
+#define WIM_COMPRESSION_NONE	0
+#define WIM_COMPRESSION_XPRESS	1
+#define WIM_COMPRESSION_LZX	2
+
+struct wim_file {
+	/* The file descriptor the WIM is open on, for reading  */
+	int fd;
+
+	/* The WIM_COMPRESSION_* type of the WIM's compressed resources, and
+	 * the base 2 logarithm of their chunk size  */
+	int compression;
+	u32 chunk_order;
+
+	/* The SHA-1 message digest of the WIM's blob table as stored in the
+	 * WIM, which identifies the WIM in the reparse points of the files it
+	 * backs  */
+	u8 blob_table_hash[SHA1_HASH_SIZE];
+
+	struct wim_file *next;
+};
+
+extern int
+wimboot_add_wim(const char *path);
+
+extern const struct wim_file *
+wimboot_find_wim(const u8 blob_table_hash[SHA1_HASH_SIZE]);
+
+extern s64
+wim_pread(const struct wim_file *wim, u64 pos, size_t count, void *buf);
+
+#endif /* _WIMBOOT_H */
@@ -67,6 +67,9 @@
 #  include "config.h"
 #endif
 
+#include <string.h>
+
+#include "buffer_arena.h"
 #include "decompress_common.h"
 #include "system_compression.h"
 #include "xpress_constants.h"
@@ -74,6 +77,13 @@
 /* This value is chosen for fast decompression.  */
 #define XPRESS_TABLEBITS 11
 
+/*
+ * A pair table, which decodes two literals per lookup, is built for a chunk
+ * only if it's expected to save at least as many lookups as it has entries,
+ * times this factor.  See pair_table_profitable().
+ */
+#define XPRESS_PAIR_TABLE_THRESHOLD	1
+
 struct xpress_decompressor {
 	union {
 		DECODE_TABLE(decode_table, XPRESS_NUM_SYMBOLS,
@@ -82,33 +92,133 @@ struct xpress_decompressor {
 	};
 	DECODE_TABLE_WORKING_SPACE(working_space, XPRESS_NUM_SYMBOLS,
 				   XPRESS_MAX_CODEWORD_LEN);
+
+	/* Decode table for pairs of literals; see make_huffman_pair_table() */
+	u32 pair_table[1 << XPRESS_TABLEBITS];
+
+	/* The Huffman code, as stored at the start of each chunk, from which the
+	 * decode tables were last built, and whether they're still valid.
+	 * Consecutive chunks often use the same code, and then the tables
+	 * needn't be built again.  */
+	u8 table_code[XPRESS_NUM_SYMBOLS / 2];
+	int tables_valid;
+	int use_pair_table;
+
+	/* The implementation of xpress_decompress() chosen for the CPU when
+	 * the decompressor was allocated */
+	int (*decompress)(struct xpress_decompressor *restrict d,
+			  const void *restrict compressed_data,
+			  size_t compressed_size,
+			  void *restrict uncompressed_data,
+			  size_t uncompressed_size);
 } _aligned_attribute(DECODE_TABLE_ALIGNMENT);
 
-int
-xpress_decompress(struct xpress_decompressor *restrict d,
-		  const void *restrict compressed_data, size_t compressed_size,
-		  void *restrict uncompressed_data, size_t uncompressed_size)
+/*
+ * Decide whether to decode @size bytes using a pair table.
+ *
+ * The codeword lengths tell us roughly how often each symbol occurs: a symbol
+ * with a codeword of length n has probability about 2^-n.  From that, estimate
+ * the proportion of lookups which would decode a pair of literals, and the
+ * number of symbols in the data (from the average number of bytes each symbol
+ * produces; match lengths are approximated by their length headers).  Their
+ * product is the number of lookups saved.
+ */
+static forceinline int
+pair_table_profitable(const u8 lens[], size_t size)
+{
+	/* Probabilities are scaled by 2^XPRESS_MAX_CODEWORD_LEN.  */
+	u32 literal_prob[XPRESS_TABLEBITS] = { 0 };
+	u64 bytes_per_sym = 0;
+	u64 pair_prob = 0;
+	u64 cum_prob = 0;
+
+	for (int sym = 0; sym < XPRESS_NUM_SYMBOLS; sym++) {
+		const unsigned len = lens[sym];
+		u32 prob;
+
+		if (len == 0)
+			continue;
+		prob = (u32)1 << (XPRESS_MAX_CODEWORD_LEN - len);
+		if (sym < XPRESS_NUM_CHARS) {
+			bytes_per_sym += prob;
+			if (len < XPRESS_TABLEBITS)
+				literal_prob[len] += prob;
+		} else {
+			bytes_per_sym += (u64)prob *
+				((sym & 0xf) + XPRESS_MIN_MATCH_LEN);
+		}
+	}
+
+	/* A pair is decoded if the codewords of the two literals have a total
+	 * length of at most XPRESS_TABLEBITS.  */
+	for (int len1 = XPRESS_TABLEBITS - 1, len2 = 1; len1 >= 1;
+	     len1--, len2++) {
+		cum_prob += literal_prob[len2];
+		pair_prob += literal_prob[len1] * cum_prob;
+	}
+
+	/* Lookups saved: size / (bytes_per_sym / 2^15) * (pair_prob / 2^30) */
+	return (u64)size * pair_prob >=
+		((u64)XPRESS_PAIR_TABLE_THRESHOLD << XPRESS_TABLEBITS) *
+		(bytes_per_sym << XPRESS_MAX_CODEWORD_LEN);
+}
+
+/*
+ * Unlike LZX, XPRESS can't use the wide bitstream, since the bytes which extend
+ * match lengths are interleaved with the coding units.  But on x86 it still
+ * benefits from being compiled with BMI2, whose shift instructions take the
+ * count in any register and don't modify the flags.
+ */
+static forceinline int
+xpress_decompress_template(struct xpress_decompressor *restrict d,
+			   const void *restrict compressed_data,
+			   size_t compressed_size,
+			   void *restrict uncompressed_data,
+			   size_t uncompressed_size)
 {
 	const u8 * const in_begin = compressed_data;
 	u8 * const out_begin = uncompressed_data;
 	u8 *out_next = out_begin;
 	u8 * const out_end = out_begin + uncompressed_size;
 	struct input_bitstream is;
+	int use_pair_table;
 
-	/* Read the Huffman codeword lengths.  */
 	if (compressed_size < XPRESS_NUM_SYMBOLS / 2)
 		return -1;
-	for (int i = 0; i < XPRESS_NUM_SYMBOLS / 2; i++) {
-		d->lens[2 * i + 0] = in_begin[i] & 0xf;
-		d->lens[2 * i + 1] = in_begin[i] >> 4;
-	}
 
-	/* Build a decoding table for the Huffman code.  */
-	if (make_huffman_decode_table(d->decode_table, XPRESS_NUM_SYMBOLS,
-				      XPRESS_TABLEBITS, d->lens,
-				      XPRESS_MAX_CODEWORD_LEN,
-				      d->working_space))
-		return -1;
+	/* Build the decode tables, unless they are already built for this
+	 * Huffman code.  */
+	if (!d->tables_valid ||
+	    memcmp(d->table_code, in_begin, XPRESS_NUM_SYMBOLS / 2) != 0) {
+
+		d->tables_valid = 0;
+
+		/* Read the Huffman codeword lengths.  */
+		for (int i = 0; i < XPRESS_NUM_SYMBOLS / 2; i++) {
+			d->lens[2 * i + 0] = in_begin[i] & 0xf;
+			d->lens[2 * i + 1] = in_begin[i] >> 4;
+		}
+
+		d->use_pair_table = pair_table_profitable(d->lens,
+							  uncompressed_size);
+
+		/* Build a decoding table for the Huffman code.  */
+		if (make_huffman_decode_table(d->decode_table,
+					      XPRESS_NUM_SYMBOLS,
+					      XPRESS_TABLEBITS, d->lens,
+					      XPRESS_MAX_CODEWORD_LEN,
+					      d->working_space))
+			return -1;
+
+		if (d->use_pair_table)
+			make_huffman_pair_table(d->pair_table, d->decode_table,
+						XPRESS_TABLEBITS,
+						XPRESS_NUM_CHARS);
+
+		memcpy(d->table_code, in_begin, XPRESS_NUM_SYMBOLS / 2);
+		d->tables_valid = 1;
+	}
+	use_pair_table = d->use_pair_table;
 
 	/* Decode the matches and literals.  */
 
@@ -121,6 +231,24 @@ xpress_decompress(struct xpress_decompressor *restrict d,
 		u32 length;
 		u32 offset;
 
+		if (use_pair_table) {
+			/* This reads the same bits, in the same order, as one
+			 * or two calls to read_huffsym() would.  */
+			u32 entry;
+
+			bitstream_ensure_bits(&is, XPRESS_MAX_CODEWORD_LEN);
+			entry = d->pair_table[bitstream_peek_bits(&is,
+							XPRESS_TABLEBITS)];
+			if (entry != 0 && likely(out_end - out_next >= 2)) {
+				out_next[0] = entry >> 8;
+				out_next[1] = entry >> 16;
+				out_next += entry >> PAIR_TABLE_COUNT_SHIFT;
+				bitstream_remove_bits(&is, entry &
+						      PAIR_TABLE_LENGTH_MASK);
+				continue;
+			}
+		}
+
 		sym = read_huffsym(&is, d->decode_table,
 				   XPRESS_TABLEBITS, XPRESS_MAX_CODEWORD_LEN);
 		if (sym < XPRESS_NUM_CHARS) {
@@ -154,15 +282,59 @@ xpress_decompress(struct xpress_decompressor *restrict d,
 	return 0;
 }
 
+static int
+xpress_decompress_default(struct xpress_decompressor *restrict d,
+			  const void *restrict compressed_data,
+			  size_t compressed_size,
+			  void *restrict uncompressed_data,
+			  size_t uncompressed_size)
+{
+	return xpress_decompress_template(d, compressed_data, compressed_size,
+					  uncompressed_data, uncompressed_size);
+}
+
+#if X86_CPU_DISPATCH
+static int _target_attribute("bmi2")
+xpress_decompress_bmi2(struct xpress_decompressor *restrict d,
+		       const void *restrict compressed_data,
+		       size_t compressed_size,
+		       void *restrict uncompressed_data,
+		       size_t uncompressed_size)
+{
+	return xpress_decompress_template(d, compressed_data, compressed_size,
+					  uncompressed_data, uncompressed_size);
+}
+#endif
+
+int
+xpress_decompress(struct xpress_decompressor *restrict d,
+		  const void *restrict compressed_data, size_t compressed_size,
+		  void *restrict uncompressed_data, size_t uncompressed_size)
+{
+	return (*d->decompress)(d, compressed_data, compressed_size,
+				uncompressed_data, uncompressed_size);
+}
+
 struct xpress_decompressor *
 xpress_allocate_decompressor(void)
 {
-	return aligned_malloc(sizeof(struct xpress_decompressor),
-			      DECODE_TABLE_ALIGNMENT);
+	struct xpress_decompressor *d;
+
+	d = buffer_arena_alloc(sizeof(struct xpress_decompressor));
+	if (!d)
+		return NULL;
+
+	d->tables_valid = 0;
+	d->decompress = xpress_decompress_default;
+#if X86_CPU_DISPATCH
+	if (x86_have_cpu_feature("bmi2"))
+		d->decompress = xpress_decompress_bmi2;
+#endif
+	return d;
 }
 
 void
 xpress_free_decompressor(struct xpress_decompressor *d)
 {
-	aligned_free(d);
+	buffer_arena_free(d, sizeof(*d));
 }
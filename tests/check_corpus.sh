@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Run by "make check": for each stream of the test corpus, decompress it with
+# the benchmark program, verifying the data against the original and comparing
+# the throughput with the one recorded in tests/baseline; then decompress
+# corrupted copies of its chunks.  If the libFuzzer program was built, also run
+# it briefly.
+#
+# The throughput check uses a threshold of BENCH_THRESHOLD percent, 50 by
+# default, since the baseline was measured on one machine.  Set it to 100 to
+# disable the check, for example for builds with sanitizers.
+
+srcdir=${srcdir:-.}
+threshold=${BENCH_THRESHOLD:-50}
+status=0
+
+for stream in "$srcdir"/tests/corpus/*.wof; do
+	orig=${stream%.wof}.orig
+	name=${stream##*/}
+	format=${name%.wof}
+	format=${format##*_}
+	size=$(wc -c < "$orig")
+
+	./bench -i 200 -v "$orig" -B "$srcdir/tests/baseline" -T "$threshold" \
+		"$format" $size "$stream" || status=1
+	./bench -m fuzz -i 20 "$format" $size "$stream" || status=1
+done
+
+if [ -x ./fuzz ]; then
+	./fuzz -runs=100000 -seed=1 || status=1
+fi
+
+exit $status
@@ -0,0 +1,809 @@
+/*
+ * bench.c - Benchmark program for the system compression plugin
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This program measures decompression performance on captured WofCompressedData
+ * streams, i.e. the compressed data of system-compressed files exactly as
+ * stored on disk.  It has three modes:
+ *
+ * - "chunks" mode decompresses every compressed chunk of the stream with
+ *   xpress_decompress() or lzx_decompress() directly, measuring only the
+ *   decompressor.
+ *
+ * - "read" mode replays the stream through ntfs_read_system_compressed_data(),
+ *   measuring the whole read path including chunk lookup, caching, readahead,
+ *   and parallel decompression, for a given read size and access pattern.
+ *
+ * - "fuzz" mode decompresses corrupted copies of every compressed chunk, to
+ *   check that the decompressors stay within their buffers whatever the input.
+ *
+ * A file of baseline throughputs may be given, so that runs over a set of
+ * captured streams, such as the test corpus run by "make check", can check
+ * changes to the decompressors for performance regressions.
+ *
+ * See usage() for the options.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "system_compression.h"
+
+/* The number of bytes after the output of each chunk in fuzz mode which the
+ * decompressor must leave alone  */
+#define FUZZ_GUARD_SIZE		64
+#define FUZZ_GUARD_BYTE		0xA5
+
+struct stream_info {
+	u32 format;
+	const char *format_name;
+	u32 chunk_size;
+	u64 uncompressed_size;
+	u8 *stream;
+	size_t stream_size;
+	u8 *expected;
+};
+
+/* The throughput in MB/s measured by the last call to report()  */
+static double last_mbps;
+
+struct chunk {
+	const u8 *data;
+	u32 stored_size;
+	u32 uncompressed_size;
+	u64 uncompressed_offset;
+};
+
+static const struct {
+	const char *name;
+	u32 format;
+	u32 chunk_size;
+} formats[] = {
+	{ "xpress4k",	0, 4096 },
+	{ "lzx",	1, 32768 },
+	{ "xpress8k",	2, 8192 },
+	{ "xpress16k",	3, 16384 },
+};
+
+static void
+usage(FILE *fp)
+{
+	fprintf(fp,
+"Usage: bench [OPTION...] FORMAT UNCOMPRESSED_SIZE STREAM\n"
+"\n"
+"Benchmark decompression of STREAM, the WofCompressedData stream of a\n"
+"system-compressed file whose compression format is FORMAT (xpress4k,\n"
+"xpress8k, xpress16k, or lzx) and whose uncompressed size is\n"
+"UNCOMPRESSED_SIZE bytes.\n"
+"\n"
+"Options:\n"
+"  -m MODE     'chunks' to time the decompressor on each chunk (default),\n"
+"              'read' to time reads through the plugin's read path, or\n"
+"              'fuzz' to decompress corrupted copies of each chunk\n"
+"  -i N        number of iterations over the whole stream (default 10)\n"
+"  -s SEED     seed for the corruption in fuzz mode (default 1)\n"
+"  -B FILE     file of baseline throughputs, with lines of the form\n"
+"              'STREAM MBPS' where STREAM is a file name without its\n"
+"              directory; exit with status 2 if the measured throughput is\n"
+"              lower than the one given for STREAM by more than the threshold\n"
+"  -T PERCENT  threshold for -B, in percent (default 5)\n"
+"  -v FILE     verify the decompressed data against FILE\n"
+"  -r SIZE     read size in bytes for read mode (default 131072)\n"
+"  -p PATTERN  access pattern for read mode: 'seq' (default), 'random', or\n"
+"              'reverse'\n"
+"  -c SIZE     chunk cache size in bytes for read mode (default 0)\n"
+"  -a SIZE     readahead size in bytes for read mode (default 0)\n"
+"  -t N        number of decompression threads for read mode (default 1)\n"
+"  -h          show this help\n");
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u64
+cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void
+report(const char *what, u64 bytes, u64 count, const char *count_name,
+       double seconds, u64 cycle_count)
+{
+	last_mbps = bytes / seconds / 1e6;
+	printf("%s: %llu bytes in %.3f s: %.1f MB/s, %.0f %s/s",
+	       what, (unsigned long long)bytes, seconds,
+	       last_mbps, count / seconds, count_name);
+	if (cycle_count)
+		printf(", %.2f cycles/byte", (double)cycle_count / bytes);
+	printf("\n");
+}
+
+static void *
+read_file(const char *path, size_t *size_ret)
+{
+	FILE *fp = fopen(path, "rb");
+	u8 *buf = NULL;
+	size_t size = 0, capacity = 0, n;
+
+	if (!fp) {
+		fprintf(stderr, "bench: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	do {
+		if (size == capacity) {
+			capacity = capacity ? capacity * 2 : 65536;
+			buf = realloc(buf, capacity);
+			if (!buf) {
+				fprintf(stderr, "bench: out of memory\n");
+				exit(1);
+			}
+		}
+		n = fread(buf + size, 1, capacity - size, fp);
+		size += n;
+	} while (n);
+	if (ferror(fp)) {
+		fprintf(stderr, "bench: %s: read error\n", path);
+		exit(1);
+	}
+	fclose(fp);
+	*size_ret = size;
+	return buf;
+}
+
+/* Parse a size in bytes like the plugin's options do.  On failure, return -1
+ * and set errno to EINVAL, or to ERANGE if the size is too large.  */
+static int
+parse_size(const char *str, u64 *size_ret)
+{
+	unsigned long long size;
+	unsigned shift = 0;
+	char *end;
+
+	/* strtoull() would accept and negate a leading '-'.  */
+	if (*str < '0' || *str > '9') {
+		errno = EINVAL;
+		return -1;
+	}
+	errno = 0;
+	size = strtoull(str, &end, 10);
+	if (errno)
+		return -1;
+	switch (*end) {
+	case 'G': case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M': case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K': case 'k':
+		shift += 10;
+		end++;
+		break;
+	}
+	if (*end) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (size > (UINT64_MAX >> shift)) {
+		errno = ERANGE;
+		return -1;
+	}
+	*size_ret = (u64)size << shift;
+	return 0;
+}
+
+/*
+ * Return the baseline throughput in MB/s which the file @path gives for the
+ * stream file @stream_path, or 0 if it gives none.  Each line of the file is
+ * blank, a comment starting with '#', or the name of a stream file without its
+ * directory followed by a throughput.
+ */
+static double
+read_baseline(const char *path, const char *stream_path)
+{
+	const char *stream_name = strrchr(stream_path, '/');
+	char line[256];
+	char name[256];
+	double mbps;
+	double baseline = 0;
+	FILE *fp;
+
+	stream_name = stream_name ? stream_name + 1 : stream_path;
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "bench: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		const char *p = line;
+
+		while (isspace((unsigned char)*p))
+			p++;
+		if (*p == '\0' || *p == '#')
+			continue;
+		if (sscanf(p, "%255s %lf", name, &mbps) != 2 || mbps <= 0) {
+			fprintf(stderr, "bench: %s: invalid line: %s", path,
+				line);
+			exit(1);
+		}
+		if (!strcmp(name, stream_name))
+			baseline = mbps;
+	}
+	fclose(fp);
+	return baseline;
+}
+
+static u64
+parse_size_or_die(const char *str)
+{
+	u64 size;
+
+	if (parse_size(str, &size)) {
+		fprintf(stderr, "bench: invalid size: \"%s\": %s\n", str,
+			strerror(errno));
+		exit(1);
+	}
+	return size;
+}
+
+/* Split the stream into its chunks, using its chunk offset table.  */
+static struct chunk *
+get_chunks(const struct stream_info *info, u64 *num_chunks_ret)
+{
+	const u64 num_chunks = (info->uncompressed_size + info->chunk_size - 1) /
+			       info->chunk_size;
+	const int entry_size = (info->uncompressed_size <= UINT32_MAX) ? 4 : 8;
+	const u64 table_size = num_chunks ? (num_chunks - 1) * entry_size : 0;
+	struct chunk *chunks;
+	u64 offset = table_size;
+	u64 i;
+
+	if (table_size > info->stream_size) {
+		fprintf(stderr, "bench: stream is too short for its chunk "
+			"table\n");
+		exit(1);
+	}
+	chunks = calloc(num_chunks ? num_chunks : 1, sizeof(chunks[0]));
+	if (!chunks) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < num_chunks; i++) {
+		u64 next_offset;
+
+		if (i == num_chunks - 1) {
+			next_offset = info->stream_size;
+		} else {
+			const u8 *entry = info->stream + i * entry_size;
+
+			next_offset = table_size + (entry_size == 8 ?
+				le64_to_cpu(*(const le64 *)entry) :
+				le32_to_cpu(*(const le32 *)entry));
+		}
+		chunks[i].uncompressed_offset = i * info->chunk_size;
+		chunks[i].uncompressed_size =
+			min((u64)info->chunk_size,
+			    info->uncompressed_size -
+				chunks[i].uncompressed_offset);
+		if (next_offset < offset || next_offset > info->stream_size ||
+		    next_offset - offset > chunks[i].uncompressed_size ||
+		    next_offset == offset) {
+			fprintf(stderr, "bench: invalid chunk table entry for "
+				"chunk %llu\n", (unsigned long long)i);
+			exit(1);
+		}
+		chunks[i].data = info->stream + offset;
+		chunks[i].stored_size = next_offset - offset;
+		offset = next_offset;
+	}
+	*num_chunks_ret = num_chunks;
+	return chunks;
+}
+
+static int
+bench_chunks(const struct stream_info *info, unsigned iterations)
+{
+	const int is_lzx = (info->format == 1);
+	struct xpress_decompressor *xpress = NULL;
+	struct lzx_decompressor *lzx = NULL;
+	struct chunk *chunks;
+	u64 num_chunks, num_compressed = 0, compressed_bytes = 0;
+	u64 bytes = 0, count = 0, cycle_count;
+	u8 *out;
+	double start;
+	unsigned iter;
+	u64 i;
+
+	chunks = get_chunks(info, &num_chunks);
+	for (i = 0; i < num_chunks; i++) {
+		if (chunks[i].stored_size != chunks[i].uncompressed_size) {
+			num_compressed++;
+			compressed_bytes += chunks[i].uncompressed_size;
+		}
+	}
+	printf("%s: %llu chunks, %llu stored compressed (%llu bytes "
+	       "uncompressed)\n", info->format_name,
+	       (unsigned long long)num_chunks,
+	       (unsigned long long)num_compressed,
+	       (unsigned long long)compressed_bytes);
+	if (!num_compressed)
+		return 0;
+
+	if (is_lzx)
+		lzx = lzx_allocate_decompressor(32768);
+	else
+		xpress = xpress_allocate_decompressor();
+	out = malloc(info->chunk_size);
+	if ((!lzx && !xpress) || !out) {
+		fprintf(stderr, "bench: out of memory\n");
+		return 1;
+	}
+
+	start = now();
+	cycle_count = cycles();
+	for (iter = 0; iter < iterations; iter++) {
+		for (i = 0; i < num_chunks; i++) {
+			const struct chunk *c = &chunks[i];
+			int res;
+
+			if (c->stored_size == c->uncompressed_size)
+				continue;
+			if (is_lzx)
+				res = lzx_decompress(lzx, c->data,
+						     c->stored_size, out,
+						     c->uncompressed_size);
+			else
+				res = xpress_decompress(xpress, c->data,
+							c->stored_size, out,
+							c->uncompressed_size);
+			if (res) {
+				fprintf(stderr, "bench: chunk %llu failed to "
+					"decompress\n", (unsigned long long)i);
+				return 1;
+			}
+			if (iter == 0 && info->expected &&
+			    memcmp(out, info->expected +
+					c->uncompressed_offset,
+				   c->uncompressed_size)) {
+				fprintf(stderr, "bench: chunk %llu decompressed "
+					"incorrectly\n", (unsigned long long)i);
+				return 1;
+			}
+			bytes += c->uncompressed_size;
+			count++;
+		}
+	}
+	cycle_count = cycles() - cycle_count;
+	report(info->format_name, bytes, count, "chunks", now() - start,
+	       cycle_count);
+
+	lzx_free_decompressor(lzx);
+	xpress_free_decompressor(xpress);
+	free(out);
+	free(chunks);
+	return 0;
+}
+
+static u64
+next_random(u64 *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* Corrupt the @size bytes at @data in one of several ways, and return the new
+ * size, which may be smaller.  */
+static u32
+corrupt(u8 *data, u32 size, u64 *rng)
+{
+	u32 i, n, pos;
+
+	switch (next_random(rng) % 4) {
+	case 0:
+		/* Flip a few bits.  */
+		n = 1 + next_random(rng) % 8;
+		for (i = 0; i < n; i++)
+			data[next_random(rng) % size] ^=
+				1 << (next_random(rng) % 8);
+		return size;
+	case 1:
+		/* Truncate the data, so that the bitstream is overrun.  */
+		return next_random(rng) % size;
+	case 2:
+		/* Overwrite a few bytes with random bytes.  */
+		pos = next_random(rng) % size;
+		n = 1 + next_random(rng) % 16;
+		n = min(n, size - pos);
+		for (i = 0; i < n; i++)
+			data[pos + i] = next_random(rng);
+		return size;
+	default:
+		/* Overwrite a few bytes with all zeroes or all ones.  */
+		pos = next_random(rng) % size;
+		n = 1 + next_random(rng) % 16;
+		n = min(n, size - pos);
+		memset(&data[pos], (next_random(rng) & 1) ? 0xFF : 0, n);
+		return size;
+	}
+}
+
+static int
+decompress_chunk(int is_lzx, void *decompressor, const void *in, u32 in_size,
+		 void *out, u32 out_size)
+{
+	if (is_lzx)
+		return lzx_decompress(decompressor, in, in_size, out, out_size);
+	return xpress_decompress(decompressor, in, in_size, out, out_size);
+}
+
+/*
+ * Decompress @iterations corrupted copies of each compressed chunk.  The
+ * decompressors must never read past the end of their input, which they treat
+ * as followed by zeroes, nor write past the end of their output, which in
+ * parallel decompression is the next chunk.  Each copy is decompressed from a
+ * buffer of exactly its size, so a build with -fsanitize=address catches reads
+ * past the end, and is followed by guard bytes which are checked afterwards.
+ * After each copy, the original chunk is decompressed again with the same
+ * decompressor, which must give the same data as before: a corrupted chunk
+ * mustn't break the decode tables reused between chunks.  The corruption comes
+ * from a generator seeded by @seed, so failures can be reproduced.
+ */
+static int
+bench_fuzz(const struct stream_info *info, unsigned iterations, u64 seed)
+{
+	const int is_lzx = (info->format == 1);
+	void *decompressor;
+	struct chunk *chunks;
+	u64 num_chunks, num_corrupted = 0, num_accepted = 0;
+	u64 rng = seed ? seed : 1;
+	u8 *out, *good;
+	unsigned iter;
+	u64 i;
+
+	chunks = get_chunks(info, &num_chunks);
+	if (is_lzx)
+		decompressor = lzx_allocate_decompressor(32768);
+	else
+		decompressor = xpress_allocate_decompressor();
+	out = malloc(info->chunk_size + FUZZ_GUARD_SIZE);
+	good = malloc(info->chunk_size);
+	if (!decompressor || !out || !good) {
+		fprintf(stderr, "bench: out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < num_chunks; i++) {
+		const struct chunk *c = &chunks[i];
+
+		if (c->stored_size == c->uncompressed_size)
+			continue;
+		if (decompress_chunk(is_lzx, decompressor, c->data,
+				     c->stored_size, good,
+				     c->uncompressed_size)) {
+			fprintf(stderr, "bench: chunk %llu failed to "
+				"decompress\n", (unsigned long long)i);
+			return 1;
+		}
+		if (info->expected &&
+		    memcmp(good, info->expected + c->uncompressed_offset,
+			   c->uncompressed_size)) {
+			fprintf(stderr, "bench: chunk %llu decompressed "
+				"incorrectly\n", (unsigned long long)i);
+			return 1;
+		}
+
+		for (iter = 0; iter < iterations; iter++) {
+			u8 *in = malloc(c->stored_size);
+			u32 in_size;
+			u32 j;
+
+			if (!in) {
+				fprintf(stderr, "bench: out of memory\n");
+				return 1;
+			}
+			memcpy(in, c->data, c->stored_size);
+			in_size = corrupt(in, c->stored_size, &rng);
+			memset(out + c->uncompressed_size, FUZZ_GUARD_BYTE,
+			       FUZZ_GUARD_SIZE);
+
+			if (!decompress_chunk(is_lzx, decompressor, in,
+					      in_size, out,
+					      c->uncompressed_size))
+				num_accepted++;
+			num_corrupted++;
+			free(in);
+
+			for (j = 0; j < FUZZ_GUARD_SIZE; j++) {
+				if (out[c->uncompressed_size + j] !=
+				    FUZZ_GUARD_BYTE) {
+					fprintf(stderr, "bench: corrupted copy "
+						"%u of chunk %llu overran the "
+						"output (seed %llu)\n", iter,
+						(unsigned long long)i,
+						(unsigned long long)seed);
+					return 1;
+				}
+			}
+
+			if (decompress_chunk(is_lzx, decompressor, c->data,
+					     c->stored_size, out,
+					     c->uncompressed_size) ||
+			    memcmp(out, good, c->uncompressed_size)) {
+				fprintf(stderr, "bench: chunk %llu decompressed "
+					"differently after corrupted copy %u "
+					"(seed %llu)\n", (unsigned long long)i,
+					iter, (unsigned long long)seed);
+				return 1;
+			}
+		}
+	}
+	printf("%s: %llu corrupted chunks decompressed, %llu without error\n",
+	       info->format_name, (unsigned long long)num_corrupted,
+	       (unsigned long long)num_accepted);
+
+	if (is_lzx)
+		lzx_free_decompressor(decompressor);
+	else
+		xpress_free_decompressor(decompressor);
+	free(good);
+	free(out);
+	free(chunks);
+	return 0;
+}
+
+enum pattern {
+	PATTERN_SEQUENTIAL,
+	PATTERN_RANDOM,
+	PATTERN_REVERSE,
+};
+
+static int
+bench_reads(const struct stream_info *info, unsigned iterations,
+	    u64 read_size, enum pattern pattern)
+{
+	const u64 num_reads = (info->uncompressed_size + read_size - 1) /
+			      read_size;
+	struct bench_file file;
+	u64 bytes = 0, count = 0, cycle_count;
+	u64 rng = 0x2545F4914F6CDD1DULL;
+	u8 *buf;
+	double start;
+	unsigned iter;
+	u64 i;
+
+	bench_file_init(&file, info->format, info->uncompressed_size,
+			info->stream, info->stream_size);
+
+	buf = malloc(read_size);
+	if (!buf) {
+		fprintf(stderr, "bench: out of memory\n");
+		return 1;
+	}
+
+	start = now();
+	cycle_count = cycles();
+	for (iter = 0; iter < iterations; iter++) {
+		struct ntfs_system_decompression_ctx *ctx;
+
+		ctx = ntfs_open_system_decompression_ctx(&file.ni,
+							 &file.reparse.header);
+		if (!ctx) {
+			fprintf(stderr, "bench: can't open stream: %s\n",
+				strerror(errno));
+			return 1;
+		}
+		for (i = 0; i < num_reads; i++) {
+			u64 pos;
+			ssize_t res;
+
+			switch (pattern) {
+			case PATTERN_RANDOM:
+				pos = (next_random(&rng) % num_reads) *
+				      read_size;
+				break;
+			case PATTERN_REVERSE:
+				pos = (num_reads - 1 - i) * read_size;
+				break;
+			default:
+				pos = i * read_size;
+				break;
+			}
+			res = ntfs_read_system_compressed_data(ctx, &file.ni,
+							       pos, read_size,
+							       buf);
+			if (res <= 0) {
+				fprintf(stderr, "bench: read at %llu failed: "
+					"%s\n", (unsigned long long)pos,
+					res ? strerror(errno) :
+					      "unexpected end of file");
+				return 1;
+			}
+			if (iter == 0 && info->expected &&
+			    memcmp(buf, info->expected + pos, res)) {
+				fprintf(stderr, "bench: read at %llu returned "
+					"incorrect data\n",
+					(unsigned long long)pos);
+				return 1;
+			}
+			bytes += res;
+			count++;
+		}
+		ntfs_close_system_decompression_ctx(ctx);
+	}
+	cycle_count = cycles() - cycle_count;
+	report(info->format_name, bytes, count, "reads", now() - start,
+	       cycle_count);
+	printf("%s: %lu reads of the compressed stream\n", info->format_name,
+	       bench_pread_calls);
+	free(buf);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct stream_info info = { 0 };
+	const char *mode = "chunks";
+	const char *verify_file = NULL;
+	unsigned iterations = 10;
+	u64 read_size = 131072;
+	enum pattern pattern = PATTERN_SEQUENTIAL;
+	u64 seed = 1;
+	const char *baseline_file = NULL;
+	double baseline = 0;
+	double threshold = 5;
+	size_t i;
+	int ret;
+	int c;
+
+	/* The chunk cache would turn repeated iterations into cache hits, so
+	 * it's disabled unless requested.  */
+	ntfs_set_system_decompression_cache_size(0);
+
+	while ((c = getopt(argc, argv, "m:i:v:r:p:c:a:t:s:B:T:h")) != -1) {
+		switch (c) {
+		case 'm':
+			mode = optarg;
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'v':
+			verify_file = optarg;
+			break;
+		case 'r':
+			read_size = parse_size_or_die(optarg);
+			break;
+		case 'p':
+			if (!strcmp(optarg, "seq")) {
+				pattern = PATTERN_SEQUENTIAL;
+			} else if (!strcmp(optarg, "random")) {
+				pattern = PATTERN_RANDOM;
+			} else if (!strcmp(optarg, "reverse")) {
+				pattern = PATTERN_REVERSE;
+			} else {
+				fprintf(stderr, "bench: unknown access "
+					"pattern: \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c':
+			ntfs_set_system_decompression_cache_size(
+					parse_size_or_die(optarg));
+			break;
+		case 'a':
+			ntfs_set_system_decompression_readahead(
+					parse_size_or_die(optarg));
+			break;
+		case 't':
+			ntfs_set_system_decompression_threads(atoi(optarg));
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'B':
+			baseline_file = optarg;
+			break;
+		case 'T':
+			threshold = atof(optarg);
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 3 || iterations == 0 || read_size == 0) {
+		usage(stderr);
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		if (!strcmp(argv[0], formats[i].name)) {
+			info.format = formats[i].format;
+			info.format_name = formats[i].name;
+			info.chunk_size = formats[i].chunk_size;
+		}
+	}
+	if (!info.format_name) {
+		fprintf(stderr, "bench: unknown format: \"%s\"\n", argv[0]);
+		return 1;
+	}
+	info.uncompressed_size = parse_size_or_die(argv[1]);
+	info.stream = read_file(argv[2], &info.stream_size);
+	if (baseline_file)
+		baseline = read_baseline(baseline_file, argv[2]);
+
+	if (verify_file) {
+		size_t size;
+
+		info.expected = read_file(verify_file, &size);
+		if (size != info.uncompressed_size) {
+			fprintf(stderr, "bench: %s has the wrong size\n",
+				verify_file);
+			return 1;
+		}
+	}
+
+	if (!strcmp(mode, "chunks")) {
+		ret = bench_chunks(&info, iterations);
+	} else if (!strcmp(mode, "read")) {
+		ret = bench_reads(&info, iterations, read_size, pattern);
+	} else if (!strcmp(mode, "fuzz")) {
+		return bench_fuzz(&info, iterations, seed);
+	} else {
+		fprintf(stderr, "bench: unknown mode: \"%s\"\n", mode);
+		return 1;
+	}
+
+	/* A stream with no compressed chunks has nothing to measure.  */
+	if (ret == 0 && baseline > 0 && last_mbps > 0 &&
+	    last_mbps < baseline * (1 - threshold / 100)) {
+		fprintf(stderr, "bench: %.1f MB/s is more than %g%% below the "
+			"baseline of %.1f MB/s\n", last_mbps, threshold,
+			baseline);
+		return 2;
+	}
+	return ret;
+}
@@ -0,0 +1,41 @@
+/*
+ * bench.h
+ *
+ * Declarations for the in-memory stand-in for the parts of libntfs-3g which the
+ * benchmark program needs.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <ntfs-3g/attrib.h>
+#include <ntfs-3g/inode.h>
+#include <ntfs-3g/layout.h>
+
+/* The reparse point of a system-compressed file  */
+struct bench_reparse_point {
+	REPARSE_POINT header;
+	le32 wof_version;
+	le32 wof_provider;
+	le32 file_version;
+	le32 compression_format;
+} __attribute__((packed));
+
+/* A system-compressed file whose WofCompressedData stream is held in memory.
+ * The inode must be first.  */
+struct bench_file {
+	ntfs_inode ni;
+	MFT_RECORD mrec;
+	ATTR_RECORD attr;
+	struct bench_reparse_point reparse;
+	const u8 *stream;
+	size_t stream_size;
+};
+
+extern void
+bench_file_init(struct bench_file *file, u32 compression_format,
+		u64 uncompressed_size, const void *stream, size_t stream_size);
+
+extern unsigned long bench_pread_calls;
+
+#endif /* _BENCH_H */
@@ -0,0 +1,226 @@
+/*
+ * bench_ntfs.c - In-memory stand-in for libntfs-3g used by the benchmark
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The benchmark program replays captured WofCompressedData streams through
+ * ntfs_read_system_compressed_data() without an NTFS volume, so that it can be
+ * built and run without linking to libntfs-3g or FUSE.  This file provides the
+ * few libntfs-3g functions which the plugin's read path calls, operating on a
+ * 'struct bench_file' that holds the stream in memory.  Only the headers of
+ * libntfs-3g are needed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ntfs-3g/device.h>
+#include <ntfs-3g/misc.h>
+
+#include "bench.h"
+
+ntfschar AT_UNNAMED[] = { const_cpu_to_le16('\0') };
+
+unsigned long bench_pread_calls;
+
+static ntfs_volume bench_volume;
+
+static struct bench_file *
+inode_to_file(ntfs_inode *ni)
+{
+	return (struct bench_file *)ni;
+}
+
+void
+bench_file_init(struct bench_file *file, u32 compression_format,
+		u64 uncompressed_size, const void *stream, size_t stream_size)
+{
+	memset(file, 0, sizeof(*file));
+
+	file->ni.mft_no = 64;
+	file->ni.mrec = &file->mrec;
+	file->ni.vol = &bench_volume;
+	file->ni.flags = FILE_ATTR_REPARSE_POINT | FILE_ATTR_SPARSE_FILE;
+	file->ni.data_size = uncompressed_size;
+	file->mrec.sequence_number = cpu_to_le16(1);
+
+	file->reparse.header.reparse_tag = IO_REPARSE_TAG_WOF;
+	file->reparse.header.reparse_data_length =
+		cpu_to_le16(sizeof(file->reparse) - sizeof(REPARSE_POINT));
+	file->reparse.wof_version = cpu_to_le32(1);
+	file->reparse.wof_provider = cpu_to_le32(2);
+	file->reparse.file_version = cpu_to_le32(1);
+	file->reparse.compression_format = cpu_to_le32(compression_format);
+
+	file->stream = stream;
+	file->stream_size = stream_size;
+}
+
+void *
+ntfs_malloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p)
+		errno = ENOMEM;
+	return p;
+}
+
+void *
+ntfs_calloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (!p)
+		errno = ENOMEM;
+	return p;
+}
+
+ntfs_attr *
+ntfs_attr_open(ntfs_inode *ni, const ATTR_TYPES type, ntfschar *name,
+	       u32 name_len)
+{
+	ntfs_attr *na;
+
+	if (type != AT_DATA || name_len == 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+	na = ntfs_calloc(sizeof(*na));
+	if (!na)
+		return NULL;
+	na->ni = ni;
+	na->type = type;
+	na->data_size = inode_to_file(ni)->stream_size;
+	na->initialized_size = na->data_size;
+	na->allocated_size = na->data_size;
+	return na;
+}
+
+void
+ntfs_attr_close(ntfs_attr *na)
+{
+	free(na);
+}
+
+s64
+ntfs_attr_pread(ntfs_attr *na, const s64 pos, s64 count, void *b)
+{
+	const struct bench_file *file = inode_to_file(na->ni);
+
+	bench_pread_calls++;
+	if (pos < 0 || count < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((u64)pos >= file->stream_size)
+		return 0;
+	if ((u64)count > file->stream_size - pos)
+		count = file->stream_size - pos;
+	memcpy(b, file->stream + pos, count);
+	return count;
+}
+
+/* The stream is resident as far as the plugin can tell, so it's never read
+ * directly from the device; these are just needed to link.  */
+int
+ntfs_attr_map_whole_runlist(ntfs_attr *na)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+s64
+ntfs_pread(struct ntfs_device *dev, const s64 pos, s64 count, void *b)
+{
+	errno = EIO;
+	return -1;
+}
+
+void *
+ntfs_attr_readall(ntfs_inode *ni, const ATTR_TYPES type, ntfschar *name,
+		  u32 name_len, s64 *data_size)
+{
+	const struct bench_file *file = inode_to_file(ni);
+	void *p;
+
+	if (type != AT_REPARSE_POINT) {
+		errno = ENOENT;
+		return NULL;
+	}
+	p = ntfs_malloc(sizeof(file->reparse));
+	if (!p)
+		return NULL;
+	memcpy(p, &file->reparse, sizeof(file->reparse));
+	*data_size = sizeof(file->reparse);
+	return p;
+}
+
+/* Search contexts only ever look up the WofCompressedData stream, which is
+ * represented by the file's 'attr'.  */
+struct bench_search_ctx {
+	ntfs_attr_search_ctx actx;
+	struct bench_file *file;
+};
+
+ntfs_attr_search_ctx *
+ntfs_attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mrec)
+{
+	struct bench_search_ctx *ctx = ntfs_calloc(sizeof(*ctx));
+
+	if (!ctx)
+		return NULL;
+	ctx->file = inode_to_file(ni);
+	ctx->actx.mrec = &ctx->file->mrec;
+	return &ctx->actx;
+}
+
+void
+ntfs_attr_put_search_ctx(ntfs_attr_search_ctx *actx)
+{
+	free(actx);
+}
+
+int
+ntfs_attr_lookup(const ATTR_TYPES type, const ntfschar *name,
+		 const u32 name_len, const IGNORE_CASE_BOOL ic,
+		 const VCN lowest_vcn, const u8 *val, const u32 val_len,
+		 ntfs_attr_search_ctx *actx)
+{
+	struct bench_search_ctx *ctx = (struct bench_search_ctx *)actx;
+
+	if (type != AT_DATA || name_len == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	actx->attr = &ctx->file->attr;
+	return 0;
+}
+
+s64
+ntfs_get_attribute_value_length(const ATTR_RECORD *a)
+{
+	const struct bench_file *file = (const struct bench_file *)
+		((const u8 *)a - offsetof(struct bench_file, attr));
+
+	return file->stream_size;
+}
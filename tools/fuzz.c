@@ -0,0 +1,76 @@
+/*
+ * fuzz.c - libFuzzer entry point for the decompressors
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is built by "make check" only if the compiler supports
+ * -fsanitize=fuzzer, as clang does.  Each input is one chunk: its first byte
+ * selects the compression format (low 2 bits) and the uncompressed size (the
+ * other 6 bits, in 64ths of the chunk size, with 0 meaning the whole chunk),
+ * and the rest is the compressed data.  The output buffer is allocated with
+ * exactly the uncompressed size, so that AddressSanitizer catches writes past
+ * its end.  Whether the data decompresses doesn't matter, only that the
+ * decompressor stays within its buffers.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "system_compression.h"
+
+/* The chunk order of each format: XPRESS4K, LZX, XPRESS8K, XPRESS16K  */
+static const unsigned chunk_orders[4] = { 12, 15, 13, 14 };
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static struct xpress_decompressor *xpress;
+	static struct lzx_decompressor *lzx;
+	unsigned format;
+	size_t chunk_size, out_size;
+	u8 *out;
+
+	if (size < 1)
+		return 0;
+
+	format = data[0] & 3;
+	chunk_size = (size_t)1 << chunk_orders[format];
+	out_size = chunk_size * (data[0] >> 2) / 64;
+	if (out_size == 0)
+		out_size = chunk_size;
+	data++;
+	size--;
+
+	if (!xpress)
+		xpress = xpress_allocate_decompressor();
+	if (!lzx)
+		lzx = lzx_allocate_decompressor(32768);
+	out = malloc(out_size);
+	if (!xpress || !lzx || !out)
+		abort();
+
+	if (format == 1)
+		lzx_decompress(lzx, data, size, out, out_size);
+	else
+		xpress_decompress(xpress, data, size, out, out_size);
+
+	free(out);
+	return 0;
+}